@@ -0,0 +1,385 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "harness.hpp"
+#include "../src/sipm.hpp"
+#include "../src/utilities.hpp"
+#include "../src/perfcounters.hpp"
+
+using namespace std;
+
+// Private SiPM kernels (LUT lookups, random draws), for timing on their own.
+struct SiPMBench
+{
+    static double pde_LUT(const SiPM &s, double x) { return s.pde_LUT(x); }
+    static double volt_LUT(const SiPM &s, double x) { return s.volt_LUT(x); }
+    static double unif_double(SiPM &s) { return s.unif_rand_double(0, 1); }
+    static unsigned long unif_int(SiPM &s) { return s.unif_rand_int(0, s.numMicrocell); }
+    static int poisson(SiPM &s, double lambda) { return poisson_distribution<int>(lambda)(s.poissonEngine); }
+};
+
+// The device of test/performance.hpp: a J30020-like SiPM at dt = 0.2 ns.
+static SiPM bench_device(unsigned long numMicrocell)
+{
+    SiPM sipm(numMicrocell, 27.5, 24.5, 2.2 * 14e-9, 0.0, 4.6e-14, 2.04, 0.46);
+    sipm.dt = 2.0e-10;
+    sipm.seed(1);
+    return sipm;
+}
+
+volatile double benchSink; // keeps results alive
+
+struct Options
+{
+    int reps = 15;
+    int warmup = 2;
+    string filter;
+    string out;
+    string baseline;
+    string cli;
+    double threshold = 0.03; // smallest relative change worth a verdict
+    double alpha = 0.01;     // significance level
+};
+
+static bool selected(const Options &opt, const string &name)
+{
+    return opt.filter.empty() || name.find(opt.filter) != string::npos;
+}
+
+static vector<BenchResult> run_all(const Options &opt)
+{
+    vector<BenchResult> results;
+    auto add = [&](const string &name, const string &unit, double items, int reps, const function<void()> &body)
+    {
+        if (!selected(opt, name))
+        {
+            return;
+        }
+        results.push_back(run_bench(name, unit, items, opt.warmup, reps, body));
+        const BenchResult &r = results.back();
+        cout << left << setw(44) << r.name << right << fixed << setprecision(3) << setw(12) << r.percentile(50)
+             << " " << setw(10) << r.unit << "  p90 " << setw(10) << r.percentile(90) << "  cv "
+             << setprecision(1) << setw(5) << 100.0 * r.stdev() / r.mean() << "%" << endl;
+    };
+
+    // Hardware events over `reps` more runs of the body, per microcell-step,
+    // attached to the last result (where the machine has the counters).
+    PerfCounters perf;
+    if (!perf.available())
+    {
+        cout << "(hardware counters unavailable: " << perf.error() << ")" << endl;
+    }
+    auto count_events = [&](double cellSteps, int reps, const function<void()> &body)
+    {
+        if (!perf.available() || results.empty())
+        {
+            return;
+        }
+        perf.reset();
+        perf.start();
+        for (int i = 0; i < reps; i++)
+        {
+            body();
+        }
+        perf.stop();
+        PerfCounters::Reading reading = perf.read();
+        BenchResult &r = results.back();
+        r.counterUnit = "per cell-step";
+        cout << setw(46) << "";
+        for (int c = 0; c < PerfCounters::COUNTERS; c++)
+        {
+            if (reading.valid[c])
+            {
+                double v = reading.value[c] / (cellSteps * reps);
+                r.counters.emplace_back(PerfCounters::name((PerfCounters::Counter)c), v);
+                cout << PerfCounters::name((PerfCounters::Counter)c) << " " << defaultfloat << setprecision(3) << v << "  ";
+            }
+        }
+        cout << endl;
+    };
+
+    // simulate_microcells (through simulate_chunk) at steady state.
+    for (unsigned long cells : {1000UL, 14410UL, 100000UL})
+    {
+        for (double flux : {0.0, 1.0, 10.0, 100.0, 1000.0})
+        {
+            string name = "simulate_microcells/cells=" + to_string(cells) + "/flux=" + to_string((int)flux);
+            if (!selected(opt, name))
+            {
+                continue;
+            }
+            SiPM sipm = bench_device(cells);
+            sipm.init_state(flux, 1000000);
+            size_t n = flux <= 10.0 ? 20000 : flux <= 100.0 ? 5000 : 1000;
+            vector<double> in(n, flux), out(n);
+            auto body = [&]
+            {
+                sipm.simulate_chunk(in.data(), out.data(), n);
+                benchSink = out[n - 1];
+            };
+            add(name, "ns/step", (double)n, opt.reps, body);
+            count_events((double)n * (double)cells, opt.reps, body);
+        }
+    }
+    // The other recovery models, against the LUT above.
+    for (Recovery model : {Recovery::Exact, Recovery::FastExp})
+    {
+        for (double flux : {10.0, 100.0})
+        {
+            string name = string("simulate_microcells/") + (model == Recovery::Exact ? "exact" : "fast") +
+                          "/cells=14410/flux=" + to_string((int)flux);
+            if (!selected(opt, name))
+            {
+                continue;
+            }
+            SiPM sipm = bench_device(14410);
+            sipm.set_recovery(model);
+            sipm.init_state(flux, 1000000);
+            size_t n = flux <= 10.0 ? 20000 : 5000;
+            vector<double> in(n, flux), out(n);
+            add(name, "ns/step", (double)n, opt.reps, [&]
+                {
+                    sipm.simulate_chunk(in.data(), out.data(), n);
+                    benchSink = out[n - 1];
+                });
+        }
+    }
+
+    // Lookup tables, over ages spanning the recovery.
+    {
+        SiPM sipm = bench_device(14410);
+        const size_t n = 1000000;
+        vector<double> ages(n);
+        mt19937_64 rng(2);
+        uniform_real_distribution<double> age(0.0, 5.0 * sipm.tauRecovery);
+        for (double &a : ages)
+        {
+            a = age(rng);
+        }
+        // Sum n results of f(i), so none is optimised away.
+        auto sum = [&](auto f)
+        {
+            double s = 0.0;
+            for (size_t i = 0; i < n; i++)
+            {
+                s += f(i);
+            }
+            benchSink = s;
+        };
+        add("lut/pde", "ns/lookup", (double)n, opt.reps, [&]
+            { sum([&](size_t i)
+                  { return SiPMBench::pde_LUT(sipm, ages[i]); }); });
+        add("lut/volt", "ns/lookup", (double)n, opt.reps, [&]
+            { sum([&](size_t i)
+                  { return SiPMBench::volt_LUT(sipm, ages[i]); }); });
+
+        // Random draws as simulate_microcells makes them.
+        add("rng/uniform_double", "ns/draw", (double)n, opt.reps, [&]
+            { sum([&](size_t)
+                  { return SiPMBench::unif_double(sipm); }); });
+        add("rng/uniform_cell", "ns/draw", (double)n, opt.reps, [&]
+            { sum([&](size_t)
+                  { return (double)SiPMBench::unif_int(sipm); }); });
+        add("rng/poisson/lambda=10", "ns/draw", (double)n, opt.reps, [&]
+            { sum([&](size_t)
+                  { return (double)SiPMBench::poisson(sipm, 10.0); }); });
+    }
+
+    // Seeding the microcell ages.
+    for (double flux : {1.0, 100.0})
+    {
+        SiPM sipm = bench_device(14410);
+        add("init_state/cells=14410/flux=" + to_string((int)flux), "us/call", 1000.0, opt.reps, [&]
+            { sipm.init_state(flux, 1000000); });
+    }
+
+    // Output shaping.
+    {
+        SiPM sipm = bench_device(14410);
+        vector<double> signal(1 << 16);
+        mt19937_64 rng(3);
+        poisson_distribution<int> counts(0.5);
+        for (double &v : signal)
+        {
+            v = counts(rng) * sipm.cCell;
+        }
+        vector<double> kernel = get_gaussian(sipm.dt, 1.5e-9);
+        add("conv1d/kernel=" + to_string(kernel.size()), "ns/sample", (double)signal.size(), opt.reps, [&]
+            { benchSink = conv1d(signal, kernel).back(); });
+    }
+
+    // .npy streaming throughput, in the CLI's 65536-sample blocks.
+    {
+        const size_t n = 1 << 22, chunk = 1 << 16;
+        const string path = "/tmp/simspad-bench-" + to_string(getpid()) + ".npy";
+        vector<double> buf(chunk, 1.0);
+        add("npy/write", "ns/sample", (double)n, opt.reps, [&]
+            {
+                NpyWriter writer(path, n);
+                for (size_t at = 0; at < n; at += chunk)
+                {
+                    writer.write(buf.data(), chunk);
+                }
+                writer.close();
+            });
+        add("npy/read", "ns/sample", (double)n, opt.reps, [&]
+            {
+                NpyReader reader(path);
+                double s = 0.0;
+                while (reader.read(buf.data(), chunk) > 0)
+                {
+                    s += buf[0];
+                }
+                benchSink = s;
+            });
+        remove(path.c_str());
+    }
+
+    // A whole CLI run: parameters and input from disk, response to disk.
+    if (!opt.cli.empty() && selected(opt, "cli"))
+    {
+        const size_t n = 200000;
+        const string stem = "/tmp/simspad-bench-cli-" + to_string(getpid());
+        SiPM sipm = bench_device(14410);
+        save_params_json(stem + ".json", sipm);
+        {
+            NpyWriter writer(stem + "-in.npy", n);
+            vector<double> in(n, 10.0);
+            writer.write(in.data(), n);
+            writer.close();
+        }
+        const string command = opt.cli + " -s -p " + stem + ".json -i " + stem + "-in.npy -o " + stem +
+                               "-out.npy > /dev/null 2>&1";
+        bool failed = false;
+        add("cli/cells=14410/flux=10", "ns/step", (double)n, max(3, opt.reps / 3), [&]
+            { failed = failed || system(command.c_str()) != 0; });
+        if (failed)
+        {
+            cerr << "[WARN] the CLI run failed: " << command << endl;
+        }
+        for (const char *suffix : {".json", "-in.npy", "-out.npy"})
+        {
+            remove((stem + suffix).c_str());
+        }
+    }
+    return results;
+}
+
+// Welch's t-test of each benchmark against the baseline run. A change counts
+// only when it is both significant at `alpha` and larger than `threshold`.
+static bool compare(const Options &opt, const vector<BenchResult> &results)
+{
+    vector<BenchResult> baseline = read_results(opt.baseline);
+    if (baseline.empty())
+    {
+        cout << "No baseline at " << opt.baseline << " (make bench-baseline stores one)." << endl;
+        return true;
+    }
+    cout << defaultfloat << "\nAgainst " << opt.baseline << " (Welch's t-test, alpha " << opt.alpha << ", threshold "
+         << 100.0 * opt.threshold << "%):" << endl;
+    int regressions = 0;
+    for (const BenchResult &r : results)
+    {
+        auto base = find_if(baseline.begin(), baseline.end(), [&](const BenchResult &b)
+                            { return b.name == r.name && b.unit == r.unit; });
+        if (base == baseline.end())
+        {
+            continue;
+        }
+        double change = r.mean() / base->mean() - 1.0;
+        double p = welch_p_value(r, *base);
+        string verdict = "same";
+        if (p < opt.alpha && fabs(change) > opt.threshold)
+        {
+            verdict = change > 0 ? "\033[31;49;1mREGRESSION\033[0m" : "\033[32;49;1mfaster\033[0m";
+            regressions += change > 0;
+        }
+        cout << left << setw(44) << r.name << right << showpos << fixed << setprecision(1) << setw(8)
+             << 100.0 * change << "%" << noshowpos << "  p " << scientific << setprecision(1) << p << "  "
+             << verdict << endl;
+    }
+    cout << (regressions ? "\033[31;49;1m" : "\033[32;49;1m") << regressions << " regression(s)\033[0m" << endl;
+    return regressions == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--reps" && !value.empty())
+        {
+            opt.reps = max(2, atoi(value.c_str()));
+        }
+        else if (arg == "--warmup" && !value.empty())
+        {
+            opt.warmup = max(0, atoi(value.c_str()));
+        }
+        else if (arg == "--filter" && !value.empty())
+        {
+            opt.filter = value;
+        }
+        else if (arg == "--out" && !value.empty())
+        {
+            opt.out = value;
+        }
+        else if (arg == "--baseline" && !value.empty())
+        {
+            opt.baseline = value;
+        }
+        else if (arg == "--cli" && !value.empty())
+        {
+            opt.cli = value;
+        }
+        else if (arg == "--threshold" && !value.empty())
+        {
+            opt.threshold = atof(value.c_str()) / 100.0;
+        }
+        else
+        {
+            cerr << "usage: bench [--reps N] [--warmup N] [--filter SUBSTRING] [--out results.json]\n"
+                    "             [--baseline baseline.json] [--threshold PERCENT] [--cli path/to/simspad]"
+                 << endl;
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+
+    cout << "SimSPAD " << VERSION << " benchmarks: " << opt.reps << " repetitions after " << opt.warmup
+         << " warm-up(s), median per item" << endl;
+    vector<BenchResult> results = run_all(opt);
+
+    if (!opt.out.empty())
+    {
+        ofstream out(opt.out);
+        write_results(out, VERSION, results);
+        cout << "Results written to " << opt.out << endl;
+    }
+    bool ok = opt.baseline.empty() || compare(opt, results);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,240 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One benchmark: `reps` timed repetitions (after `warmup` untimed ones) of a
+// body that processes `items` units of work, kept as time per item.
+struct BenchResult
+{
+    std::string name;
+    std::string unit; // e.g. "ns/step"
+    std::vector<double> samples;
+    std::vector<std::pair<std::string, double>> counters; // hardware events per `counterUnit`, if measured
+    std::string counterUnit;
+
+    double mean() const;
+    double stdev() const;
+    double percentile(double p) const;
+};
+
+BenchResult run_bench(const std::string &name, const std::string &unit, double items, int warmup, int reps,
+                      const std::function<void()> &body)
+{
+    using namespace std;
+    for (int i = 0; i < warmup; i++)
+    {
+        body();
+    }
+    BenchResult r;
+    r.name = name;
+    r.unit = unit;
+    for (int i = 0; i < reps; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        body();
+        chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+        r.samples.push_back(elapsed.count() / items);
+    }
+    return r;
+}
+
+double BenchResult::mean() const
+{
+    double sum = 0.0;
+    for (double s : samples)
+    {
+        sum += s;
+    }
+    return samples.empty() ? 0.0 : sum / (double)samples.size();
+}
+
+double BenchResult::stdev() const
+{
+    if (samples.size() < 2)
+    {
+        return 0.0;
+    }
+    double m = mean(), ss = 0.0;
+    for (double s : samples)
+    {
+        ss += (s - m) * (s - m);
+    }
+    return std::sqrt(ss / (double)(samples.size() - 1));
+}
+
+// Linear interpolation between order statistics, p in [0, 100].
+double BenchResult::percentile(double p) const
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    double at = p / 100.0 * (double)(sorted.size() - 1);
+    size_t lo = (size_t)at;
+    size_t hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (at - (double)lo) * (sorted[hi] - sorted[lo]);
+}
+
+// ---- Welch's t-test ----
+
+// Continued fraction for the regularised incomplete beta function (modified Lentz).
+double beta_cf(double a, double b, double x)
+{
+    const double tiny = 1e-300;
+    double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0);
+    d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+    double h = d;
+    for (int m = 1; m <= 300; m++)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            double num = half == 0 ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+                                   : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+            d = 1.0 + num * d;
+            d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+            c = 1.0 + num / c;
+            c = std::fabs(c) < tiny ? tiny : c;
+            h *= d * c;
+        }
+        if (std::fabs(d * c - 1.0) < 1e-12)
+        {
+            break;
+        }
+    }
+    return h;
+}
+
+double incomplete_beta(double a, double b, double x)
+{
+    if (x <= 0.0 || x >= 1.0)
+    {
+        return x <= 0.0 ? 0.0 : 1.0;
+    }
+    double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) +
+                            b * std::log(1.0 - x));
+    if (x < (a + 1.0) / (a + b + 2.0))
+    {
+        return front * beta_cf(a, b, x) / a;
+    }
+    return 1.0 - front * beta_cf(b, a, 1.0 - x) / b;
+}
+
+// Two-sided p-value of Welch's t-test for equal means.
+double welch_p_value(const BenchResult &x, const BenchResult &y)
+{
+    double nx = (double)x.samples.size(), ny = (double)y.samples.size();
+    if (nx < 2 || ny < 2)
+    {
+        return 1.0;
+    }
+    double vx = x.stdev() * x.stdev() / nx, vy = y.stdev() * y.stdev() / ny;
+    if (vx + vy <= 0.0)
+    {
+        return x.mean() == y.mean() ? 1.0 : 0.0;
+    }
+    double t = (x.mean() - y.mean()) / std::sqrt(vx + vy);
+    double df = (vx + vy) * (vx + vy) / (vx * vx / (nx - 1) + vy * vy / (ny - 1));
+    return incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+}
+
+// ---- JSON results ----
+
+void write_results(std::ostream &out, const std::string &version, const std::vector<BenchResult> &results)
+{
+    out << std::setprecision(6);
+    out << "{\n  \"version\": \"" << version << "\",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"reps\": " << r.samples.size()
+            << ", \"mean\": " << r.mean() << ", \"stdev\": " << r.stdev() << ", \"p50\": " << r.percentile(50)
+            << ", \"p90\": " << r.percentile(90) << ", \"p99\": " << r.percentile(99) << ",\n     \"samples\": [";
+        for (size_t j = 0; j < r.samples.size(); j++)
+        {
+            out << (j ? ", " : "") << r.samples[j];
+        }
+        out << "]";
+        if (!r.counters.empty())
+        {
+            out << ",\n     \"counterUnit\": \"" << r.counterUnit << "\", \"counters\": {";
+            for (size_t j = 0; j < r.counters.size(); j++)
+            {
+                out << (j ? ", " : "") << "\"" << r.counters[j].first << "\": " << r.counters[j].second;
+            }
+            out << "}";
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+// Read back what write_results() wrote: the name, unit and samples of each benchmark.
+std::vector<BenchResult> read_results(const std::string &filename)
+{
+    std::ifstream in(filename);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    const std::string text = buffer.str();
+    auto field = [&](size_t from, const std::string &key, size_t &end) -> std::string
+    {
+        size_t at = text.find("\"" + key + "\": \"", from);
+        if (at == std::string::npos)
+        {
+            return "";
+        }
+        at += key.size() + 5;
+        end = text.find('"', at);
+        return text.substr(at, end - at);
+    };
+    std::vector<BenchResult> results;
+    size_t pos = 0, end = 0;
+    while ((pos = text.find("{\"name\": ", pos)) != std::string::npos)
+    {
+        BenchResult r;
+        r.name = field(pos, "name", end);
+        r.unit = field(end, "unit", end);
+        size_t open = text.find('[', text.find("\"samples\":", end));
+        size_t close = text.find(']', open);
+        std::istringstream values(text.substr(open + 1, close - open - 1));
+        std::string value;
+        while (std::getline(values, value, ','))
+        {
+            r.samples.push_back(std::stod(value));
+        }
+        results.push_back(r);
+        pos = close;
+    }
+    return results;
+}
+
+#endif // BENCH_HARNESS_H
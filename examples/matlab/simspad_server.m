@@ -1,33 +1,97 @@
-function opticalOutput = simspad_server(config, opticalInput)
+function opticalOutput = simspad_server(config, opticalInput, encoding)
 %SIMSPAD_SERVER posts a waveform to the SimSPAD web server and returns the response.
 % Device parameters travel as a JSON object in the X-SiPM-Params request header;
 % the request body is the raw optical-input waveform (little-endian float64). The
 % response body is the little-endian float64 charge-per-step waveform, the same
 % length as the input.
+%
+% The optional ENCODING ('f64' (default), 'f32' or 'i16') selects a compact wire
+% encoding for both the body and the response, negotiated with an "encoding"
+% parameter on the Content-Type and Accept headers: 'f32' halves the transfer,
+% 'i16' (16-bit quantisation per block of 65536 samples) quarters it.
+
+if nargin < 3
+    encoding = 'f64';
+end
 
 httpUrl = 'http://localhost:33232/simspad';
 
 % --- device parameters as a JSON header ---
-paramJson = jsonencode(params_struct(config));
+% meanPhotonsPerDt seeds the initial microcell state; the server simulates the
+% body as it arrives, so without it only the first 65536 samples are used.
+params = params_struct(config);
+params.meanPhotonsPerDt = mean(double(opticalInput(:)));
+paramJson = jsonencode(params);
 
-% --- optical input as a raw little-endian float64 body ---
+% --- optical input as a raw little-endian body in the chosen encoding ---
 % NOTE: typecast uses the machine byte order; this assumes a little-endian host
-% (all current MATLAB platforms), matching the server's '<f8' expectation.
-body = typecast(double(opticalInput(:)).', 'uint8');
+% (all current MATLAB platforms), matching the server's little-endian expectation.
+body = encode_waveform(double(opticalInput(:)).', encoding);
+if strcmp(encoding, 'f64')
+    mediaType = 'application/octet-stream';
+else
+    mediaType = ['application/octet-stream; encoding=' encoding];
+end
 
 opt = weboptions( ...
     'RequestMethod', 'post', ...
-    'MediaType', 'application/octet-stream', ...
+    'MediaType', mediaType, ...
     'ContentType', 'binary', ...
-    'HeaderFields', {'X-SiPM-Params', paramJson}, ...
+    'HeaderFields', {'X-SiPM-Params', paramJson; 'Accept', mediaType}, ...
     'Timeout', 600);
 
 fprintf("Sending simulation request...");
 responseData = webwrite(httpUrl, body, opt);
 fprintf(" Simulation result received.\n");
 
-% --- reinterpret the octet-stream response as little-endian float64 ---
-opticalOutput = typecast(uint8(responseData(:)).', 'double');
+% --- decode the octet-stream response ---
+opticalOutput = decode_waveform(uint8(responseData(:)).', encoding);
 opticalOutput = opticalOutput(:)';
 
 end
+
+function bytes = encode_waveform(x, encoding)
+switch encoding
+    case 'f64'
+        bytes = typecast(x, 'uint8');
+    case 'f32'
+        bytes = typecast(single(x), 'uint8');
+    case 'i16'
+        % blocks: float64 scale, uint32 count, int16 samples (x = q * scale)
+        blockSize = 65536;
+        parts = cell(1, ceil(numel(x) / blockSize));
+        for b = 1:numel(parts)
+            block = x((b - 1) * blockSize + 1:min(b * blockSize, numel(x)));
+            peak = max(abs(block));
+            scale = 1;
+            if peak > 0
+                scale = peak / 32767;
+            end
+            parts{b} = [typecast(scale, 'uint8'), typecast(uint32(numel(block)), 'uint8'), ...
+                        typecast(int16(round(block / scale)), 'uint8')];
+        end
+        bytes = [parts{:}];
+    otherwise
+        error('simspad_server:encoding', 'unsupported encoding ''%s'' (f64, f32 or i16)', encoding);
+end
+end
+
+function x = decode_waveform(bytes, encoding)
+switch encoding
+    case 'f64'
+        x = typecast(bytes, 'double');
+    case 'f32'
+        x = double(typecast(bytes, 'single'));
+    case 'i16'
+        parts = {};
+        at = 1;
+        while at <= numel(bytes)
+            scale = typecast(bytes(at:at + 7), 'double');
+            n = double(typecast(bytes(at + 8:at + 11), 'uint32'));
+            at = at + 12;
+            parts{end + 1} = double(typecast(bytes(at:at + 2 * n - 1), 'int16')) * scale; %#ok<AGROW>
+            at = at + 2 * n;
+        end
+        x = [parts{:}];
+end
+end
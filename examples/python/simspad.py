@@ -5,11 +5,19 @@ response waveforms as 1-D little-endian float64 NumPy ``.npy`` arrays. Web:
 parameters as a JSON ``X-SiPM-Params`` request header, the waveform as a raw
 ``application/octet-stream`` body (little-endian float64); the response is the
 same, charge-per-step, one value per time step.
+
+Either end can also produce a sparse detection-event list instead: packed
+``(step <u8, cell <u4, charge <f8)`` records, one per charge-producing
+detection (``simspad -e EVENTS.npy`` or ``X-SiPM-Output: events``). Use
+``densify_events`` to turn it back into charge-per-step samples.
 """
 import json
 
 import numpy as np
 
+# Packed detection-event record (matches NpyEventWriter / pack_event()).
+EVENT_DTYPE = np.dtype([("step", "<u8"), ("cell", "<u4"), ("charge", "<f8")])
+
 # Parameter order matches SiPM::dump_configuration() / the .json schema.
 PARAM_KEYS = [
     "dt", "numMicrocell", "vBias", "vBr", "tauRecovery",
@@ -32,6 +40,14 @@ class SiPM:
         d["numMicrocell"] = int(d["numMicrocell"])
         return d
 
+    def request_params(self, optical_input):
+        """Parameters for a web request: the device plus the waveform's mean
+        photons/dt, which seeds the initial microcell state. The server
+        streams the body as it arrives, so without it only a prefix is used."""
+        d = self.params_dict()
+        d["meanPhotonsPerDt"] = float(np.mean(optical_input)) if len(optical_input) else 0.0
+        return d
+
     def write_params(self, filename):
         """Write the device parameters to a flat JSON file."""
         with open(filename, "w") as f:
@@ -51,29 +67,385 @@ class SiPM:
         np.save(filename, np.ascontiguousarray(optical_input, dtype="<f8"))
 
     # -- web client ---------------------------------------------------------
-    def simulate_web(self, url, optical_input):
+    def request_headers(self, optical_input, seed=None, encoding="f64", response_encoding="f64"):
+        """Request headers for a simulation of ``optical_input``. A ``seed``
+        makes the run reproducible, so the server may answer repeats from its
+        result cache. ``encoding`` / ``response_encoding`` name the wire
+        encodings of the body and the response (see encode_waveform())."""
+        headers = {
+            "X-SiPM-Params": json.dumps(self.request_params(optical_input)),
+            "Content-Type": media_type(encoding),
+            "Accept": media_type(response_encoding),
+        }
+        if seed is not None:
+            headers["X-SiPM-Seed"] = str(int(seed))
+        return headers
+
+    def simulate_web(self, url, optical_input, seed=None, encoding="f64", response_encoding=None):
         """POST a waveform to a SimSPAD server; return the response as an ndarray.
 
         Parameters travel in the ``X-SiPM-Params`` JSON header, the waveform as
         a raw little-endian float64 octet-stream body. The response body is the
-        charge-per-step waveform (same length as the input)."""
+        charge-per-step waveform (same length as the input). A compact
+        ``encoding`` (f32, i16, dvarint) shrinks the body, and by default the
+        response too."""
+        import requests
+
+        response_encoding = response_encoding or encoding
+        body = encode_waveform(optical_input, encoding)
+        headers = self.request_headers(optical_input, seed, encoding, response_encoding)
+        response = requests.post(url, data=body, headers=headers)
+        response.raise_for_status()
+        return decode_waveform(response.content, response_encoding)
+
+    def simulate_batch(self, base_url, optical_inputs, seed=None):
+        """Simulate many (short) waveforms in one ``POST {base_url}/simspad/batch``,
+        all on this device, and return a list of responses in input order. An
+        item the server refused is returned as a RuntimeError instead. With a
+        ``seed``, item i runs with seed + i."""
+        import struct
+        import requests
+
+        body = bytearray()
+        for wave in optical_inputs:
+            wave = np.ascontiguousarray(wave, dtype="<f8")
+            params = json.dumps(self.request_params(wave)).encode()
+            body += struct.pack("<II", len(params), len(wave)) + params + wave.tobytes()
+        headers = {"Content-Type": "application/x-simspad-batch"}
+        if seed is not None:
+            headers["X-SiPM-Seed"] = str(int(seed))
+        response = requests.post(f"{base_url}/simspad/batch", data=bytes(body), headers=headers)
+        response.raise_for_status()
+        results, at, data = [], 0, response.content
+        while at < len(data):
+            status, length = struct.unpack_from("<II", data, at)
+            payload = data[at + 8:at + 8 + length]
+            at += 8 + length
+            if status == 200:
+                results.append(np.frombuffer(payload, dtype="<f8"))
+            else:
+                results.append(RuntimeError(f"{status}: {payload.decode()}"))
+        return results
+
+    def simulate_job(self, base_url, optical_input, poll=1.0, seed=None):
+        """Run a simulation through the server's asynchronous job API
+        (``POST {base_url}/jobs``), polling until it finishes, and return the
+        response. Long runs then never hold an HTTP worker or a client timeout."""
+        import time
         import requests
 
         body = np.ascontiguousarray(optical_input, dtype="<f8").tobytes()
-        headers = {
-            "X-SiPM-Params": json.dumps(self.params_dict()),
-            "Content-Type": "application/octet-stream",
-        }
+        headers = self.request_headers(optical_input, seed)
+        job = requests.post(f"{base_url}/jobs", data=body, headers=headers)
+        job.raise_for_status()
+        job_url = f"{base_url}/jobs/{job.json()['id']}"
+        while True:
+            status = requests.get(job_url).json()
+            if status["status"] == "done":
+                break
+            if status["status"] in ("failed", "cancelled"):
+                raise RuntimeError(f"job {status['id']} {status['status']}: {status['error']}")
+            time.sleep(poll)
+        result = requests.get(f"{job_url}/result")
+        result.raise_for_status()
+        requests.delete(job_url)
+        return np.frombuffer(result.content, dtype="<f8")
+
+    def simulate_web_events(self, url, optical_input, seed=None):
+        """As simulate_web(), but return the sparse detection-event list
+        (a structured ndarray of EVENT_DTYPE) instead of the dense response."""
+        import requests
+
+        body = np.ascontiguousarray(optical_input, dtype="<f8").tobytes()
+        headers = self.request_headers(optical_input, seed)
+        headers["X-SiPM-Output"] = "events"
         response = requests.post(url, data=body, headers=headers)
         response.raise_for_status()
+        return np.frombuffer(response.content, dtype=EVENT_DTYPE)
+
+    def simulate_unix(self, path, optical_input, seed=None, float32=False, frame_samples=1 << 20):
+        """Run a simulation over the server's Unix domain socket
+        (``SIMSPAD_UNIX_SOCKET``), skipping HTTP; see src/unixsocket.hpp for
+        the framing. ``float32`` halves the bytes moved each way."""
+        import socket
+        import struct
+
+        def recv_exact(sock, n):
+            buf = bytearray()
+            while len(buf) < n:
+                chunk = sock.recv(n - len(buf))
+                if not chunk:
+                    raise ConnectionError("server closed the connection")
+                buf += chunk
+            return bytes(buf)
+
+        def recv_frame(sock):
+            (length,) = struct.unpack("<I", recv_exact(sock, 4))
+            if length == 0xFFFFFFFF:
+                status, _, msg_len = struct.unpack("<HHI", recv_exact(sock, 8))
+                raise RuntimeError(f"{status}: {recv_exact(sock, msg_len).decode()}")
+            return recv_exact(sock, length)
+
+        dtype = "<f4" if float32 else "<f8"
+        wave = np.ascontiguousarray(optical_input, dtype=dtype)
+        params = self.request_params(optical_input)
+        flags = (1 if seed is not None else 0) | (2 | 8 if float32 else 0)
+        header = b"SSPQ" + struct.pack(
+            "<HH10ddQQII", 1, flags, *[float(params[k]) for k in PARAM_KEYS],
+            params["meanPhotonsPerDt"], int(seed or 0), len(wave), 0, 0)
+        out = []
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+            sock.connect(path)
+            sock.sendall(header)
+            status, retry, msg_len = struct.unpack("<4xHHII", recv_exact(sock, 16))[1:]
+            if status != 200:
+                raise RuntimeError(f"{status} (retry after {retry}s): {recv_exact(sock, msg_len).decode()}")
+            # One reply frame per input frame, so neither side's buffer fills.
+            for start in range(0, len(wave), frame_samples):
+                chunk = wave[start:start + frame_samples].tobytes()
+                sock.sendall(struct.pack("<I", len(chunk)) + chunk)
+                out.append(recv_frame(sock))
+            sock.sendall(struct.pack("<I", 0))
+            out.append(recv_frame(sock))
+            recv_exact(sock, 16)  # trailer: samples, detections
+        return np.frombuffer(b"".join(out), dtype=dtype)
+
+    def simulate_shm(self, path, optical_input, seed=None):
+        """As simulate_unix(), but pass the waveform in a shared-memory
+        segment: the server simulates from and into it in place, and only a
+        small descriptor (with the segment's file descriptor) crosses the
+        socket. Linux, Python 3.9+."""
+        import fcntl
+        import mmap
+        import os
+        import socket
+        import struct
+
+        wave = np.ascontiguousarray(optical_input, dtype="<f8")
+        nbytes = wave.nbytes
+        params = self.request_params(optical_input)
+        header = b"SSPQ" + struct.pack(
+            "<HH10ddQQII", 1, 16 | (1 if seed is not None else 0), *[float(params[k]) for k in PARAM_KEYS],
+            params["meanPhotonsPerDt"], int(seed or 0), len(wave), 0, 0)
+        segment = os.memfd_create("simspad", os.MFD_ALLOW_SEALING)
+        try:
+            os.ftruncate(segment, 2 * nbytes)
+            fcntl.fcntl(segment, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK)  # required by the server
+            with mmap.mmap(segment, 2 * nbytes) as shared, \
+                    socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+                shared[:nbytes] = wave.tobytes()
+                sock.connect(path)
+                sock.sendall(header)
+                socket.send_fds(sock, [struct.pack("<QQ", 0, nbytes)], [segment])
+                reply = sock.makefile("rb")
+                status, retry, msg_len = struct.unpack("<4xHHII", reply.read(16))[1:]
+                if status != 200:
+                    raise RuntimeError(f"{status} (retry after {retry}s): {reply.read(msg_len).decode()}")
+                (length,) = struct.unpack("<I", reply.read(4))  # completion
+                if length == 0xFFFFFFFF:
+                    status, _, msg_len = struct.unpack("<HHI", reply.read(8))
+                    raise RuntimeError(f"{status}: {reply.read(msg_len).decode()}")
+                reply.read(16)  # trailer: samples, detections
+                reply.close()
+                return np.frombuffer(shared[nbytes:], dtype="<f8")
+        finally:
+            os.close(segment)
+
+    def open_session(self, base_url, mean_photons_per_dt=None, seed=None):
+        """Open a persistent server-side session (``POST {base_url}/sessions``)
+        for closed-loop use; see Session."""
+        return Session(base_url, self, mean_photons_per_dt, seed)
+
+
+class Session:
+    """A server-held SiPM whose microcell state carries over between calls:
+    each advance() continues where the previous one stopped. Without a mean
+    flux the state is seeded from the first chunk."""
+
+    def __init__(self, base_url, sipm, mean_photons_per_dt=None, seed=None):
+        import requests
+
+        params = sipm.params_dict()
+        if mean_photons_per_dt is not None:
+            params["meanPhotonsPerDt"] = float(mean_photons_per_dt)
+        headers = {"X-SiPM-Params": json.dumps(params)}
+        if seed is not None:
+            headers["X-SiPM-Seed"] = str(int(seed))
+        response = requests.post(f"{base_url}/sessions", headers=headers)
+        response.raise_for_status()
+        self.url = f"{base_url}/sessions/{response.json()['id']}"
+
+    def advance(self, optical_input):
+        """Push the next chunk of optical input; return its response."""
+        import requests
+
+        body = np.ascontiguousarray(optical_input, dtype="<f8").tobytes()
+        response = requests.post(f"{self.url}/advance", data=body,
+                                 headers={"Content-Type": "application/octet-stream"})
+        response.raise_for_status()
         return np.frombuffer(response.content, dtype="<f8")
 
+    def close(self):
+        import requests
+
+        requests.delete(self.url)
+
+
+# -- wire encodings (Content-Type / Accept "encoding" parameter) --------------
+# f64 and f32 are raw arrays; i16 and dvarint are blocks of a float64 scale, a
+# uint32 count and then int16 values, or a uint32 byte length and zigzag
+# LEB128 varints of successive differences, of the quantised samples
+# round(x / scale). See src/encoding.hpp.
+ENCODINGS = ("f64", "f32", "i16", "dvarint")
+
+
+def media_type(encoding="f64", scale=None):
+    """The application/octet-stream media type for a wire encoding."""
+    if encoding not in ENCODINGS:
+        raise ValueError(f"unknown encoding {encoding!r}, expected one of {ENCODINGS}")
+    if encoding == "f64":
+        return "application/octet-stream"
+    return f"application/octet-stream; encoding={encoding}" + (f"; scale={scale!r}" if scale else "")
+
+
+def encode_waveform(x, encoding="f64", scale=None, block=1 << 16):
+    """Encode a waveform for the wire. Without a ``scale`` the integer
+    encodings quantise each block to 16 bits of its peak; ``scale=1`` sends
+    integer photon counts through dvarint losslessly."""
+    import struct
+
+    x = np.ascontiguousarray(x, dtype="<f8")
+    if encoding == "f64":
+        return x.tobytes()
+    if encoding == "f32":
+        return x.astype("<f4").tobytes()
+    out = bytearray()
+    for start in range(0, len(x), block):
+        part = x[start:start + block]
+        peak = float(np.max(np.abs(part))) if len(part) else 0.0
+        step = scale or (peak / 32767.0 if peak > 0 else 1.0)
+        q = np.rint(part / step)
+        if encoding == "i16":
+            out += struct.pack("<dI", step, len(part))
+            out += np.clip(q, -32768, 32767).astype("<i2").tobytes()
+            continue
+        q = q.astype(np.int64)
+        delta = np.diff(q, prepend=0)
+        zz = ((delta << 1) ^ (delta >> 63)).astype(np.uint64)
+        nbytes = np.ones(len(zz), dtype=np.int64)
+        for k in range(1, 10):
+            nbytes += (zz >> np.uint64(7 * k)) > 0
+        offsets = np.cumsum(nbytes) - nbytes
+        payload = np.zeros(int(nbytes.sum()), dtype=np.uint8)
+        for k in range(10):
+            has = nbytes > k
+            more = (nbytes[has] > k + 1).astype(np.uint8) << 7
+            payload[offsets[has] + k] = ((zz[has] >> np.uint64(7 * k)) & np.uint64(0x7F)).astype(np.uint8) | more
+        out += struct.pack("<dII", step, len(part), len(payload)) + payload.tobytes()
+    return bytes(out)
+
+
+def decode_waveform(data, encoding="f64"):
+    """Decode a waveform received in one of the wire encodings."""
+    import struct
+
+    if encoding == "f64":
+        return np.frombuffer(data, dtype="<f8")
+    if encoding == "f32":
+        return np.frombuffer(data, dtype="<f4").astype(np.float64)
+    parts, at = [], 0
+    while at < len(data):
+        if encoding == "i16":
+            step, n = struct.unpack_from("<dI", data, at)
+            at += 12
+            parts.append(np.frombuffer(data, dtype="<i2", count=n, offset=at) * step)
+            at += 2 * n
+            continue
+        step, n, length = struct.unpack_from("<dII", data, at)
+        at += 16
+        b = np.frombuffer(data, dtype=np.uint8, count=length, offset=at).astype(np.uint64)
+        at += length
+        ends = np.flatnonzero(b < 0x80)
+        starts = np.concatenate(([0], ends[:-1] + 1))
+        position = np.arange(len(b)) - np.repeat(starts, ends - starts + 1)
+        zz = np.add.reduceat((b & np.uint64(0x7F)) << (np.uint64(7) * position.astype(np.uint64)), starts) \
+            if len(b) else np.zeros(0, dtype=np.uint64)
+        delta = (zz >> np.uint64(1)).astype(np.int64) ^ -(zz & np.uint64(1)).astype(np.int64)
+        parts.append(np.cumsum(delta)[:n] * step)
+    return np.concatenate(parts) if parts else np.zeros(0)
+
 
 def read_waveform(filename):
     """Read a 1-D float64 .npy waveform written by SimSPAD."""
     return np.load(filename)
 
 
+def read_events(filename):
+    """Read a detection-event .npy written by ``simspad -e``."""
+    return np.load(filename)
+
+
+def densify_events(events, num_samples, first_step=0):
+    """Re-densify an event list into charge-per-step samples covering steps
+    [first_step, first_step + num_samples)."""
+    out = np.zeros(num_samples)
+    idx = events["step"].astype(np.int64) - first_step
+    keep = (idx >= 0) & (idx < num_samples)
+    np.add.at(out, idx[keep], events["charge"][keep])
+    return out
+
+
+# Chunk-index records (matches ChunkIndexWriter in utilities.cpp).
+INDEX_CHUNK_DTYPE = np.dtype([
+    ("offset", "<u8"), ("count", "<u8"), ("sum", "<f8"),
+    ("min", "<f8"), ("max", "<f8"), ("detections", "<u8"),
+])
+
+
+def read_index(filename):
+    """Read a chunk index written by ``simspad -o OUT.npy -x OUT.idx``.
+
+    Returns a dict with the per-chunk table (``chunks``, a structured ndarray
+    of INDEX_CHUNK_DTYPE) and the min/max pyramid (``levels``: a list, finest
+    first, of ``(samples_per_bin, ndarray[n_bins, 2])``)."""
+    with open(filename, "rb") as f:
+        raw = f.read()
+    if raw[:8] != b"SSPDIDX\0":
+        raise ValueError(f"not a SimSPAD index: {filename}")
+    _version, n_levels = np.frombuffer(raw, "<u4", 2, 8)
+    total, n_chunks, data_offset, bin_samples, factor = np.frombuffer(raw, "<u8", 5, 16)
+    pos = 56
+    chunks = np.frombuffer(raw, INDEX_CHUNK_DTYPE, int(n_chunks), pos)
+    pos += chunks.nbytes
+    levels = []
+    for _ in range(int(n_levels)):
+        n_bins, per_bin = np.frombuffer(raw, "<u8", 2, pos)
+        pos += 16
+        mm = np.frombuffer(raw, "<f8", 2 * int(n_bins), pos).reshape(-1, 2)
+        pos += mm.nbytes
+        levels.append((int(per_bin), mm))
+    return {"total": int(total), "data_offset": int(data_offset),
+            "bin_samples": int(bin_samples), "factor": int(factor),
+            "chunks": chunks, "levels": levels}
+
+
+def read_window(filename, start, count):
+    """Read samples [start, start + count) of a .npy response without loading
+    the whole file."""
+    return np.load(filename, mmap_mode="r")[start:start + count].copy()
+
+
+def preview(index, start, stop, width):
+    """Min/max envelope of samples [start, stop) at roughly ``width`` points,
+    read from the coarsest pyramid level that still resolves the window."""
+    span = max(stop - start, 1)
+    per_bin, mm = index["levels"][0]
+    for lvl_per_bin, lvl_mm in index["levels"]:
+        if span // lvl_per_bin >= width:
+            per_bin, mm = lvl_per_bin, lvl_mm
+    return mm[start // per_bin:(stop + per_bin - 1) // per_bin]
+
+
 def read_params(filename):
     """Read a JSON parameter file, returning a configured SiPM."""
     return SiPM.from_params(filename)
@@ -0,0 +1,218 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include "batch.hpp"
+
+using namespace std;
+
+static uint32_t get_u32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put_u32(string &out, uint32_t v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+vector<BatchItem> parse_batch(const string &body, const string &sharedParams, const SimulationRequest &base)
+{
+    vector<BatchItem> items;
+    uint64_t totalSamples = 0, totalWork = 0;
+    size_t at = 0;
+    while (at < body.size())
+    {
+        if (items.size() == MAX_BATCH_ITEMS)
+        {
+            throw ServiceError(400, "too many batch items (max " + to_string(MAX_BATCH_ITEMS) + ")");
+        }
+        if (body.size() - at < 2 * sizeof(uint32_t))
+        {
+            throw ServiceError(400, "truncated batch item header at byte " + to_string(at));
+        }
+        uint64_t paramsLen = get_u32(&body[at]), n = get_u32(&body[at + 4]);
+        at += 2 * sizeof(uint32_t);
+        if (body.size() - at < paramsLen + n * sizeof(double))
+        {
+            throw ServiceError(400, "batch item " + to_string(items.size()) + " runs past the end of the body");
+        }
+
+        items.emplace_back();
+        BatchItem &item = items.back();
+        item.req = base;
+        item.req.samples = (size_t)n;
+        if (base.seeded)
+        {
+            item.req.seed = base.seed + (items.size() - 1);
+        }
+        string params = paramsLen ? body.substr(at, (size_t)paramsLen) : sharedParams;
+        at += (size_t)paramsLen;
+        item.in.resize((size_t)n);
+        memcpy(item.in.data(), &body[at], (size_t)n * sizeof(double));
+        at += (size_t)n * sizeof(double);
+
+        try
+        {
+            if (params.empty())
+            {
+                throw ServiceError(400, "no item parameters and no shared X-SiPM-Params header");
+            }
+            item.req.svars = parse_request_params(params, &item.req.seedMean);
+        }
+        catch (const ServiceError &e)
+        {
+            item.status = e.status;
+            item.error = e.what();
+        }
+
+        // The per-request limits bound the batch as a whole, not just each
+        // item. Items the SiPM will reject are charged one cell per sample.
+        totalSamples += n;
+        if (totalSamples > MAX_SAMPLES)
+        {
+            throw ServiceError(413, "batch too long (max " + to_string(MAX_SAMPLES) + " samples in all items)");
+        }
+        if (item.status == 0)
+        {
+            double cells = item.req.svars[1];
+            totalWork += (cells >= 1.0 && cells <= (double)MAX_MICROCELL ? (uint64_t)cells : 1) * n;
+            if (totalWork > MAX_WORK)
+            {
+                throw ServiceError(413, "batch too large (numMicrocell * samples over all items exceeds the per-request budget)");
+            }
+        }
+    }
+    return items;
+}
+
+string run_batch(SimulationCore &core, ComputePool &pool, vector<BatchItem> &items)
+{
+    // Items queue for admission without holding a pool thread, as jobs do, and
+    // reach the pool only once admitted: a large batch never parks the pool's
+    // threads in admission or holds other pool work behind it.
+    mutex m;
+    condition_variable done;
+    size_t pending = 0;
+    vector<unique_ptr<SimulationRun>> runs(items.size());
+    auto settle = [&](BatchItem &item, int status, const string &error)
+    {
+        item.status = status;
+        item.error = error;
+        vector<double>().swap(item.in);
+        lock_guard<mutex> lock(m);
+        if (--pending == 0)
+        {
+            done.notify_one();
+        }
+    };
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        BatchItem &item = items[i];
+        if (item.status != 0)
+        {
+            continue;
+        }
+        if (item.in.empty())
+        {
+            item.status = 200; // as /simspad answers an empty body
+            continue;
+        }
+        try
+        {
+            runs[i] = core.prepare(item.req);
+        }
+        catch (const ServiceError &e)
+        {
+            item.status = e.status;
+            item.error = e.what();
+            continue;
+        }
+        catch (const exception &e)
+        {
+            item.status = 500;
+            item.error = e.what();
+            continue;
+        }
+        {
+            lock_guard<mutex> lock(m);
+            pending++;
+        }
+        unique_ptr<SimulationRun> &run = runs[i];
+        run->admit_async([&pool, &item, &run, &settle]
+                         {
+            pool.enqueue([&item, &run, &settle]
+                         {
+                int status = 200;
+                string error;
+                try
+                {
+                    if (chrono::steady_clock::now() > item.req.deadline)
+                    {
+                        throw ServiceError(503, "deadline expired while queued");
+                    }
+                    item.out.resize(item.in.size());
+                    run->simulate(item.in.data(), item.out.data(), item.in.size());
+                }
+                catch (const ServiceError &e)
+                {
+                    status = e.status;
+                    error = e.what();
+                }
+                catch (const exception &e)
+                {
+                    status = 500;
+                    error = e.what();
+                }
+                run.reset(); // hand back its memory budget
+                settle(item, status, error); }); });
+    }
+    {
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [&]
+                  { return pending == 0; });
+    }
+    size_t total = 0;
+    for (const BatchItem &item : items)
+    {
+        total += 2 * sizeof(uint32_t) + (item.status == 200 ? item.out.size() * sizeof(double) : item.error.size());
+    }
+    string response;
+    response.reserve(total);
+    for (BatchItem &item : items)
+    {
+        put_u32(response, (uint32_t)item.status);
+        if (item.status == 200)
+        {
+            put_u32(response, (uint32_t)(item.out.size() * sizeof(double)));
+            response.append(reinterpret_cast<const char *>(item.out.data()), item.out.size() * sizeof(double));
+            vector<double>().swap(item.out);
+        }
+        else
+        {
+            put_u32(response, (uint32_t)item.error.size());
+            response += item.error;
+        }
+    }
+    return response;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "simcore.hpp"
+#include "threadpool.hpp"
+
+// Many short waveforms in one request (POST /simspad/batch), so per-request
+// overhead is paid once. All integers and floats are little-endian.
+//
+// Request body: items back to back, each
+//    u32  params JSON length (0: use the request's shared X-SiPM-Params)
+//    u32  sample count
+//    the params JSON, then the float64 samples.
+// Response body: one record per item, in input order:
+//    u32  status (HTTP code)
+//    u32  byte length
+//    float64 response samples (200), else the error message.
+
+constexpr std::size_t MAX_BATCH_ITEMS = 65536;
+
+struct BatchItem
+{
+    SimulationRequest req;
+    std::vector<double> in, out;
+    int status = 0; // 0 until run; an error status is final
+    std::string error;
+};
+
+// Split a batch body into items, each copying `base` (client, deadline, seed)
+// with its own parameters and samples. Item i of a seeded batch runs with
+// seed + i. Throws ServiceError(400) if the framing is broken, and 413 if the
+// items together exceed MAX_SAMPLES samples or MAX_WORK microcell-steps (the
+// single-request limits); an item whose parameters are bad gets a per-item
+// 400 instead.
+std::vector<BatchItem> parse_batch(const std::string &body, const std::string &sharedParams,
+                                   const SimulationRequest &base);
+
+// Run the items in parallel on `pool`, each admitted on its own without
+// occupying a pool thread while it queues, and return the framed response.
+std::string run_batch(SimulationCore &core, ComputePool &pool, std::vector<BatchItem> &items);
+
+#endif // BATCH_H
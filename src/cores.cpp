@@ -0,0 +1,309 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <system_error>
+#include <pthread.h>
+#include <sched.h>
+#include "cores.hpp"
+
+using namespace std;
+
+// Parse a kernel CPU list such as "0-3,8,10-11".
+static vector<int> parse_cpulist(const string &text)
+{
+    vector<int> cpus;
+    stringstream ranges(text);
+    string range;
+    while (getline(ranges, range, ','))
+    {
+        int lo, hi;
+        char dash;
+        stringstream r(range);
+        if (!(r >> lo))
+        {
+            continue;
+        }
+        hi = (r >> dash >> hi) ? hi : lo;
+        for (int c = lo; c <= hi; c++)
+        {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+Topology Topology::detect()
+{
+    Topology t;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+        {
+            if (CPU_ISSET(c, &mask))
+            {
+                t.cpus.push_back(c);
+            }
+        }
+    }
+    if (t.cpus.empty())
+    {
+        unsigned n = max(1u, thread::hardware_concurrency());
+        for (unsigned c = 0; c < n; c++)
+        {
+            t.cpus.push_back((int)c);
+        }
+    }
+
+    map<int, int> nodeOf;
+    for (int node = 0; node < 1024; node++)
+    {
+        ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!list)
+        {
+            if (node > 0)
+            {
+                break; // nodes are numbered densely in practice
+            }
+            continue;
+        }
+        string text;
+        getline(list, text);
+        for (int c : parse_cpulist(text))
+        {
+            nodeOf[c] = node;
+        }
+    }
+    for (int c : t.cpus)
+    {
+        t.nodes.push_back(nodeOf.count(c) ? nodeOf[c] : 0);
+    }
+    return t;
+}
+
+size_t Topology::node_count() const
+{
+    vector<int> distinct(nodes);
+    sort(distinct.begin(), distinct.end());
+    return (size_t)(unique(distinct.begin(), distinct.end()) - distinct.begin());
+}
+
+CoreScheduler::CoreScheduler(const Topology &topology, const Config &config)
+    : config_(config), nodes_(topology.node_count()), workers_(topology.cpus.size())
+{
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i].cpu = topology.cpus[i];
+        workers_[i].node = topology.nodes[i];
+    }
+}
+
+CoreScheduler::~CoreScheduler()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_.notify_all();
+    for (Worker &w : workers_)
+    {
+        if (w.thread.joinable())
+        {
+            w.thread.join();
+        }
+    }
+}
+
+void CoreScheduler::serve(size_t i)
+{
+    Worker &w = workers_[i];
+    if (config_.pin)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w.cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // best effort
+    }
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        work_.wait(lock, [&]
+                   { return stopping_ || w.task; });
+        if (!w.task)
+        {
+            return;
+        }
+        function<void()> task = std::move(w.task);
+        w.task = nullptr;
+        lock.unlock();
+        task();
+        lock.lock();
+        w.busy = false;
+        done_.notify_all();
+    }
+}
+
+unique_ptr<CoreScheduler::Lease> CoreScheduler::lease(uint64_t work, size_t running, size_t queued)
+{
+    if (queued > 0 || config_.shardWork == 0)
+    {
+        return nullptr; // others are waiting: one core each
+    }
+    size_t wanted = (size_t)min<uint64_t>(work / config_.shardWork, workers_.size());
+    if (config_.maxShards)
+    {
+        wanted = min(wanted, config_.maxShards);
+    }
+    if (wanted < 2)
+    {
+        return nullptr;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    // Cores busy with other requests' own threads are not ours to take.
+    size_t idle = workers_.size() - leased_;
+    idle = idle > running ? idle - running : 0;
+    size_t helpers = min(wanted - 1, idle);
+    if (helpers == 0)
+    {
+        return nullptr;
+    }
+
+    // Prefer the node with the most free workers, then spill over.
+    map<int, size_t> freeOn;
+    for (const Worker &w : workers_)
+    {
+        if (!w.leased)
+        {
+            freeOn[w.node]++;
+        }
+    }
+    int best = max_element(freeOn.begin(), freeOn.end(), [](const pair<const int, size_t> &a, const pair<const int, size_t> &b)
+                           { return a.second < b.second; })
+                   ->first;
+    unique_ptr<Lease> l(new Lease(this));
+    for (int pass = 0; pass < 2 && l->workers.size() < helpers; pass++)
+    {
+        for (size_t i = 0; i < workers_.size() && l->workers.size() < helpers; i++)
+        {
+            Worker &w = workers_[i];
+            if (w.leased || (pass == 0 && w.node != best))
+            {
+                continue;
+            }
+            if (!w.thread.joinable())
+            {
+                try
+                {
+                    w.thread = thread([this, i]
+                                      { serve(i); });
+                }
+                catch (const system_error &)
+                {
+                    continue; // out of threads: lease fewer cores
+                }
+            }
+            w.leased = true;
+            l->workers.push_back(i);
+        }
+    }
+    if (l->workers.empty())
+    {
+        return nullptr;
+    }
+    leased_ += l->workers.size();
+    parallelRuns_++;
+    return l;
+}
+
+void CoreScheduler::Lease::run(size_t i, function<void()> task)
+{
+    // A throw must not escape the worker thread (std::terminate); it is kept
+    // for wait() to rethrow on the request's thread.
+    function<void()> guarded = [this, task = std::move(task)]
+    {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(sched->mutex_);
+            if (!error)
+            {
+                error = current_exception();
+            }
+        }
+    };
+    lock_guard<mutex> lock(sched->mutex_);
+    Worker &w = sched->workers_[workers[i]];
+    w.task = std::move(guarded);
+    w.busy = true;
+    sched->work_.notify_all();
+}
+
+void CoreScheduler::Lease::wait()
+{
+    join();
+    exception_ptr e;
+    {
+        lock_guard<mutex> lock(sched->mutex_);
+        swap(e, error);
+    }
+    if (e)
+    {
+        rethrow_exception(e);
+    }
+}
+
+void CoreScheduler::Lease::join()
+{
+    unique_lock<mutex> lock(sched->mutex_);
+    sched->done_.wait(lock, [&]
+                      {
+        for (size_t i : workers)
+        {
+            if (sched->workers_[i].busy)
+            {
+                return false;
+            }
+        }
+        return true; });
+}
+
+CoreScheduler::Lease::~Lease()
+{
+    join();
+    lock_guard<mutex> lock(sched->mutex_);
+    for (size_t i : workers)
+    {
+        sched->workers_[i].leased = false;
+    }
+    sched->leased_ -= workers.size();
+}
+
+CoreScheduler::Stats CoreScheduler::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{workers_.size(), nodes_, leased_, parallelRuns_};
+}
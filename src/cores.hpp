@@ -0,0 +1,122 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CORES_H
+#define CORES_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstddef>
+#include <cstdint>
+
+// The CPUs this process may run on and their NUMA nodes (from the affinity
+// mask and /sys/devices/system/node; one node when that is unavailable).
+struct Topology
+{
+    std::vector<int> cpus;
+    std::vector<int> nodes; // nodes[i] is the NUMA node of cpus[i]
+
+    static Topology detect();
+    std::size_t node_count() const;
+};
+
+// Core-aware helpers for the parallel engine. Every request simulates on its
+// own thread; a large one may additionally lease idle cores, each served by a
+// worker pinned to it (started the first time the core is leased, so none run
+// while sharding is off), to run further shards of its device (see parallel.hpp).
+// Leases only take cores no other simulation is using, preferring a single
+// NUMA node, so under load every request keeps to one core and an idle
+// machine gives a big request as many as its work justifies.
+class CoreScheduler
+{
+public:
+    struct Config
+    {
+        std::size_t maxShards = 0;       // cores per request (0 = all)
+        std::uint64_t shardWork = 0;     // microcell-steps that justify each extra core
+        bool pin = true;                 // pin workers to their cores
+    };
+
+    CoreScheduler(const Topology &topology, const Config &config);
+    ~CoreScheduler();
+
+    // Helper cores leased by one request, returned when destroyed.
+    class Lease
+    {
+    public:
+        ~Lease();
+        std::size_t size() const { return workers.size(); }
+        // Run `task` on helper i; wait() joins every helper's task, then
+        // rethrows the first exception any of them threw.
+        void run(std::size_t i, std::function<void()> task);
+        void wait();
+        Lease(Lease const &) = delete;
+        void operator=(Lease const &) = delete;
+
+    private:
+        friend class CoreScheduler;
+        Lease(CoreScheduler *s) : sched(s) {}
+        CoreScheduler *sched;
+        std::vector<std::size_t> workers;
+        std::exception_ptr error; // guarded by sched->mutex_
+
+        void join();
+    };
+
+    // Lease helpers for a request of `work` microcell-steps while `running`
+    // simulations (this one included) are admitted and `queued` wait; null if
+    // the work does not justify a second core or none is idle.
+    std::unique_ptr<Lease> lease(std::uint64_t work, std::size_t running, std::size_t queued);
+
+    struct Stats
+    {
+        std::size_t cores, nodes, leased;
+        unsigned long long parallelRuns;
+    };
+    Stats stats();
+
+    CoreScheduler(CoreScheduler const &) = delete;
+    void operator=(CoreScheduler const &) = delete;
+
+private:
+    struct Worker
+    {
+        int cpu, node;
+        bool leased = false;
+        std::function<void()> task;
+        bool busy = false;
+        std::thread thread;
+    };
+
+    Config config_;
+    std::size_t nodes_;
+    std::vector<Worker> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_, done_;
+    bool stopping_ = false;
+    std::size_t leased_ = 0;
+    unsigned long long parallelRuns_ = 0;
+
+    void serve(std::size_t i);
+};
+
+#endif // CORES_H
@@ -0,0 +1,240 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cmath>
+#include <random>
+#include "devicecache.hpp"
+
+using namespace std;
+
+// Per device, how many distinct fluxes keep an age distribution / warm states.
+static const size_t MAX_AGE_FLUXES = 16;
+static const size_t MAX_WARM_FLUXES = 4;
+
+// Exact-value keys: the raw bytes of the parameters (numMicrocell truncated the
+// way the SiPM constructor does) and of the flux.
+static string device_key(const vector<double> &svars)
+{
+    double v[10] = {0};
+    for (size_t i = 0; i < 10 && i < svars.size(); i++)
+    {
+        v[i] = svars[i];
+    }
+    v[1] = floor(v[1]);
+    return string(reinterpret_cast<const char *>(v), sizeof(v));
+}
+
+static string flux_key(double mean, unsigned long nSteps)
+{
+    // A zero flux falls back to 1/nSteps in SiPM::age_distribution().
+    string key(reinterpret_cast<const char *>(&mean), sizeof(mean));
+    if (mean == 0.0)
+    {
+        key.append(reinterpret_cast<const char *>(&nSteps), sizeof(nSteps));
+    }
+    return key;
+}
+
+DeviceCache::DeviceCache(size_t maxModels, size_t warmPerFlux, uint64_t maxWarmBytes, ComputePool *pool)
+    : maxModels_(maxModels ? maxModels : 1), warmPerFlux_(warmPerFlux), maxWarmBytes_(maxWarmBytes), pool_(pool)
+{
+}
+
+shared_ptr<DeviceCache::Model> DeviceCache::model(const vector<double> &svars)
+{
+    string key = device_key(svars);
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = models_.find(key);
+        if (it != models_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            modelHits_++;
+            return it->second.model;
+        }
+        modelMisses_++;
+    }
+
+    // Validate and build the LUTs outside the lock (throws on bad parameters).
+    auto built = make_shared<Model>(svars);
+
+    lock_guard<mutex> lock(mutex_);
+    auto it = models_.find(key);
+    if (it != models_.end())
+    {
+        return it->second.model; // built concurrently by another request
+    }
+    lru_.push_front(key);
+    models_[key] = Slot{built, lru_.begin()};
+    while (models_.size() > maxModels_)
+    {
+        auto victim = models_.find(lru_.back());
+        drop_warm(*victim->second.model);
+        models_.erase(victim);
+        lru_.pop_back();
+    }
+    return built;
+}
+
+// Copy the prototype and give the copy its own random streams.
+shared_ptr<SiPM> DeviceCache::copy(const Model &m)
+{
+    auto sipm = make_shared<SiPM>(m.prototype);
+    random_device rd;
+    sipm->seed((uint64_t)rd() << 32 | rd());
+    return sipm;
+}
+
+shared_ptr<const SiPM::AgeDistribution> DeviceCache::ages(Model &m, double mean, unsigned long nSteps)
+{
+    string key = flux_key(mean, nSteps);
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = m.ages.find(key);
+        if (it != m.ages.end())
+        {
+            return it->second;
+        }
+    }
+    SiPM scratch(m.prototype);
+    auto dist = make_shared<const SiPM::AgeDistribution>(scratch.age_distribution(mean, nSteps));
+
+    lock_guard<mutex> lock(mutex_);
+    if (m.ages.size() >= MAX_AGE_FLUXES && !m.ages.count(key))
+    {
+        m.ages.erase(m.ages.begin());
+    }
+    m.ages[key] = dist;
+    return dist;
+}
+
+shared_ptr<SiPM> DeviceCache::device(const vector<double> &svars)
+{
+    return copy(*model(svars));
+}
+
+void DeviceCache::init_state(SiPM &sipm, double mean, unsigned long nSteps)
+{
+    sipm.init_state(*ages(*model(sipm.dump_configuration()), mean, nSteps));
+}
+
+shared_ptr<SiPM> DeviceCache::build_warm(Model &m, double mean)
+{
+    auto sipm = copy(m);
+    sipm->init_state(*ages(m, mean, 0));
+    return sipm;
+}
+
+shared_ptr<SiPM> DeviceCache::warm_device(const vector<double> &svars, double mean)
+{
+    auto m = model(svars);
+    string key = flux_key(mean, 0);
+    shared_ptr<SiPM> sipm;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = m->warm.find(key);
+        if (it == m->warm.end() && m->warm.size() >= MAX_WARM_FLUXES)
+        {
+            drop_warm(*m);
+        }
+        WarmSet &set = m->warm.emplace(key, WarmSet{mean, {}, 0}).first->second;
+        if (!set.ready.empty())
+        {
+            sipm = set.ready.back();
+            set.ready.pop_back();
+            warmStates_--;
+            warmBytes_ -= (uint64_t)sipm->numMicrocell * sizeof(double);
+            warmHits_++;
+        }
+        else
+        {
+            warmMisses_++;
+        }
+        schedule_refills(m, key);
+    }
+    return sipm ? sipm : build_warm(*m, mean);
+}
+
+// Top the warm set back up in the background, within the byte budget.
+void DeviceCache::schedule_refills(const shared_ptr<Model> &m, const string &key)
+{
+    if (!pool_)
+    {
+        return;
+    }
+    WarmSet &set = m->warm[key];
+    const uint64_t bytes = (uint64_t)m->prototype.numMicrocell * sizeof(double);
+    while (set.ready.size() + set.pending < warmPerFlux_ &&
+           warmBytes_ + (set.pending + 1) * bytes <= maxWarmBytes_)
+    {
+        set.pending++;
+        double mean = set.mean;
+        pool_->enqueue([this, m, key, mean, bytes]
+                       {
+            shared_ptr<SiPM> sipm = build_warm(*m, mean);
+            lock_guard<mutex> lock(mutex_);
+            auto it = m->warm.find(key);
+            if (it == m->warm.end())
+            {
+                return; // dropped meanwhile
+            }
+            it->second.pending--;
+            if (warmBytes_ + bytes <= maxWarmBytes_)
+            {
+                it->second.ready.push_back(sipm);
+                warmStates_++;
+                warmBytes_ += bytes;
+            } });
+    }
+}
+
+void DeviceCache::drop_warm(Model &m)
+{
+    for (auto &kv : m.warm)
+    {
+        warmStates_ -= kv.second.ready.size();
+        warmBytes_ -= kv.second.ready.size() * (uint64_t)m.prototype.numMicrocell * sizeof(double);
+    }
+    m.warm.clear();
+}
+
+void DeviceCache::preload(const vector<double> &svars, const vector<double> &means)
+{
+    auto m = model(svars);
+    for (double mean : means)
+    {
+        if (!(mean > 0.0))
+        {
+            continue;
+        }
+        ages(*m, mean, 0);
+        lock_guard<mutex> lock(mutex_);
+        string key = flux_key(mean, 0);
+        if (!m->warm.count(key) && m->warm.size() < MAX_WARM_FLUXES)
+        {
+            m->warm.emplace(key, WarmSet{mean, {}, 0});
+            schedule_refills(m, key);
+        }
+    }
+}
+
+DeviceCache::Stats DeviceCache::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{modelHits_, modelMisses_, warmHits_, warmMisses_, models_.size(), warmStates_, warmBytes_};
+}
@@ -0,0 +1,110 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include "sipm.hpp"
+#include "threadpool.hpp"
+
+// Warm device models for the server, so requests for a device seen before skip
+// the per-request setup. For each parameter set (keyed by its exact values)
+// it keeps a prototype SiPM with its LUTs built, the age distributions already
+// computed for each mean flux, and a few SiPMs whose microcell state is
+// already sampled for those fluxes, refilled in the background on `pool`.
+// At most `maxModels` devices are kept (least recently used out), and warm
+// states are bounded to `maxWarmBytes` of microcell ages in total.
+class DeviceCache
+{
+public:
+    struct Stats
+    {
+        unsigned long long modelHits, modelMisses, warmHits, warmMisses;
+        std::size_t models, warmStates;
+        std::uint64_t warmBytes;
+    };
+
+    DeviceCache(std::size_t maxModels, std::size_t warmPerFlux, std::uint64_t maxWarmBytes, ComputePool *pool);
+
+    // A fresh SiPM for `svars` with its own random streams and no state yet.
+    // Throws std::invalid_argument for bad parameters, like the SiPM constructor.
+    std::shared_ptr<SiPM> device(const std::vector<double> &svars);
+
+    // Initialise `sipm` (from device()) using the cached age distribution.
+    void init_state(SiPM &sipm, double meanPhotonsPerDt, unsigned long nSteps);
+
+    // A SiPM for `svars` already initialised for `meanPhotonsPerDt` (> 0),
+    // from the warm pool when one is ready. Not for seeded runs: its random
+    // streams have already been used.
+    std::shared_ptr<SiPM> warm_device(const std::vector<double> &svars, double meanPhotonsPerDt);
+
+    // Build a device model ahead of time, and warm states for `means`.
+    void preload(const std::vector<double> &svars, const std::vector<double> &means);
+
+    Stats stats();
+
+    DeviceCache(DeviceCache const &) = delete;
+    void operator=(DeviceCache const &) = delete;
+
+private:
+    struct WarmSet
+    {
+        double mean;
+        std::vector<std::shared_ptr<SiPM>> ready;
+        std::size_t pending = 0; // refills queued on the pool
+    };
+    struct Model
+    {
+        explicit Model(const std::vector<double> &svars) : prototype(svars) {}
+        const SiPM prototype; // LUTs built; never simulated, only copied
+        std::map<std::string, std::shared_ptr<const SiPM::AgeDistribution>> ages;
+        std::map<std::string, WarmSet> warm;
+    };
+    struct Slot
+    {
+        std::shared_ptr<Model> model;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::size_t maxModels_, warmPerFlux_;
+    std::uint64_t maxWarmBytes_;
+    ComputePool *pool_;
+
+    std::mutex mutex_;
+    std::list<std::string> lru_; // most recently used at the front
+    std::unordered_map<std::string, Slot> models_;
+    std::uint64_t warmBytes_ = 0;
+    std::size_t warmStates_ = 0;
+    unsigned long long modelHits_ = 0, modelMisses_ = 0, warmHits_ = 0, warmMisses_ = 0;
+
+    std::shared_ptr<Model> model(const std::vector<double> &svars);
+    std::shared_ptr<const SiPM::AgeDistribution> ages(Model &model, double mean, unsigned long nSteps);
+    std::shared_ptr<SiPM> copy(const Model &model);
+    std::shared_ptr<SiPM> build_warm(Model &model, double mean);
+    void schedule_refills(const std::shared_ptr<Model> &model, const std::string &fluxKey); // mutex_ held
+    void drop_warm(Model &model);                                                          // mutex_ held
+};
+
+#endif // DEVICE_CACHE_H
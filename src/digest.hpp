@@ -0,0 +1,44 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Incremental SHA-256 (FIPS 180-4), used to content-address cached results:
+// feed the request pieces with update(), then take hex_digest() once.
+class Sha256
+{
+public:
+    Sha256();
+    void update(const void *data, std::size_t len);
+    void update(const std::string &s) { update(s.data(), s.size()); }
+    std::string hex_digest(); // 64 lowercase hex digits; ends the hash
+
+private:
+    std::uint32_t state[8];
+    unsigned char block[64];
+    std::size_t blockLen = 0;
+    std::uint64_t totalLen = 0;
+
+    void compress(const unsigned char *chunk);
+};
+
+#endif // DIGEST_H
@@ -0,0 +1,306 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include "encoding.hpp"
+#include "service.hpp"
+#include "simd.hpp"
+
+using namespace std;
+
+static string trim(const string &s)
+{
+    size_t b = s.find_first_not_of(" \t"), e = s.find_last_not_of(" \t");
+    return b == string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+static const char *encoding_name(Encoding e)
+{
+    switch (e)
+    {
+    case Encoding::F32:
+        return "f32";
+    case Encoding::I16:
+        return "i16";
+    case Encoding::DeltaVarint:
+        return "dvarint";
+    default:
+        return "f64";
+    }
+}
+
+string WireFormat::media_type() const
+{
+    string type = "application/octet-stream";
+    if (encoding != Encoding::F64)
+    {
+        type += string("; encoding=") + encoding_name(encoding);
+    }
+    return type;
+}
+
+WireFormat parse_wire_format(const string &header, int status)
+{
+    WireFormat format;
+    stringstream entries(header);
+    string entry;
+    while (getline(entries, entry, ','))
+    {
+        stringstream parts(entry);
+        string part;
+        getline(parts, part, ';');
+        if (trim(part) != "application/octet-stream")
+        {
+            continue;
+        }
+        while (getline(parts, part, ';'))
+        {
+            size_t eq = part.find('=');
+            string key = trim(part.substr(0, eq)), value = eq == string::npos ? "" : trim(part.substr(eq + 1));
+            if (key == "encoding")
+            {
+                if (value == "f64")
+                    format.encoding = Encoding::F64;
+                else if (value == "f32")
+                    format.encoding = Encoding::F32;
+                else if (value == "i16")
+                    format.encoding = Encoding::I16;
+                else if (value == "dvarint")
+                    format.encoding = Encoding::DeltaVarint;
+                else
+                    throw ServiceError(status, "unsupported encoding '" + value + "' (f64, f32, i16 or dvarint)");
+            }
+            else if (key == "scale")
+            {
+                char *end = nullptr;
+                format.scale = strtod(value.c_str(), &end);
+                if (value.empty() || *end != '\0' || !(format.scale > 0.0) || !isfinite(format.scale))
+                {
+                    throw ServiceError(status, "encoding scale must be a positive number");
+                }
+            }
+        }
+        return format;
+    }
+    return format;
+}
+
+template <typename T>
+static void put(string &out, T v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+static double block_scale(const WireFormat &format, const double *x, size_t n)
+{
+    if (format.scale > 0.0)
+    {
+        return format.scale;
+    }
+    double peak = simd().peak_abs(x, n);
+    return peak > 0.0 ? peak / 32767.0 : 1.0;
+}
+
+void encode_samples(const WireFormat &format, const double *x, size_t n, string &out)
+{
+    switch (format.encoding)
+    {
+    case Encoding::F64:
+        out.append(reinterpret_cast<const char *>(x), n * sizeof(double));
+        return;
+    case Encoding::F32:
+    {
+        size_t at = out.size();
+        out.resize(at + n * sizeof(float));
+        simd().to_f32(x, &out[at], n);
+        return;
+    }
+    case Encoding::I16:
+    {
+        double scale = block_scale(format, x, n);
+        put<double>(out, scale);
+        put<uint32_t>(out, (uint32_t)n);
+        size_t at = out.size();
+        out.resize(at + n * sizeof(int16_t));
+        simd().to_i16(x, scale, &out[at], n);
+        return;
+    }
+    case Encoding::DeltaVarint:
+    {
+        double scale = block_scale(format, x, n);
+        put<double>(out, scale);
+        put<uint32_t>(out, (uint32_t)n);
+        size_t lengthAt = out.size();
+        put<uint32_t>(out, 0);
+        int64_t prev = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            int64_t q = llrint(x[i] / scale);
+            uint64_t z = ((uint64_t)(q - prev) << 1) ^ (uint64_t)((q - prev) >> 63);
+            prev = q;
+            while (z >= 0x80)
+            {
+                out.push_back((char)(z | 0x80));
+                z >>= 7;
+            }
+            out.push_back((char)z);
+        }
+        uint32_t length = (uint32_t)(out.size() - lengthAt - sizeof(uint32_t));
+        memcpy(&out[lengthAt], &length, sizeof(length));
+        return;
+    }
+    }
+}
+
+// A little-endian f64, f32 or i16 (width 8, 4 or 2) as a double.
+static double load(const unsigned char *p, size_t width)
+{
+    if (width == sizeof(double))
+    {
+        double d;
+        memcpy(&d, p, sizeof(d));
+        return d;
+    }
+    if (width == sizeof(float))
+    {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        return f;
+    }
+    int16_t q;
+    memcpy(&q, p, sizeof(q));
+    return q;
+}
+
+void WireDecoder::push(double x, const Emit &emit)
+{
+    out_[outHave_++] = x;
+    if (outHave_ == sizeof(out_) / sizeof(out_[0]))
+    {
+        emit(out_, outHave_);
+        outHave_ = 0;
+    }
+}
+
+void WireDecoder::feed(const char *data, size_t len, const Emit &emit)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data), *end = p + len;
+    const bool varint = format_.encoding == Encoding::DeltaVarint;
+    const size_t headerBytes = varint ? 16 : 12;
+    while (p < end)
+    {
+        if (format_.encoding == Encoding::F32 || format_.encoding == Encoding::F64)
+        {
+            const size_t width = format_.encoding == Encoding::F32 ? sizeof(float) : sizeof(double);
+            if (partialHave_ > 0 || (size_t)(end - p) < width)
+            {
+                partial_[partialHave_++] = *p++; // a value split across reads
+                if (partialHave_ < width)
+                {
+                    continue;
+                }
+                partialHave_ = 0;
+                push(load(partial_, width), emit);
+            }
+            for (; (size_t)(end - p) >= width; p += width)
+            {
+                push(load(p, width), emit);
+            }
+            continue;
+        }
+        if (blockLeft_ == 0 && bytesLeft_ == 0)
+        {
+            // Block header.
+            header_[headerHave_++] = *p++;
+            if (headerHave_ < headerBytes)
+            {
+                continue;
+            }
+            headerHave_ = 0;
+            memcpy(&blockScale_, header_, sizeof(double));
+            memcpy(&blockLeft_, header_ + 8, sizeof(uint32_t));
+            if (varint)
+            {
+                memcpy(&bytesLeft_, header_ + 12, sizeof(uint32_t));
+                q_ = 0;
+            }
+            if (!(blockScale_ > 0.0) || !isfinite(blockScale_) || blockLeft_ > MAX_BLOCK_SAMPLES ||
+                (varint && (bytesLeft_ < blockLeft_ || (uint64_t)bytesLeft_ > 10ULL * blockLeft_)))
+            {
+                throw ServiceError(400, string("malformed ") + encoding_name(format_.encoding) + " block header");
+            }
+            continue;
+        }
+        if (!varint)
+        {
+            if (partialHave_ > 0 || end - p < 2)
+            {
+                partial_[partialHave_++] = *p++;
+                if (partialHave_ < sizeof(int16_t))
+                {
+                    continue;
+                }
+                partialHave_ = 0;
+                push(load(partial_, 2) * blockScale_, emit);
+                blockLeft_--;
+            }
+            for (; blockLeft_ > 0 && end - p >= 2; p += 2, blockLeft_--)
+            {
+                push(load(p, 2) * blockScale_, emit);
+            }
+            continue;
+        }
+        unsigned char b = *p++;
+        bytesLeft_--;
+        if (blockLeft_ == 0 || shift_ > 63)
+        {
+            throw ServiceError(400, "malformed dvarint block");
+        }
+        varint_ |= (uint64_t)(b & 0x7f) << shift_;
+        shift_ += 7;
+        if (b < 0x80)
+        {
+            int64_t delta = (int64_t)(varint_ >> 1) ^ -(int64_t)(varint_ & 1);
+            q_ += delta;
+            push((double)q_ * blockScale_, emit);
+            varint_ = 0;
+            shift_ = 0;
+            blockLeft_--;
+        }
+        if (bytesLeft_ == 0 && (blockLeft_ != 0 || shift_ != 0))
+        {
+            throw ServiceError(400, "malformed dvarint block");
+        }
+    }
+    if (outHave_ > 0)
+    {
+        emit(out_, outHave_);
+        outHave_ = 0;
+    }
+}
+
+void WireDecoder::finish()
+{
+    if (partialHave_ != 0 || headerHave_ != 0 || blockLeft_ != 0 || bytesLeft_ != 0)
+    {
+        throw ServiceError(400, string("request body ends part-way through a ") + encoding_name(format_.encoding) +
+                                    " value or block");
+    }
+}
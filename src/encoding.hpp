@@ -0,0 +1,98 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <string>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+// Compact wire encodings for waveforms, negotiated with an `encoding`
+// parameter on the application/octet-stream media type (Content-Type for the
+// request body, Accept for the response); `scale` optionally fixes the
+// quantum of the lossy integer encodings. All little-endian.
+//
+//   f64      raw float64 (the default)
+//   f32      raw float32
+//   i16      blocks: f64 scale, u32 n, n x i16 q; x = q * scale
+//   dvarint  blocks: f64 scale, u32 n, u32 byte length, n zigzag LEB128
+//            varints of q[i] - q[i-1] (q[-1] = 0); x = q * scale
+//
+// Without `scale`, each block's quantum is its peak magnitude / 32767, i.e.
+// 16-bit precision relative to the block; integer-valued waveforms (photon
+// counts) go through dvarint losslessly with scale=1.
+enum class Encoding
+{
+    F64,
+    F32,
+    I16,
+    DeltaVarint
+};
+
+struct WireFormat
+{
+    Encoding encoding = Encoding::F64;
+    double scale = 0.0; // 0: chosen per block
+
+    std::string media_type() const;
+};
+
+// Parse a Content-Type or Accept value; anything but application/octet-stream
+// means f64. Throws ServiceError(`status`) on an unknown encoding or a bad scale.
+WireFormat parse_wire_format(const std::string &header, int status);
+
+// Largest block a decoder accepts, in samples.
+constexpr std::uint32_t MAX_BLOCK_SAMPLES = 1u << 24;
+
+// Append the encoding of n samples to `out`; the block encodings emit one block.
+void encode_samples(const WireFormat &format, const double *x, std::size_t n, std::string &out);
+
+// Incremental decoder for a request body in arbitrary splits.
+class WireDecoder
+{
+public:
+    using Emit = std::function<void(const double *x, std::size_t n)>;
+
+    explicit WireDecoder(WireFormat format) : format_(format) {}
+
+    // Throws ServiceError(400) on a malformed block.
+    void feed(const char *data, std::size_t len, const Emit &emit);
+
+    // Throws ServiceError(400) if the input stopped part-way through a value or block.
+    void finish();
+
+private:
+    WireFormat format_;
+    unsigned char header_[16];
+    std::size_t headerHave_ = 0;
+    double blockScale_ = 0.0;
+    std::uint32_t blockLeft_ = 0;   // samples still due in the block
+    std::uint32_t bytesLeft_ = 0;   // dvarint payload bytes still due
+    std::int64_t q_ = 0;            // dvarint running value
+    std::uint64_t varint_ = 0;
+    unsigned shift_ = 0;
+    unsigned char partial_[8];
+    std::size_t partialHave_ = 0;
+    double out_[4096];
+    std::size_t outHave_ = 0;
+
+    void push(double x, const Emit &emit);
+};
+
+#endif // ENCODING_H
@@ -0,0 +1,136 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include "estimator.hpp"
+
+using namespace std;
+
+// Two-sided Student-t critical value: the standard normal quantile (by
+// bisection on erfc) and the Cornish-Fisher expansion in 1/dof, good to ~1e-3
+// from 9 degrees of freedom up.
+static double t_critical(double confidence, unsigned long dof)
+{
+    const double p = 0.5 * (1 + confidence);
+    double lo = 0.0, hi = 40.0;
+    for (int i = 0; i < 100; i++)
+    {
+        const double z = 0.5 * (lo + hi);
+        if (0.5 * erfc(-z / sqrt(2.0)) < p)
+        {
+            lo = z;
+        }
+        else
+        {
+            hi = z;
+        }
+    }
+    const double z = 0.5 * (lo + hi);
+    const double n = (double)dof;
+    const double z2 = z * z;
+    return z + z * (z2 + 1) / (4 * n) + z * ((5 * z2 + 16) * z2 + 3) / (96 * n * n) +
+           z * (((3 * z2 + 19) * z2 + 17) * z2 - 15) / (384 * n * n * n);
+}
+
+IbiasEstimate estimate_ibias(SiPM &sipm, double photonsPerDt, const EstimatorOptions &opts)
+{
+    if (!(photonsPerDt >= 0) || !(opts.relativeCi > 0) || !(opts.confidence > 0 && opts.confidence < 1) ||
+        opts.minBatches < 2)
+    {
+        throw invalid_argument("estimate_ibias() needs photonsPerDt >= 0, relativeCi > 0, 0 < confidence < 1 "
+                               "and minBatches >= 2");
+    }
+    // Blocks of 2 tauRecovery, short enough that 2 * minBatches fit in maxSamples
+    const double autoBlock = min(2 * sipm.tauRecovery / sipm.dt, (double)opts.maxSamples / (2.0 * opts.minBatches));
+    const unsigned long block = opts.blockSamples ? opts.blockSamples : max(64UL, (unsigned long)ceil(autoBlock));
+    const unsigned long maxBatches = 4 * opts.minBatches;
+
+    vector<double> in(block, photonsPerDt);
+    vector<double> out(block);
+    vector<double> means; // per-block mean current
+    vector<double> sum1 = {0.0}, sum2 = {0.0}; // prefix sums of the block means and their squares
+    IbiasEstimate est;
+
+    sipm.init_state(photonsPerDt, (unsigned long)min<unsigned long long>(opts.maxSamples, ~0UL));
+    while (est.samples + block <= opts.maxSamples)
+    {
+        sipm.simulate_chunk(in.data(), out.data(), block);
+        est.samples += block;
+        double charge = 0.0;
+        for (double q : out)
+        {
+            charge += q;
+        }
+        means.push_back(charge / (block * sipm.dt));
+        sum1.push_back(sum1.back() + means.back());
+        sum2.push_back(sum2.back() + means.back() * means.back());
+
+        // MSER warm-up: the cut d <= n/2 minimising the variance of the
+        // remaining block means over their count
+        const size_t n = means.size();
+        size_t cut = 0;
+        double best = numeric_limits<double>::max();
+        for (size_t d = 0; d <= n / 2; d++)
+        {
+            const double k = (double)(n - d);
+            const double s1 = sum1[n] - sum1[d];
+            const double mser = max(0.0, (sum2[n] - sum2[d]) - s1 * s1 / k) / (k * k);
+            if (mser < best)
+            {
+                best = mser;
+                cut = d;
+            }
+        }
+
+        // Batch means over the newest blocks after the cut: between
+        // minBatches and maxBatches batches once there are enough blocks
+        const size_t kept = n - cut;
+        const size_t size = max<size_t>(1, kept / maxBatches + (kept % maxBatches != 0));
+        const size_t batches = kept / size;
+        if (batches < opts.minBatches)
+        {
+            continue;
+        }
+        const size_t first = n - batches * size;
+        const double mean = (sum1[n] - sum1[first]) / (double)(batches * size);
+        double var = 0.0;
+        for (size_t b = 0; b < batches; b++)
+        {
+            const size_t lo = first + b * size;
+            const double batch = (sum1[lo + size] - sum1[lo]) / (double)size;
+            var += (batch - mean) * (batch - mean);
+        }
+        var /= (double)(batches - 1);
+
+        est.ibias = mean;
+        est.halfWidth = t_critical(opts.confidence, batches - 1) * sqrt(var / (double)batches);
+        est.warmup = (unsigned long long)first * block;
+        est.batches = (unsigned long)batches;
+        // An all-zero run so far has no spread but says nothing yet, unless
+        // there is no light at all
+        if (est.halfWidth <= opts.relativeCi * fabs(mean) && (mean != 0.0 || photonsPerDt == 0.0))
+        {
+            est.converged = true;
+            break;
+        }
+    }
+    return est;
+}
@@ -0,0 +1,359 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstdio>
+#include "jobs.hpp"
+#include "sipm.hpp"
+#include "service.hpp"
+
+using namespace std;
+
+const char *job_status_name(JobStatus s)
+{
+    switch (s)
+    {
+    case JobStatus::Queued:
+        return "queued";
+    case JobStatus::Running:
+        return "running";
+    case JobStatus::Done:
+        return "done";
+    case JobStatus::Failed:
+        return "failed";
+    case JobStatus::Cancelled:
+        return "cancelled";
+    }
+    return "unknown";
+}
+
+JobManager::JobManager(ComputePool &pool, const string &spoolDir, uint64_t maxSpoolBytes, chrono::seconds ttl,
+                       AdmissionScheduler *scheduler)
+    : pool_(pool), scheduler_(scheduler), spoolDir_(spoolDir), maxSpoolBytes_(maxSpoolBytes), ttl_(ttl)
+{
+    filesystem::create_directories(spoolDir_);
+}
+
+shared_ptr<Job> JobManager::create(const vector<double> &svars, double seedMean, size_t N)
+{
+    purge_expired();
+
+    // Input and output are both N float64 samples.
+    uint64_t need = 2 * (uint64_t)N * sizeof(double);
+    uint64_t used = usedBytes_.load();
+    do
+    {
+        if (used + need > maxSpoolBytes_)
+        {
+            throw ServiceError(507, "job spool is full (" + to_string(used) + " of " +
+                                        to_string(maxSpoolBytes_) + " bytes in use)");
+        }
+    } while (!usedBytes_.compare_exchange_weak(used, used + need));
+
+    auto job = make_shared<Job>();
+    job->id = random_id();
+    job->svars = svars;
+    job->seedMean = seedMean;
+    job->samples = N;
+    job->inputPath = spoolDir_ + "/" + job->id + ".in";
+    job->outputPath = spoolDir_ + "/" + job->id + ".out";
+    job->submitted = chrono::steady_clock::now();
+    job->reservedBytes = need;
+
+    lock_guard<mutex> lock(mutex_);
+    jobs_[job->id] = job;
+    return job;
+}
+
+void JobManager::start(const shared_ptr<Job> &job)
+{
+    if (!scheduler_)
+    {
+        pool_.enqueue([this, job]
+                      { run(job, nullptr); });
+        return;
+    }
+    // Wait for admission off the pool: the job only takes a compute thread
+    // once the scheduler grants it a ticket.
+    const uint64_t numMicrocell = (uint64_t)job->svars[1];
+    const uint64_t chunk = 1u << 16;
+    unsigned long long id = scheduler_->admit_async(
+        job->client, numMicrocell * job->samples, (numMicrocell + 2 * chunk) * sizeof(double),
+        [this, job](shared_ptr<AdmissionScheduler::Ticket> ticket)
+        {
+            pool_.enqueue([this, job, ticket]
+                          { run(job, ticket); });
+        });
+    lock_guard<mutex> lock(job->mutex);
+    job->admission = id;
+}
+
+void JobManager::abandon(const shared_ptr<Job> &job)
+{
+    job->status = JobStatus::Failed;
+    remove(job->id);
+}
+
+shared_ptr<Job> JobManager::find(const string &id)
+{
+    purge_expired();
+    lock_guard<mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    return it == jobs_.end() ? nullptr : it->second;
+}
+
+bool JobManager::remove(const string &id)
+{
+    shared_ptr<Job> job;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = jobs_.find(id);
+        if (it == jobs_.end())
+        {
+            return false;
+        }
+        job = it->second;
+        jobs_.erase(it);
+    }
+    job->cancel = true;
+    lock_guard<mutex> lock(job->mutex);
+    job->removed = true;
+    if (scheduler_ && job->admission && scheduler_->withdraw(job->admission))
+    {
+        // Still waiting for admission, so no worker will ever see it.
+        job->finished = chrono::steady_clock::now();
+        job->status = JobStatus::Cancelled;
+    }
+    JobStatus s = job->status.load();
+    if (s != JobStatus::Queued && s != JobStatus::Running)
+    {
+        discard(*job); // otherwise the worker discards it when it lets go
+    }
+    return true;
+}
+
+void JobManager::purge_expired()
+{
+    auto now = chrono::steady_clock::now();
+    vector<string> expired;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (auto &kv : jobs_)
+        {
+            Job &job = *kv.second;
+            JobStatus s = job.status.load();
+            if (s == JobStatus::Queued || s == JobStatus::Running)
+            {
+                continue;
+            }
+            lock_guard<mutex> jobLock(job.mutex);
+            if (now - job.finished > ttl_)
+            {
+                expired.push_back(kv.first);
+            }
+        }
+    }
+    for (const auto &id : expired)
+    {
+        remove(id);
+    }
+}
+
+void JobManager::release_input(Job &job)
+{
+    uint64_t inBytes = (uint64_t)job.samples * sizeof(double);
+    if (job.reservedBytes >= inBytes)
+    {
+        std::remove(job.inputPath.c_str());
+        job.reservedBytes -= inBytes;
+        usedBytes_ -= inBytes;
+    }
+}
+
+void JobManager::discard(Job &job)
+{
+    if (job.discarded)
+    {
+        return;
+    }
+    std::remove(job.inputPath.c_str());
+    std::remove(job.outputPath.c_str());
+    usedBytes_ -= job.reservedBytes;
+    job.reservedBytes = 0;
+    job.discarded = true;
+}
+
+// Worker body: the same two-pass streaming pipeline as the command line tool,
+// reading the spooled input and writing the spooled result, checking for
+// cancellation between chunks.
+void JobManager::run(const shared_ptr<Job> &job, shared_ptr<AdmissionScheduler::Ticket> ticket)
+{
+    JobStatus final = JobStatus::Done;
+    string error;
+    if (job->cancel)
+    {
+        final = JobStatus::Cancelled;
+    }
+    else
+    {
+        try
+        {
+            const size_t chunk = 1u << 16; // 65536 samples per block
+            SiPM sipm(job->svars);
+            if (job->seeded)
+            {
+                sipm.seed(job->seed);
+            }
+            if (ticket)
+            {
+                ticket->begin();
+            }
+            {
+                lock_guard<mutex> lock(job->mutex);
+                job->started = chrono::steady_clock::now();
+            }
+            job->status = JobStatus::Running;
+            ifstream fin(job->inputPath, ios::binary);
+            ofstream fout(job->outputPath, ios::binary);
+            if (!fin || !fout)
+            {
+                throw runtime_error("cannot open job spool files");
+            }
+            vector<double> inbuf(chunk), outbuf(chunk);
+
+            double mean = job->seedMean;
+            if (mean < 0.0)
+            {
+                double sum = 0.0;
+                streamsize got;
+                while ((got = fin.read(reinterpret_cast<char *>(inbuf.data()), chunk * sizeof(double)).gcount()) > 0)
+                {
+                    for (size_t i = 0; i < (size_t)got / sizeof(double); i++)
+                    {
+                        sum += inbuf[i];
+                    }
+                }
+                mean = job->samples ? sum / (double)job->samples : 0.0;
+                fin.clear();
+                fin.seekg(0);
+            }
+            sipm.init_state(mean, (unsigned long)job->samples);
+
+            streamsize got;
+            while ((got = fin.read(reinterpret_cast<char *>(inbuf.data()), chunk * sizeof(double)).gcount()) > 0)
+            {
+                if (job->cancel)
+                {
+                    final = JobStatus::Cancelled;
+                    break;
+                }
+                size_t n = (size_t)got / sizeof(double);
+                sipm.simulate_chunk(inbuf.data(), outbuf.data(), n);
+                fout.write(reinterpret_cast<const char *>(outbuf.data()), (streamsize)(n * sizeof(double)));
+                job->samplesDone += n;
+            }
+            if (!fout)
+            {
+                throw runtime_error("failed writing job result");
+            }
+        }
+        catch (const exception &e)
+        {
+            final = JobStatus::Failed;
+            error = e.what();
+        }
+    }
+    ticket.reset(); // hand back the admission budgets before reporting
+
+    lock_guard<mutex> lock(job->mutex);
+    job->finished = chrono::steady_clock::now();
+    job->error = error;
+    job->status = final;
+    if (job->removed || final != JobStatus::Done)
+    {
+        discard(*job);
+    }
+    else
+    {
+        release_input(*job);
+    }
+}
+
+string JobManager::status_json(Job &job)
+{
+    JobStatus s = job.status.load();
+    size_t done = job.samplesDone.load();
+    double eta = -1.0;
+    string error;
+    {
+        lock_guard<mutex> lock(job.mutex);
+        error = job.error;
+        if (s == JobStatus::Running && done > 0)
+        {
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - job.started).count();
+            eta = elapsed * (double)(job.samples - done) / (double)done;
+        }
+        else if (s == JobStatus::Done)
+        {
+            eta = 0.0;
+        }
+    }
+    // error strings come from exceptions we raise ourselves; strip quotes and
+    // backslashes rather than carry a full JSON escaper.
+    for (char &c : error)
+    {
+        if (c == '"' || c == '\\' || (unsigned char)c < 0x20)
+        {
+            c = ' ';
+        }
+    }
+    ostringstream o;
+    o << "{\"id\": \"" << job.id << "\", \"status\": \"" << job_status_name(s)
+      << "\", \"samples\": " << job.samples << ", \"samplesDone\": " << done
+      << ", \"etaSeconds\": " << eta << ", \"error\": \"" << error << "\"}\n";
+    return o.str();
+}
+
+void JobManager::cancel_all()
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto &kv : jobs_)
+    {
+        Job &job = *kv.second;
+        job.cancel = true;
+        lock_guard<mutex> jobLock(job.mutex);
+        if (scheduler_ && job.admission && scheduler_->withdraw(job.admission))
+        {
+            job.finished = chrono::steady_clock::now();
+            job.status = JobStatus::Cancelled;
+            discard(job);
+        }
+    }
+}
+
+map<JobStatus, size_t> JobManager::counts()
+{
+    map<JobStatus, size_t> c;
+    lock_guard<mutex> lock(mutex_);
+    for (auto &kv : jobs_)
+    {
+        c[kv.second->status.load()]++;
+    }
+    return c;
+}
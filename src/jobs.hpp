@@ -0,0 +1,126 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "threadpool.hpp"
+#include "scheduler.hpp"
+
+enum class JobStatus
+{
+    Queued,
+    Running,
+    Done,
+    Failed,
+    Cancelled
+};
+
+const char *job_status_name(JobStatus s);
+
+// One asynchronous simulation. The input waveform and the result are spooled
+// to files in the job manager's spool directory; progress is readable while
+// the job runs.
+struct Job
+{
+    std::string id;
+    std::vector<double> svars; // SiPM parameters (dump_configuration() order)
+    double seedMean;           // photons/dt seeding the ages, or < 0 for the input mean
+    bool seeded = false;       // reproducible run from `seed` (X-SiPM-Seed)
+    std::uint64_t seed = 0;
+    std::string client;        // submitter's fair-queue flow (client_id())
+    std::size_t samples;
+    std::string inputPath, outputPath;
+
+    std::atomic<JobStatus> status{JobStatus::Queued};
+    std::atomic<std::size_t> samplesDone{0};
+    std::atomic<bool> cancel{false};
+
+    std::mutex mutex; // guards the fields below
+    std::chrono::steady_clock::time_point submitted, started, finished;
+    std::string error;
+    bool removed = false;   // DELETEd (or expired); files go once the job is idle
+    bool discarded = false; // files deleted and spool space released
+    std::uint64_t reservedBytes = 0;
+    unsigned long long admission = 0; // pending AdmissionScheduler::admit_async() request
+};
+
+// Owns the asynchronous jobs behind the server's /jobs API. Jobs run on a
+// dedicated ComputePool; their files live in a spool directory bounded to
+// `maxSpoolBytes` (input + output reserved at submission). Finished jobs are
+// kept for `ttl` after completion, then purged. If a scheduler is given, each
+// job also waits for admission against the global budgets, in its submitter's
+// flow, before it is handed to the pool; a queued job holds no pool thread
+// and can be cancelled while it waits.
+class JobManager
+{
+public:
+    JobManager(ComputePool &pool, const std::string &spoolDir, std::uint64_t maxSpoolBytes,
+               std::chrono::seconds ttl, AdmissionScheduler *scheduler = nullptr);
+
+    // Reserve spool space for a job of N samples and register it (not yet
+    // runnable). Throws ServiceError(507) if the spool is full.
+    std::shared_ptr<Job> create(const std::vector<double> &svars, double seedMean, std::size_t N);
+
+    // Queue a created job once its input file is fully written.
+    void start(const std::shared_ptr<Job> &job);
+
+    // Drop a created job whose input never arrived.
+    void abandon(const std::shared_ptr<Job> &job);
+
+    std::shared_ptr<Job> find(const std::string &id);
+
+    // Cancel a job and delete its files. Returns false for an unknown id.
+    bool remove(const std::string &id);
+
+    std::string status_json(Job &job);
+
+    // Ask every queued or running job to stop (used at server shutdown).
+    void cancel_all();
+
+    std::map<JobStatus, std::size_t> counts();
+    std::uint64_t spool_bytes() const { return usedBytes_.load(); }
+
+    JobManager(JobManager const &) = delete;
+    void operator=(JobManager const &) = delete;
+
+private:
+    ComputePool &pool_;
+    AdmissionScheduler *scheduler_;
+    std::string spoolDir_;
+    std::uint64_t maxSpoolBytes_;
+    std::chrono::seconds ttl_;
+    std::atomic<std::uint64_t> usedBytes_{0};
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Job>> jobs_;
+
+    void run(const std::shared_ptr<Job> &job, std::shared_ptr<AdmissionScheduler::Ticket> ticket);
+    void purge_expired();
+    void discard(Job &job); // job.mutex must be held
+    void release_input(Job &job);
+};
+
+#endif // JOBS_H
@@ -24,8 +24,13 @@
 #include <chrono>
 #include <ctime>
 #include <cstdio>
+#include <memory>
 #include "sipm.hpp"
 #include "utilities.hpp"
+#include "trace.hpp"
+#include "perfcounters.hpp"
+#include "estimator.hpp"
+#include "simd.hpp"
 
 using namespace std;
 
@@ -69,19 +74,255 @@ void print_info(chrono::duration<double> elapsed, SiPM &sipm, size_t inputSize,
     wcout << "Simulated Ibias:\t" << val << " " << prefix << "A" << endl;
 }
 
+static const char *recovery_name(Recovery model)
+{
+    switch (model)
+    {
+    case Recovery::Exact:
+        return "exact";
+    case Recovery::FastExp:
+        return "fast";
+    default:
+        return "lut";
+    }
+}
+
+// Engine counters and the regime they put the run in (--stats / --stats-json).
+// Occupancy is the mean number of photons per microcell per recovery time
+// constant: well below 1 the response is linear, around 1 it compresses, and
+// well above it the array is saturated.
+void print_stats(const SiPM &sipm, size_t inputSize, chrono::duration<double> elapsed, bool json)
+{
+    EngineStats st = sipm.engine_stats();
+    const double steps = inputSize ? (double)inputSize : 1.0;
+    const double photons = st.photons ? (double)st.photons : 1.0;
+    const double strikes = st.photons > st.alreadyFired ? (double)(st.photons - st.alreadyFired) : 1.0;
+    const double perStep = (double)st.photons / steps;
+    const double occupancy = perStep * (sipm.tauRecovery / sipm.dt) / (double)sipm.numMicrocell;
+    const char *regime = occupancy < 0.1 ? "linear" : occupancy < 1.0 ? "compressing" : "saturated";
+    const RecoveryError recovery = sipm.recovery_error();
+
+    if (json)
+    {
+        cout << "{\"counters\": " << (SiPM::ENGINE_STATS ? "true" : "false") << ", \"samples\": " << inputSize
+             << ", \"elapsedSeconds\": " << elapsed.count() << ", \"numMicrocell\": " << sipm.numMicrocell
+             << ", \"photons\": " << st.photons << ", \"alreadyFired\": " << st.alreadyFired
+             << ", \"pdeRejected\": " << st.pdeRejected << ", \"subThreshold\": " << st.subThreshold
+             << ", \"detections\": " << st.detections << ", \"lutSaturated\": " << st.lutSaturated
+             << ", \"photonsPerStep\": " << perStep << ", \"occupancy\": " << occupancy << ", \"regime\": \""
+             << regime << "\", \"recovery\": \"" << recovery_name(sipm.recovery())
+             << "\", \"recoveryErrorVolt\": " << recovery.volt << ", \"recoveryErrorPde\": " << recovery.pde << "}"
+             << endl;
+        return;
+    }
+    if (!SiPM::ENGINE_STATS)
+    {
+        cout << "Engine counters compiled out (rebuild with SIMSPAD_ENGINE_STATS=1)." << endl;
+        return;
+    }
+    auto row = [&](const char *name, unsigned long long n, double of)
+    {
+        printf("%-22s%16llu  %6.2f%%\n", name, n, 100.0 * (double)n / of);
+    };
+    cout << "\nEngine counters:" << endl;
+    printf("%-22s%16llu  (%.4g per step)\n", "Photons:", st.photons, perStep);
+    row("  already fired:", st.alreadyFired, photons);
+    row("  PDE rejected:", st.pdeRejected, photons);
+    row("  sub-threshold:", st.subThreshold, photons);
+    row("  detected:", st.detections, photons);
+    row("Past the LUT range:", st.lutSaturated, strikes);
+    printf("%-22s%16.4g  (%s)\n", "Occupancy:", occupancy, regime);
+    printf("%-22s%16s  (max error %.2g of vOver, %.2g of pdeMax)\n", "Recovery model:",
+           recovery_name(sipm.recovery()), recovery.volt, recovery.pde);
+    fflush(stdout);
+}
+
+// Hardware counters over the simulate_chunk() calls, per microcell-step
+// (--perf). Counters the machine does not offer are left out.
+void print_perf(const PerfCounters &perf, double cellSteps, bool json)
+{
+    if (!perf.available())
+    {
+        if (json)
+        {
+            cout << "{\"perfCounters\": false, \"error\": \"" << perf.error() << "\"}" << endl;
+        }
+        else
+        {
+            cerr << "Hardware counters unavailable: " << perf.error() << endl;
+        }
+        return;
+    }
+    PerfCounters::Reading r = perf.read();
+    const double per = cellSteps > 0.0 ? cellSteps : 1.0;
+    if (json)
+    {
+        cout << "{\"perfCounters\": true, \"microcellSteps\": " << cellSteps << ", \"perMicrocellStep\": {";
+        const char *sep = "";
+        for (int c = 0; c < PerfCounters::COUNTERS; c++)
+        {
+            if (r.valid[c])
+            {
+                cout << sep << "\"" << PerfCounters::name((PerfCounters::Counter)c) << "\": " << r.value[c] / per;
+                sep = ", ";
+            }
+        }
+        cout << "}}" << endl;
+        return;
+    }
+    cout << "\nHardware counters (simulate_chunk):" << endl;
+    printf("%-16s%18s%16s\n", "", "total", "per uCell step");
+    for (int c = 0; c < PerfCounters::COUNTERS; c++)
+    {
+        if (r.valid[c])
+        {
+            printf("%-16s%18.0f%16.4g\n", PerfCounters::name((PerfCounters::Counter)c), r.value[c], r.value[c] / per);
+        }
+    }
+    if (r.valid[PerfCounters::CYCLES] && r.valid[PerfCounters::INSTRUCTIONS] && r.value[PerfCounters::CYCLES] > 0.0)
+    {
+        printf("%-16s%18.3f\n", "IPC", r.value[PerfCounters::INSTRUCTIONS] / r.value[PerfCounters::CYCLES]);
+    }
+    fflush(stdout);
+}
+
+// Command line settings, as parsed by main().
+struct SimulateOptions
+{
+    string params;          // JSON device parameters
+    string input;           // .npy light waveform
+    string output;          // dense .npy response (may be empty)
+    string events;          // sparse detection-event list (may be empty)
+    string index;           // chunk index beside the response (may be empty)
+    string trace;           // Chrome trace of every stage of every chunk (may be empty)
+    long long seed = -1;    // non-negative: reproducible run
+    bool silence = false;
+    bool stats = false;
+    bool statsJson = false;
+    bool perf = false;      // count hardware events over the simulation proper
+    Recovery recovery = Recovery::LUT;
+    double expError = 1e-9; // bound on the polynomial exp of Recovery::FastExp
+};
+
+// Analytic DC response of the device at each flux in photons/dt
+// (--steady-state), without simulating: a table, or one JSON line per flux.
+// A positive `mcCi` adds a Monte Carlo estimate of Ibias per flux, simulated
+// until its 95% CI is within that fraction, with the chosen recovery model
+// and (if non-negative) seed.
+void print_steady_state(const SimulateOptions &opts, const vector<double> &fluxes, double mcCi)
+{
+    SiPM sipm = load_params_json(opts.params);
+    sipm.set_recovery(opts.recovery, opts.expError);
+    vector<SteadyState> rows;
+    for (double flux : fluxes)
+    {
+        rows.push_back(sipm.steady_state(flux)); // throws on a bad flux before any output
+    }
+    if (!opts.statsJson)
+    {
+        printf("%12s%14s%14s%10s%10s%14s%14s", "photons/dt", "photons/s", "detections/s", "PDE", "Vover",
+               "charge (C)", "Ibias (A)");
+        if (mcCi > 0)
+        {
+            printf("%14s%12s%10s", "MC Ibias (A)", "CI (A)", "samples");
+        }
+        printf("\n");
+    }
+    EstimatorOptions mcOpts;
+    mcOpts.relativeCi = mcCi;
+    for (size_t i = 0; i < fluxes.size(); i++)
+    {
+        const double flux = fluxes[i];
+        const SteadyState &ss = rows[i];
+        IbiasEstimate mc;
+        if (mcCi > 0)
+        {
+            if (opts.seed >= 0)
+            {
+                sipm.seed((uint64_t)opts.seed);
+            }
+            mc = estimate_ibias(sipm, flux, mcOpts);
+        }
+        if (opts.statsJson)
+        {
+            cout << "{\"photonsPerDt\": " << flux << ", \"photonRate\": " << ss.photonRate
+                 << ", \"detectionRate\": " << ss.detectionRate << ", \"effectivePde\": " << ss.effectivePde
+                 << ", \"meanOvervoltage\": " << ss.meanOvervoltage << ", \"meanCharge\": " << ss.meanCharge
+                 << ", \"ibias\": " << ss.ibias;
+            if (mcCi > 0)
+            {
+                cout << ", \"mcIbias\": " << mc.ibias << ", \"mcHalfWidth\": " << mc.halfWidth
+                     << ", \"mcSamples\": " << mc.samples << ", \"mcConverged\": " << (mc.converged ? "true" : "false");
+            }
+            cout << "}" << endl;
+        }
+        else
+        {
+            printf("%12.5g%14.5g%14.5g%10.4f%10.4f%14.5g%14.5g", flux, ss.photonRate, ss.detectionRate,
+                   ss.effectivePde, ss.meanOvervoltage, ss.meanCharge, ss.ibias);
+            if (mcCi > 0)
+            {
+                printf("%14.5g%12.2g%10llu%s", mc.ibias, mc.halfWidth, mc.samples, mc.converged ? "" : " (max samples)");
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+    fflush(stdout);
+}
+
 // Run a simulation streaming a .npy waveform through the SiPM in bounded
 // memory: JSON device parameters + .npy light in -> .npy charge out. The
 // transform is length-preserving, so the output header is written before its
 // body. Two passes over the (paged) input: one to seed the initial microcell
 // age distribution from the mean light level, one to simulate.
-void simulate(string params_file, string fname_in, string fname_out, bool silence)
+void simulate(const SimulateOptions &opts)
 {
     const size_t chunk = 1u << 16; // 65536 samples per block
 
-    SiPM sipm = load_params_json(params_file);
-    NpyReader reader(fname_in);
+    SiPM sipm = load_params_json(opts.params);
+    sipm.set_recovery(opts.recovery, opts.expError);
+    if (opts.seed >= 0)
+    {
+        sipm.seed((uint64_t)opts.seed);
+    }
+    NpyReader reader(opts.input);
     size_t N = reader.count();
-    NpyWriter writer(fname_out, N);
+
+    unique_ptr<Tracer> tracer;
+    if (!opts.trace.empty())
+    {
+        tracer = make_unique<Tracer>(1u << 18);
+    }
+    Tracer *trace = tracer.get();
+    long long chunkNo = 0;
+    unique_ptr<PerfCounters> counters;
+    if (opts.perf)
+    {
+        counters = make_unique<PerfCounters>();
+    }
+    auto read_chunk = [&](double *buf, const char *stage)
+    {
+        TraceSpan span(trace, stage, chunkNo);
+        return reader.read(buf, chunk);
+    };
+    unique_ptr<NpyWriter> writer;
+    if (!opts.output.empty())
+    {
+        writer = make_unique<NpyWriter>(opts.output, N);
+    }
+    unique_ptr<ChunkIndexWriter> indexWriter;
+    if (writer && !opts.index.empty())
+    {
+        indexWriter = make_unique<ChunkIndexWriter>(opts.index, writer->data_offset());
+    }
+    unique_ptr<NpyEventWriter> eventWriter;
+    vector<DetectionEvent> events;
+    if (!opts.events.empty())
+    {
+        eventWriter = make_unique<NpyEventWriter>(opts.events);
+        sipm.set_event_sink(&events);
+    }
 
     // Pass 1: mean photons/dt over the whole trace (raw, matching the old
     // in-memory init_spads) to seed the initial age distribution.
@@ -89,58 +330,117 @@ void simulate(string params_file, string fname_in, string fname_out, bool silenc
     {
         vector<double> buf(chunk);
         size_t got;
-        while ((got = reader.read(buf.data(), chunk)) > 0)
+        while ((got = read_chunk(buf.data(), "read (mean)")) > 0)
         {
-            for (size_t i = 0; i < got; i++)
-            {
-                rawSum += buf[i];
-            }
+            rawSum += simd().summarise(buf.data(), got).sum;
+            chunkNo++;
         }
     }
     double mean = N ? rawSum / (double)N : 0.0;
-    sipm.init_state(mean, (unsigned long)N);
+    {
+        TraceSpan span(trace, "init_state");
+        sipm.init_state(mean, (unsigned long)N);
+    }
 
     // Pass 2: stream the simulation, writing each output block as it is made.
     reader.rewind();
     auto start = chrono::steady_clock::now();
     double outSum = 0.0;
+    chunkNo = 0;
     {
         vector<double> inbuf(chunk), outbuf(chunk);
         size_t got, done = 0;
-        while ((got = reader.read(inbuf.data(), chunk)) > 0)
+        unsigned long long lastDetections = 0;
+        while ((got = read_chunk(inbuf.data(), "read")) > 0)
         {
-            sipm.simulate_chunk(inbuf.data(), outbuf.data(), got);
-            writer.write(outbuf.data(), got);
-            for (size_t i = 0; i < got; i++)
             {
-                outSum += outbuf[i];
+                TraceSpan span(trace, "simulate", chunkNo);
+                if (counters)
+                {
+                    counters->start();
+                }
+                sipm.simulate_chunk(inbuf.data(), outbuf.data(), got);
+                if (counters)
+                {
+                    counters->stop();
+                }
+            }
+            if (writer)
+            {
+                TraceSpan span(trace, "write", chunkNo);
+                writer->write(outbuf.data(), got);
             }
+            if (indexWriter)
+            {
+                TraceSpan span(trace, "index", chunkNo);
+                unsigned long long det = sipm.detection_count();
+                indexWriter->add_chunk(outbuf.data(), got, det - lastDetections);
+                lastDetections = det;
+            }
+            if (eventWriter)
+            {
+                TraceSpan span(trace, "write events", chunkNo);
+                eventWriter->write(events.data(), events.size());
+                events.clear();
+            }
+            chunkNo++;
+            outSum += simd().summarise(outbuf.data(), got).sum;
             done += got;
-            if (!silence && N)
+            if (!opts.silence && N)
             {
                 fprintf(stderr, "\r  simulating... %5.1f%%", 100.0 * (double)done / (double)N);
             }
         }
-        if (!silence && N)
+        if (!opts.silence && N)
         {
             fprintf(stderr, "\r  simulating... done   \n");
         }
     }
-    writer.close();
+    {
+        TraceSpan span(trace, "close");
+        if (writer)
+        {
+            writer->close();
+        }
+        if (indexWriter)
+        {
+            indexWriter->close();
+        }
+        if (eventWriter)
+        {
+            eventWriter->close();
+        }
+    }
     auto end = chrono::steady_clock::now();
+    if (tracer)
+    {
+        tracer->write_json(opts.trace);
+    }
 
     chrono::duration<double> elapsed = end - start;
 
-    if (!silence)
+    if (!opts.silence)
     {
         print_info(elapsed, sipm, N, outSum);
+        if (eventWriter)
+        {
+            cout << "Detection Events:\t" << eventWriter->count() << endl;
+        }
+    }
+    if (opts.stats || opts.statsJson)
+    {
+        print_stats(sipm, N, elapsed, opts.statsJson);
+    }
+    if (counters)
+    {
+        print_perf(*counters, (double)N * (double)sipm.numMicrocell, opts.statsJson);
     }
 }
 
 // Print version number
 static void print_version()
 {
-    cout << "SimSPAD " << VERSION << endl;
+    cout << "SimSPAD " << VERSION << " (" << isa_name(simd().isa) << " kernels)" << endl;
 }
 
 // Print help text
@@ -149,14 +449,28 @@ static void show_usage(string name)
     cerr << "Usage: " << name << " -p PARAMS.json -i LIGHT.npy -o OUT.npy <option(s)>\n"
          << "Reads device parameters from a flat JSON file and the optical input\n"
          << "from a 1-D float64 .npy file, streams the simulation, and writes the\n"
-         << "charge-per-step response to a 1-D float64 .npy file.\n\n"
+         << "charge-per-step response to a 1-D float64 .npy file and/or a sparse\n"
+         << "list of detection events (step, cell, charge) to a structured .npy.\n\n"
          << "Options:\n"
          << "\t-h,--help\t\tShow this help message\n"
          << "\t-s,--silent\t\tSilence output\n"
          << "\t-v,--version\t\tPrint SimSPAD version number\n"
          << "\t-p,--params PARAMS\tDevice parameters (.json) [required]\n"
          << "\t-i,--input INPUT\tOptical input waveform (.npy) [required]\n"
-         << "\t-o,--output OUTPUT\tResponse output path (.npy) [required]"
+         << "\t-o,--output OUTPUT\tResponse output path (.npy)\n"
+         << "\t-e,--events EVENTS\tDetection-event output path (.npy)\n"
+         << "\t-x,--index INDEX\tChunk index / min-max pyramid path (needs --output)\n"
+         << "\t-S,--seed SEED\t\tSeed the random engines for a reproducible run\n"
+         << "\t--stats\t\t\tPrint the engine counters and the run's regime\n"
+         << "\t--stats-json\t\tThe same as one line of JSON (with -s, the only output)\n"
+         << "\t--recovery MODEL\tMicrocell recovery: lut (default), exact or fast\n"
+         << "\t--exp-error ERROR\tRelative error bound of fast recovery's exp (default 1e-9)\n"
+         << "\t--perf\t\t\tCount hardware events (cycles, cache/TLB/branch misses)\n"
+         << "\t--trace TRACE\t\tWrite per-chunk stage timings as a Chrome trace (.json)\n"
+         << "\t--steady-state FLUX\tPrint the analytic DC response at FLUX[,FLUX...] photons/dt\n"
+         << "\t\t\t\tinstead of simulating (needs only --params)\n"
+         << "\t--mc-ci CI\t\tWith --steady-state, also simulate Ibias to a relative 95% CI\n"
+         << "At least one of --output and --events is required."
          << endl;
 }
 
@@ -187,10 +501,9 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    string params = "";
-    string source = "";
-    string destination = "";
-    bool silence = false;
+    SimulateOptions opts;
+    vector<double> steadyFluxes;
+    double mcCi = 0.0;
 
     // Small helper to consume an option's argument.
     auto take_arg = [&](int &i, const char *opt) -> const char * {
@@ -212,54 +525,181 @@ int main(int argc, char *argv[])
         }
         else if ((arg == "-s") || (arg == "--silent"))
         {
-            silence = true;
+            opts.silence = true;
         }
         else if ((arg == "-v") || (arg == "--version"))
         {
             print_version();
         }
+        else if (arg == "--stats")
+        {
+            opts.stats = true;
+        }
+        else if (arg == "--stats-json")
+        {
+            opts.statsJson = true;
+        }
+        else if (arg == "--perf")
+        {
+            opts.perf = true;
+        }
+        else if (arg == "--recovery")
+        {
+            const char *a = take_arg(i, "--recovery");
+            if (!a)
+                return EXIT_FAILURE;
+            string model = a;
+            if (model == "lut")
+                opts.recovery = Recovery::LUT;
+            else if (model == "exact")
+                opts.recovery = Recovery::Exact;
+            else if (model == "fast")
+                opts.recovery = Recovery::FastExp;
+            else
+            {
+                cerr << "--recovery must be lut, exact or fast." << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--exp-error")
+        {
+            const char *a = take_arg(i, "--exp-error");
+            if (!a)
+                return EXIT_FAILURE;
+            opts.expError = atof(a);
+            if (!(opts.expError > 0.0))
+            {
+                cerr << "--exp-error must be positive." << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--steady-state")
+        {
+            const char *a = take_arg(i, "--steady-state");
+            if (!a)
+                return EXIT_FAILURE;
+            for (const char *p = a;; p++)
+            {
+                char *end;
+                const double flux = strtod(p, &end);
+                if (end == p || !(flux >= 0.0) || (*end != ',' && *end != '\0'))
+                {
+                    cerr << "--steady-state expects non-negative photons/dt, separated by commas." << endl;
+                    return EXIT_FAILURE;
+                }
+                steadyFluxes.push_back(flux);
+                p = end;
+                if (*p == '\0')
+                    break;
+            }
+        }
+        else if (arg == "--mc-ci")
+        {
+            const char *a = take_arg(i, "--mc-ci");
+            if (!a)
+                return EXIT_FAILURE;
+            mcCi = atof(a);
+            if (!(mcCi > 0.0 && mcCi < 1.0))
+            {
+                cerr << "--mc-ci must be between 0 and 1." << endl;
+                return EXIT_FAILURE;
+            }
+        }
         else if ((arg == "-p") || (arg == "--params"))
         {
             const char *a = take_arg(i, "--params");
             if (!a)
                 return EXIT_FAILURE;
-            params = a;
+            opts.params = a;
         }
         else if ((arg == "-i") || (arg == "--input"))
         {
             const char *a = take_arg(i, "--input");
             if (!a)
                 return EXIT_FAILURE;
-            source = a;
+            opts.input = a;
         }
         else if ((arg == "-o") || (arg == "--output"))
         {
             const char *a = take_arg(i, "--output");
             if (!a)
                 return EXIT_FAILURE;
-            destination = a;
+            opts.output = a;
+        }
+        else if ((arg == "-e") || (arg == "--events"))
+        {
+            const char *a = take_arg(i, "--events");
+            if (!a)
+                return EXIT_FAILURE;
+            opts.events = a;
+        }
+        else if ((arg == "-x") || (arg == "--index"))
+        {
+            const char *a = take_arg(i, "--index");
+            if (!a)
+                return EXIT_FAILURE;
+            opts.index = a;
+        }
+        else if (arg == "--trace")
+        {
+            const char *a = take_arg(i, "--trace");
+            if (!a)
+                return EXIT_FAILURE;
+            opts.trace = a;
+        }
+        else if ((arg == "-S") || (arg == "--seed"))
+        {
+            const char *a = take_arg(i, "--seed");
+            if (!a)
+                return EXIT_FAILURE;
+            char *end;
+            opts.seed = strtoll(a, &end, 10);
+            if (*a == '\0' || *end != '\0' || opts.seed < 0)
+            {
+                cerr << "error: --seed expects a non-negative integer." << endl;
+                return EXIT_FAILURE;
+            }
         }
         else
         {
-            source = argv[i]; // bare positional argument is the input waveform
+            opts.input = argv[i]; // bare positional argument is the input waveform
         }
     }
 
-    if (params.empty() || source.empty() || destination.empty())
+    if (!steadyFluxes.empty() && !opts.params.empty())
     {
-        cerr << "error: --params, --input and --output are all required." << endl;
+        try
+        {
+            print_steady_state(opts, steadyFluxes, mcCi);
+        }
+        catch (const std::exception &e)
+        {
+            cerr << "error: " << e.what() << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (opts.params.empty() || opts.input.empty() || (opts.output.empty() && opts.events.empty()))
+    {
+        cerr << "error: --params, --input and one of --output/--events are required." << endl;
         show_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    if (!opts.index.empty() && opts.output.empty())
+    {
+        cerr << "error: --index requires --output." << endl;
+        return EXIT_FAILURE;
+    }
 
-    if (!silence)
+    if (!opts.silence)
     {
         cli_logo();
     }
 
     try
     {
-        simulate(params, source, destination, silence);
+        simulate(opts);
     }
     catch (const std::exception &e)
     {
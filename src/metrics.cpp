@@ -0,0 +1,239 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include "metrics.hpp"
+
+using namespace std;
+
+namespace
+{
+atomic<uint64_t> registries{0};
+
+// Single-writer update: no locked instruction needed.
+inline void bump(atomic<uint64_t> &slot, uint64_t n)
+{
+    slot.store(slot.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+inline double as_double(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof d);
+    return d;
+}
+
+inline uint64_t as_bits(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof bits);
+    return bits;
+}
+}
+
+MetricsRegistry::MetricsRegistry() : serial_(++registries) {}
+
+MetricsRegistry::~MetricsRegistry() = default;
+
+MetricsRegistry::Shard::~Shard()
+{
+    for (size_t r = 0; r < nRows; r++)
+    {
+        delete[] rows[r].load(memory_order_relaxed);
+    }
+}
+
+MetricsRegistry::Id MetricsRegistry::declare(Family family, size_t slots, size_t rows)
+{
+    if (frozen_.load(memory_order_acquire))
+    {
+        throw logic_error("metric family declared after the first update: " + family.name);
+    }
+    family.slot = family.kind == Kind::Requests ? nRows_ : nSlots_;
+    nSlots_ += slots;
+    nRows_ += rows;
+    families_.push_back(std::move(family));
+    return families_.size() - 1;
+}
+
+MetricsRegistry::Id MetricsRegistry::counter(const string &name, const string &help)
+{
+    return declare({Kind::Counter, name, help, {}, {}, 0}, 1, 0);
+}
+
+MetricsRegistry::Id MetricsRegistry::histogram(const string &name, const string &help, vector<double> bounds)
+{
+    size_t slots = bounds.size() + 2;
+    return declare({Kind::Histogram, name, help, std::move(bounds), {}, 0}, slots, 0);
+}
+
+MetricsRegistry::Id MetricsRegistry::request_counter(const string &name, const string &help, vector<string> paths)
+{
+    size_t rows = paths.size();
+    return declare({Kind::Requests, name, help, {}, std::move(paths), 0}, 0, rows);
+}
+
+// This thread's shard, found once and then cached (keyed by registry serial,
+// so a registry later built at the same address is not confused with this one).
+MetricsRegistry::Shard &MetricsRegistry::shard()
+{
+    thread_local uint64_t cachedSerial = 0;
+    thread_local Shard *cached = nullptr;
+    if (cachedSerial == serial_)
+    {
+        return *cached;
+    }
+    lock_guard<mutex> lock(mutex_);
+    frozen_.store(true, memory_order_release);
+    const thread::id me = this_thread::get_id();
+    Shard *found = nullptr;
+    for (auto &s : shards_)
+    {
+        if (s->owner == me)
+        {
+            found = s.get();
+        }
+    }
+    if (!found)
+    {
+        auto s = make_unique<Shard>();
+        s->owner = me;
+        s->slots.reset(new atomic<uint64_t>[nSlots_]());
+        s->rows.reset(new atomic<atomic<uint64_t> *>[nRows_]());
+        s->nRows = nRows_;
+        found = s.get();
+        shards_.push_back(std::move(s));
+    }
+    cachedSerial = serial_;
+    cached = found;
+    return *found;
+}
+
+void MetricsRegistry::add(Id counter, uint64_t n)
+{
+    bump(shard().slots[families_[counter].slot], n);
+}
+
+void MetricsRegistry::observe(Id histogram, double value)
+{
+    const Family &f = families_[histogram];
+    size_t bucket = 0;
+    while (bucket < f.bounds.size() && value > f.bounds[bucket])
+    {
+        bucket++;
+    }
+    atomic<uint64_t> *slots = &shard().slots[f.slot];
+    bump(slots[bucket], 1);
+    atomic<uint64_t> &sum = slots[f.bounds.size() + 1];
+    sum.store(as_bits(as_double(sum.load(memory_order_relaxed)) + value), memory_order_relaxed);
+}
+
+void MetricsRegistry::count_request(Id counter, size_t path, int status)
+{
+    const Family &f = families_[counter];
+    if (path >= f.paths.size() || status < 0 || status >= STATUSES)
+    {
+        return;
+    }
+    atomic<atomic<uint64_t> *> &row = shard().rows[f.slot + path];
+    atomic<uint64_t> *counts = row.load(memory_order_acquire);
+    if (!counts)
+    {
+        counts = new atomic<uint64_t>[STATUSES]();
+        row.store(counts, memory_order_release);
+    }
+    bump(counts[status], 1);
+}
+
+string MetricsRegistry::render() const
+{
+    lock_guard<mutex> lock(mutex_);
+    ostringstream out;
+    out.precision(12);
+    for (const Family &f : families_)
+    {
+        out << "# HELP " << f.name << " " << f.help << "\n";
+        out << "# TYPE " << f.name << " " << (f.kind == Kind::Histogram ? "histogram" : "counter") << "\n";
+        if (f.kind == Kind::Counter)
+        {
+            uint64_t total = 0;
+            for (const auto &s : shards_)
+            {
+                total += s->slots[f.slot].load(memory_order_relaxed);
+            }
+            out << f.name << " " << total << "\n";
+        }
+        else if (f.kind == Kind::Histogram)
+        {
+            vector<uint64_t> buckets(f.bounds.size() + 1, 0);
+            double sum = 0.0;
+            for (const auto &s : shards_)
+            {
+                for (size_t b = 0; b < buckets.size(); b++)
+                {
+                    buckets[b] += s->slots[f.slot + b].load(memory_order_relaxed);
+                }
+                sum += as_double(s->slots[f.slot + buckets.size()].load(memory_order_relaxed));
+            }
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < buckets.size(); b++)
+            {
+                cumulative += buckets[b];
+                out << f.name << "_bucket{le=\"";
+                if (b < f.bounds.size())
+                {
+                    out << f.bounds[b];
+                }
+                else
+                {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << f.name << "_sum " << sum << "\n";
+            out << f.name << "_count " << cumulative << "\n";
+        }
+        else
+        {
+            for (size_t p = 0; p < f.paths.size(); p++)
+            {
+                vector<uint64_t> counts(STATUSES, 0);
+                bool any = false;
+                for (const auto &s : shards_)
+                {
+                    const atomic<uint64_t> *row = s->rows[f.slot + p].load(memory_order_acquire);
+                    for (int st = 0; row && st < STATUSES; st++)
+                    {
+                        counts[st] += row[st].load(memory_order_relaxed);
+                        any = true;
+                    }
+                }
+                for (int st = 0; any && st < STATUSES; st++)
+                {
+                    if (counts[st])
+                    {
+                        out << f.name << "{path=\"" << f.paths[p] << "\",status=\"" << st << "\"} " << counts[st]
+                            << "\n";
+                    }
+                }
+            }
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Counters and histograms for GET /metrics, cheap enough for every request.
+// Each thread updates its own shard with plain relaxed loads and stores (a
+// shard has a single writer, so no lock or locked read-modify-write is
+// needed); render() sums the shards. Families are declared up front, before
+// the first update, so the hot path never allocates except the first time a
+// thread counts a given request path.
+class MetricsRegistry
+{
+public:
+    using Id = std::size_t;
+
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    // Declare a family. Throws std::logic_error once updates have begun.
+    Id counter(const std::string &name, const std::string &help);
+    // `bounds` are the ascending upper bounds of the buckets (+Inf is implied).
+    Id histogram(const std::string &name, const std::string &help, std::vector<double> bounds);
+    // A counter labelled by path (one of `paths`) and HTTP status code.
+    Id request_counter(const std::string &name, const std::string &help, std::vector<std::string> paths);
+
+    void add(Id counter, std::uint64_t n = 1);
+    void observe(Id histogram, double value);
+    void count_request(Id counter, std::size_t path, int status);
+
+    // Prometheus text exposition format.
+    std::string render() const;
+
+private:
+    static constexpr int STATUSES = 1000;
+
+    enum class Kind
+    {
+        Counter,
+        Histogram,
+        Requests
+    };
+    struct Family
+    {
+        Kind kind;
+        std::string name, help;
+        std::vector<double> bounds;
+        std::vector<std::string> paths;
+        std::size_t slot; // first slot (counters, histograms) or row (requests)
+    };
+    // Histograms take one slot per bucket plus one for the sum (as double bits).
+    struct Shard
+    {
+        std::thread::id owner;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> slots;
+        std::unique_ptr<std::atomic<std::atomic<std::uint64_t> *>[]> rows; // per path, STATUSES counts
+        std::size_t nRows = 0;
+        ~Shard();
+    };
+
+    std::vector<Family> families_;
+    std::size_t nSlots_ = 0, nRows_ = 0;
+    const std::uint64_t serial_;
+    std::atomic<bool> frozen_{false};
+    mutable std::mutex mutex_; // guards shards_
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    Id declare(Family family, std::size_t slots, std::size_t rows);
+    Shard &shard();
+};
+
+#endif // METRICS_H
@@ -0,0 +1,188 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include "microbatch.hpp"
+
+using namespace std;
+
+MicroBatcher::MicroBatcher(AdmissionScheduler &scheduler, chrono::microseconds window, size_t maxSamples,
+                           size_t maxLanes)
+    : scheduler_(scheduler), window_(window), maxSamples_(maxSamples), maxLanes_(maxLanes ? maxLanes : 1)
+{
+}
+
+bool MicroBatcher::eligible(const SimulationRequest &req) const
+{
+    return window_.count() > 0 && !req.seeded && !req.events && req.samples > 0 && req.samples <= maxSamples_;
+}
+
+string MicroBatcher::run(SimulationRun &run, const vector<double> &in)
+{
+    const vector<double> &svars = run.request().svars;
+    const string key(reinterpret_cast<const char *>(svars.data()), svars.size() * sizeof(double));
+    Lane lane;
+    lane.run = &run;
+    lane.in = &in;
+
+    unique_lock<mutex> lock(mutex_);
+    shared_ptr<Batch> &slot = open_[key];
+    const bool leader = !slot;
+    if (leader)
+    {
+        slot = make_shared<Batch>();
+    }
+    shared_ptr<Batch> batch = slot;
+    batch->lanes.push_back(&lane);
+    if (batch->lanes.size() >= maxLanes_)
+    {
+        batch->closed = true;
+        open_.erase(key);
+        cv_.notify_all();
+    }
+
+    if (!leader)
+    {
+        cv_.wait(lock, [&]
+                 { return lane.status != 0; });
+    }
+    else
+    {
+        // Gather only while the server is busy anyway; alone, run at once.
+        if (!batch->closed && scheduler_.stats().running > 0)
+        {
+            cv_.wait_for(lock, window_, [&]
+                         { return batch->closed; });
+        }
+        if (!batch->closed)
+        {
+            batch->closed = true;
+            open_.erase(key);
+        }
+        batches_++;
+        lanes_ += batch->lanes.size();
+        lock.unlock();
+        execute(*batch);
+        lock.lock();
+        cv_.notify_all();
+    }
+
+    if (lane.status != 200)
+    {
+        throw ServiceError(lane.status, lane.error, lane.retryAfter);
+    }
+    return std::move(lane.out);
+}
+
+// One admission for the whole batch, whose work is then billed to each lane's
+// own client, then every lane in turn. Lane results are published under mutex_.
+void MicroBatcher::execute(Batch &batch)
+{
+    // However this returns, no lane is left waiting for a result.
+    struct Settle
+    {
+        MicroBatcher &batcher;
+        Batch &batch;
+        ~Settle()
+        {
+            lock_guard<mutex> lock(batcher.mutex_);
+            for (Lane *lane : batch.lanes)
+            {
+                if (lane->status == 0)
+                {
+                    lane->status = 500;
+                    lane->error = "micro-batch failed";
+                }
+            }
+            batcher.cv_.notify_all();
+        }
+    } settle{*this, batch};
+
+    uint64_t work = 0, bytes = 0;
+    auto deadline = chrono::steady_clock::time_point::max();
+    for (Lane *lane : batch.lanes)
+    {
+        uint64_t cells = lane->run->device().numMicrocell, n = lane->in->size();
+        work += cells * n;
+        bytes += (cells + n) * sizeof(double);
+        deadline = min(deadline, lane->run->request().deadline);
+    }
+
+    const string &leader = batch.lanes.front()->run->request().client;
+    shared_ptr<AdmissionScheduler::Ticket> ticket;
+    try
+    {
+        ticket = scheduler_.admit(leader, work, bytes, deadline);
+    }
+    catch (const ServiceError &e)
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (Lane *lane : batch.lanes)
+        {
+            lane->status = e.status;
+            lane->error = e.what();
+            lane->retryAfter = e.retryAfter;
+        }
+        return;
+    }
+
+    for (Lane *lane : batch.lanes)
+    {
+        scheduler_.transfer(leader, lane->run->request().client,
+                            (uint64_t)lane->run->device().numMicrocell * lane->in->size());
+    }
+
+    ticket->begin();
+    vector<double> out;
+    for (Lane *lane : batch.lanes)
+    {
+        int status = 200;
+        string error;
+        try
+        {
+            lane->run->join(ticket);
+            out.resize(lane->in->size());
+            lane->run->simulate(lane->in->data(), out.data(), out.size());
+            lane->out.assign(reinterpret_cast<const char *>(out.data()), out.size() * sizeof(double));
+        }
+        catch (const ServiceError &e)
+        {
+            status = e.status;
+            error = e.what();
+        }
+        catch (const exception &e)
+        {
+            status = 500;
+            error = e.what();
+        }
+        lock_guard<mutex> lock(mutex_);
+        lane->status = status;
+        lane->error = error;
+        if (lane != batch.lanes.front())
+        {
+            cv_.notify_all(); // this lane's thread can start sending at once
+        }
+    }
+    ticket->release_cpu();
+}
+
+MicroBatcher::Stats MicroBatcher::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{batches_, lanes_};
+}
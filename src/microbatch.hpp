@@ -0,0 +1,92 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MICROBATCH_H
+#define MICROBATCH_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include "simcore.hpp"
+#include "scheduler.hpp"
+
+// Server-side micro-batching of small concurrent /simspad requests. While
+// other simulations are running, a short request for a device opens a batch
+// that requests from any client for the same device parameters join for up to
+// `window`; the batch is then admitted once, for its summed work, each lane's
+// share of which is billed to that lane's client in the fair queue, and its
+// lanes run back to back on the opening request's thread with the device
+// model and age distributions hot in cache, while the other requests' threads
+// just wait for their lane. On an idle server a request runs at once, alone.
+// Running lanes serially on one core only pays off where per-request overhead
+// dominates, so the server leaves this off unless SIMSPAD_MICROBATCH_US is set.
+class MicroBatcher
+{
+public:
+    MicroBatcher(AdmissionScheduler &scheduler, std::chrono::microseconds window, std::size_t maxSamples,
+                 std::size_t maxLanes);
+
+    // Small, dense, whole-body, unseeded runs only (seeded ones go through the
+    // result cache).
+    bool eligible(const SimulationRequest &req) const;
+
+    // Simulate `in` as one lane of a batch; returns the float64 response
+    // bytes. Throws ServiceError (429 / 503 from the batch's admission).
+    std::string run(SimulationRun &run, const std::vector<double> &in);
+
+    struct Stats
+    {
+        unsigned long long batches, lanes;
+    };
+    Stats stats();
+
+    MicroBatcher(MicroBatcher const &) = delete;
+    void operator=(MicroBatcher const &) = delete;
+
+private:
+    struct Lane
+    {
+        SimulationRun *run = nullptr;
+        const std::vector<double> *in = nullptr;
+        std::string out;
+        int status = 0; // set once done: 200 or the error status
+        std::string error;
+        int retryAfter = 0;
+    };
+    struct Batch
+    {
+        std::vector<Lane *> lanes;
+        bool closed = false;
+    };
+
+    AdmissionScheduler &scheduler_;
+    std::chrono::microseconds window_;
+    std::size_t maxSamples_, maxLanes_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<std::string, std::shared_ptr<Batch>> open_; // by device parameters
+    unsigned long long batches_ = 0, lanes_ = 0;
+
+    void execute(Batch &batch);
+};
+
+#endif // MICROBATCH_H
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <random>
+#include <algorithm>
+#include <exception>
+#include "parallel.hpp"
+#include "simd.hpp"
+
+using namespace std;
+
+template <typename F>
+void ParallelEngine::each(F fn)
+{
+    // Helpers reference fn and the shards, so they are always joined before
+    // a failure on this thread (or theirs) propagates.
+    exception_ptr error;
+    try
+    {
+        for (size_t s = 1; s < shards_.size(); s++)
+        {
+            lease_->run(s - 1, [this, s, &fn]
+                        { fn(shards_[s]); });
+        }
+        fn(shards_[0]);
+    }
+    catch (...)
+    {
+        error = current_exception();
+    }
+    lease_->wait();
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+}
+
+ParallelEngine::ParallelEngine(const SiPM &prototype, unique_ptr<CoreScheduler::Lease> lease)
+    : lease_(std::move(lease)), shards_(lease_->size() + 1)
+{
+    const unsigned long n = prototype.numMicrocell, k = (unsigned long)shards_.size();
+    random_device entropy;
+    unsigned long first = 0;
+    for (unsigned long s = 0; s < k; s++)
+    {
+        shards_[s].cells = n / k + (s < n % k ? 1 : 0);
+        shards_[s].firstCell = first;
+        shards_[s].fraction = (double)shards_[s].cells / (double)n;
+        first += shards_[s].cells;
+    }
+    vector<uint64_t> seeds(k);
+    for (uint64_t &seed : seeds)
+    {
+        seed = ((uint64_t)entropy() << 32) ^ entropy();
+    }
+    // Built on the shard's own core: first touch puts its state NUMA-local.
+    each([&](Shard &shard)
+         {
+        size_t s = (size_t)(&shard - shards_.data());
+        shard.sipm = make_unique<SiPM>(prototype);
+        shard.sipm->numMicrocell = shard.cells;
+        shard.sipm->seed(seeds[s]); });
+}
+
+void ParallelEngine::init_state(double meanPhotonsPerDt, unsigned long nSteps)
+{
+    each([&](Shard &shard)
+         {
+        TraceSpan span(tracer_, "shard init_state");
+        shard.sipm->init_state(meanPhotonsPerDt * shard.fraction, nSteps); });
+}
+
+void ParallelEngine::simulate_chunk(const double *in, double *out, size_t n)
+{
+    const long long chunk = chunks_++;
+    each([&](Shard &shard)
+         {
+        TraceSpan span(tracer_, "shard simulate", chunk);
+        shard.in.resize(n);
+        shard.out.resize(n);
+        simd().scale(in, shard.fraction, shard.in.data(), n);
+        shard.sipm->set_event_sink(sink_ ? &shard.events : nullptr);
+        shard.sipm->simulate_chunk(shard.in.data(), shard.out.data(), n); });
+
+    TraceSpan merge(tracer_, "merge shards", chunk);
+    copy(shards_[0].out.begin(), shards_[0].out.begin() + n, out);
+    for (size_t s = 1; s < shards_.size(); s++)
+    {
+        simd().accumulate(shards_[s].out.data(), out, n);
+    }
+    if (sink_)
+    {
+        size_t first = sink_->size();
+        for (Shard &shard : shards_)
+        {
+            for (DetectionEvent e : shard.events)
+            {
+                e.cell += shard.firstCell;
+                sink_->push_back(e);
+            }
+            shard.events.clear();
+        }
+        stable_sort(sink_->begin() + first, sink_->end(), [](const DetectionEvent &a, const DetectionEvent &b)
+                    { return a.step < b.step; });
+    }
+}
+
+unsigned long long ParallelEngine::detection_count() const
+{
+    unsigned long long total = 0;
+    for (const Shard &shard : shards_)
+    {
+        total += shard.sipm->detection_count();
+    }
+    return total;
+}
+
+EngineStats ParallelEngine::engine_stats() const
+{
+    EngineStats total;
+    for (const Shard &shard : shards_)
+    {
+        total += shard.sipm->engine_stats();
+    }
+    return total;
+}
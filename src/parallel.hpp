@@ -0,0 +1,82 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include "sipm.hpp"
+#include "cores.hpp"
+#include "trace.hpp"
+
+// Runs one device on several cores. Photons strike microcells uniformly, so
+// splitting the N microcells into shards of N_s cells splits the Poisson
+// photon arrivals into independent Poisson streams of mean in * N_s / N
+// (Poisson thinning): each shard is simulated as its own SiPM fed the scaled
+// input, and the outputs add up to a device response with the same
+// distribution as the unsharded one (not the same random draws, so seeded
+// runs stay unsharded). Shard 0 runs on the calling thread, the others on the
+// leased cores' workers, which also allocate their shard's state so it lands
+// on their NUMA node.
+class ParallelEngine
+{
+public:
+    // `prototype` supplies parameters and lookup tables; each shard is a
+    // freshly seeded copy of it.
+    ParallelEngine(const SiPM &prototype, std::unique_ptr<CoreScheduler::Lease> lease);
+
+    std::size_t shards() const { return shards_.size(); }
+
+    void init_state(double meanPhotonsPerDt, unsigned long nSteps);
+    void simulate_chunk(const double *in, double *out, std::size_t n);
+
+    // Detections from every shard, merged in step order with global cell indices.
+    void set_event_sink(std::vector<DetectionEvent> *sink) { sink_ = sink; }
+    unsigned long long detection_count() const;
+    EngineStats engine_stats() const;
+
+    // Record each shard's work as spans on its own thread's track.
+    void set_tracer(Tracer *tracer) { tracer_ = tracer; }
+
+    // Hand the helper cores back (the shards' state stays readable).
+    void release() { lease_.reset(); }
+
+private:
+    struct Shard
+    {
+        std::unique_ptr<SiPM> sipm;
+        unsigned long cells, firstCell; // N_s, and the global index of cell 0
+        double fraction;                // N_s / N
+        std::vector<double> in, out;
+        std::vector<DetectionEvent> events;
+    };
+
+    std::unique_ptr<CoreScheduler::Lease> lease_;
+    std::vector<Shard> shards_;
+    std::vector<DetectionEvent> *sink_ = nullptr;
+    Tracer *tracer_ = nullptr;
+    long long chunks_ = 0;
+
+    // Run fn(shard) on every shard, in parallel, and wait; rethrows the
+    // first failure of any shard.
+    template <typename F>
+    void each(F fn);
+};
+
+#endif // PARALLEL_H
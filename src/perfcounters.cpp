@@ -0,0 +1,185 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include "perfcounters.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+{
+    return cache | (op << 8) | (result << 16);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+    for (int &fd : fd_)
+    {
+        fd = -1;
+    }
+#ifdef __linux__
+    const struct
+    {
+        uint32_t type;
+        uint64_t config;
+    } events[COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        fd_[c] = open_counter(events[c].type, events[c].config);
+        if (fd_[c] < 0 && error_.empty())
+        {
+            error_ = string("perf_event_open: ") + strerror(errno);
+            if (errno == EACCES || errno == EPERM)
+            {
+                error_ += " (see /proc/sys/kernel/perf_event_paranoid)";
+            }
+        }
+    }
+    if (available())
+    {
+        error_.clear(); // some counters work; the rest read as invalid
+    }
+#else
+    error_ = "hardware counters need Linux perf_event_open";
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (int fd : fd_)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+#endif
+}
+
+bool PerfCounters::available() const
+{
+    for (int fd : fd_)
+    {
+        if (fd >= 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PerfCounters::start()
+{
+#ifdef __linux__
+    for (int fd : fd_)
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void PerfCounters::stop()
+{
+#ifdef __linux__
+    for (int fd : fd_)
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+}
+
+void PerfCounters::reset()
+{
+#ifdef __linux__
+    for (int fd : fd_)
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        }
+    }
+#endif
+}
+
+PerfCounters::Reading PerfCounters::read() const
+{
+    Reading r;
+#ifdef __linux__
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        uint64_t v[3]; // value, time enabled, time running
+        if (fd_[c] < 0 || ::read(fd_[c], v, sizeof(v)) != (ssize_t)sizeof(v))
+        {
+            continue;
+        }
+        if (v[2] == 0)
+        {
+            // Never scheduled onto the PMU (or never started).
+            r.valid[c] = v[1] == 0;
+            continue;
+        }
+        r.value[c] = (double)v[0] * ((double)v[1] / (double)v[2]);
+        r.valid[c] = true;
+    }
+#endif
+    return r;
+}
+
+const char *PerfCounters::name(Counter c)
+{
+    static const char *names[COUNTERS] = {"cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses",
+                                          "branch_misses"};
+    return names[c];
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <string>
+#include <cstdint>
+
+// Hardware performance counters of the calling thread (Linux perf_event_open),
+// counting user-space events only while started. Each counter is opened on its
+// own, so a PMU lacking one event (or a kernel/container refusing them all)
+// just leaves those readings invalid; nothing here throws. Counters the PMU
+// multiplexes are scaled up to the time they were enabled.
+class PerfCounters
+{
+public:
+    enum Counter
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        DTLB_MISSES,
+        BRANCH_MISSES,
+        COUNTERS
+    };
+
+    struct Reading
+    {
+        double value[COUNTERS] = {};
+        bool valid[COUNTERS] = {};
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Whether any counter could be opened; if not, why.
+    bool available() const;
+    const std::string &error() const { return error_; }
+
+    // Counting accumulates over every start()/stop() pair until reset().
+    void start();
+    void stop();
+    void reset();
+    Reading read() const;
+
+    // Short snake_case name, as used in JSON ("cycles", "llc_misses", ...).
+    static const char *name(Counter c);
+
+private:
+    int fd_[COUNTERS];
+    std::string error_;
+};
+
+#endif // PERFCOUNTERS_H
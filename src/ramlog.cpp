@@ -15,48 +15,166 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
 #include "ramlog.hpp"
 
+#define COL_GREEN "\033[32;1m"  // Used for server messages
+#define COL_YELLOW "\033[33;1m" // Used for Warnings
+#define COL_RED "\033[31;1m"    // Used for Errors
+#define COL_RESET "\033[0m"     // Reset colour in term
+
+constexpr std::chrono::milliseconds RamLog::FLUSH_INTERVAL;
+
 RamLog &RamLog::getInstance()
 {
     static RamLog instance;
     return instance;
 }
 
+RamLog::RamLog() : ring_(MAX_SIZE), sink_([this]
+                                          { run(); }) {}
+
+RamLog::~RamLog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    sink_.join();
+}
+
 void RamLog::log(const std::string &message)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    logMessages_.push_back(message);
-    trimLog();
+    Node *node = new Node{message, std::chrono::system_clock::now(), pending_.load(std::memory_order_relaxed)};
+    while (!pending_.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    posted_.fetch_add(1, std::memory_order_relaxed);
 }
 
-std::string RamLog::getLog() const
+void RamLog::flush()
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    std::string log;
-    for (const auto &message : logMessages_)
+    unsigned long long target = posted_.load(std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushing_ = true;
+    wake_.notify_one();
+    drained_.wait(lock, [&]
+                  { return written_ >= target || stop_; });
+}
+
+// The sink thread: take everything queued, oldest first, every FLUSH_INTERVAL
+// (or sooner when flush() asks).
+void RamLog::run()
+{
+    std::vector<Node *> batch;
+    for (;;)
     {
-        log += message + '\n';
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait_for(lock, FLUSH_INTERVAL, [&]
+                           { return stop_ || flushing_; });
+            flushing_ = false;
+            stopping = stop_;
+        }
+        batch.clear();
+        for (Node *node = pending_.exchange(nullptr, std::memory_order_acquire); node; node = node->next)
+        {
+            batch.push_back(node);
+        }
+        write(batch);
+        if (stopping)
+        {
+            return;
+        }
     }
-    return log;
 }
 
-void RamLog::clear()
+void RamLog::write(std::vector<Node *> &batch)
 {
+    std::string out;
+    std::vector<std::string> rows;
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it)
+    {
+        std::string &msg = (*it)->message;
+
+        // if no tag is defined - give the message an INFO tag.
+        const bool error = msg.find("[ERROR]") != std::string::npos;
+        const bool warn = !error && msg.find("[WARN]") != std::string::npos;
+        if (!error && !warn && msg.find("[INFO]") == std::string::npos)
+        {
+            msg = "[INFO]  " + msg;
+        }
+        // CSS class (see pages.cpp) for /logs, ANSI colour for stdout.
+        const char *message_class = error ? "message-error" : warn ? "message-warn" : "message-info";
+        out += error ? COL_RED : warn ? COL_YELLOW : "";
+        out += msg;
+        out += (error || warn) ? COL_RESET "\n" : "\n";
+
+        char when[32] = "";
+        std::time_t t = std::chrono::system_clock::to_time_t((*it)->time);
+        struct tm tm;
+        if (localtime_r(&t, &tm))
+        {
+            std::strftime(when, sizeof(when), "%a %b %e %H:%M:%S %Y", &tm);
+        }
+        rows.push_back("<tr><td class='sequence'>" + std::to_string(++sequence_) + "</td><td class='time'>" + when +
+                       "</td><td class='message " + message_class + "'>" + msg + "</td></tr>");
+        delete *it;
+    }
+    if (!out.empty())
+    {
+        std::cout << out << std::flush;
+    }
     std::lock_guard<std::mutex> lock(mutex_);
-    logMessages_.clear();
+    for (const std::string &row : rows)
+    {
+        append(row);
+    }
+    written_ += batch.size();
+    drained_.notify_all();
 }
 
-void RamLog::trimLog()
+// Append one row (and its line break), dropping the oldest rows to make room.
+void RamLog::append(const std::string &row)
 {
-    size_t totalSize = 0;
-    for (const auto &message : logMessages_)
+    const size_t len = row.size() + 1;
+    if (len > ring_.size())
     {
-        totalSize += message.size();
+        return;
     }
-    while (totalSize > MAX_SIZE && !logMessages_.empty())
+    while (size_ + len > ring_.size())
     {
-        totalSize -= logMessages_.front().size();
-        logMessages_.pop_front();
+        head_ = (head_ + rows_.front()) % ring_.size();
+        size_ -= rows_.front();
+        rows_.pop_front();
     }
+    size_t at = (head_ + size_) % ring_.size();
+    size_t first = std::min(row.size(), ring_.size() - at);
+    std::memcpy(&ring_[at], row.data(), first);
+    std::memcpy(&ring_[0], row.data() + first, row.size() - first);
+    ring_[(at + row.size()) % ring_.size()] = '\n';
+    size_ += len;
+    rows_.push_back(len);
+}
+
+std::string RamLog::getLog() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string log(size_, '\0');
+    size_t first = std::min(size_, ring_.size() - head_);
+    std::copy(ring_.begin() + head_, ring_.begin() + head_ + first, log.begin());
+    std::copy(ring_.begin(), ring_.begin() + (size_ - first), log.begin() + first);
+    return log;
+}
+
+void RamLog::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    head_ = size_ = 0;
+    rows_.clear();
 }
@@ -20,30 +20,72 @@
 
 #include <string>
 #include <deque>
+#include <vector>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstddef>
 
+// The server log: the last MAX_SIZE bytes of messages, as HTML table rows for
+// /logs, also echoed to stdout. log() only pushes the message onto a lock-free
+// queue; a background thread tags, timestamps and formats it, appends it to a
+// byte ring buffer and writes stdout, flushing once per batch. Messages reach
+// /logs and stdout within about FLUSH_INTERVAL.
 class RamLog
 {
 public:
     static RamLog &getInstance();
 
+    // Lock-free; callable from any thread. A message with no [INFO], [WARN]
+    // or [ERROR] tag is logged as [INFO].
     void log(const std::string &message);
 
+    // Snapshot of the buffered rows, oldest first.
     std::string getLog() const;
 
     void clear();
 
+    // Wait until everything logged so far has been written.
+    void flush();
+
     RamLog(RamLog const &) = delete;
     void operator=(RamLog const &) = delete;
 
 private:
-    RamLog() = default;
+    RamLog();
+    ~RamLog();
+
+    struct Node
+    {
+        std::string message;
+        std::chrono::system_clock::time_point time;
+        Node *next;
+    };
 
-    std::deque<std::string> logMessages_;
-    mutable std::mutex mutex_;
+    static constexpr std::chrono::milliseconds FLUSH_INTERVAL{20};
     const size_t MAX_SIZE = 512 * 1024; // 512K
 
-    void trimLog();
+    std::atomic<Node *> pending_{nullptr}; // pushed newest first
+    std::atomic<unsigned long long> posted_{0};
+    unsigned long long written_ = 0; // guarded by mutex_
+    long sequence_ = 0;              // sink thread only
+
+    // Ring of formatted rows: ring_[head_, head_ + size_) modulo capacity,
+    // with the row lengths kept so whole rows are dropped from the front.
+    std::vector<char> ring_;
+    size_t head_ = 0, size_ = 0;
+    std::deque<size_t> rows_;
+
+    mutable std::mutex mutex_; // ring and written_; never taken by log()
+    std::condition_variable wake_, drained_;
+    bool stop_ = false, flushing_ = false;
+    std::thread sink_;
+
+    void run();
+    void write(std::vector<Node *> &batch);
+    void append(const std::string &row);
 };
 
 #endif // RAM_LOG_H
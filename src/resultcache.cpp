@@ -0,0 +1,241 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include "resultcache.hpp"
+
+using namespace std;
+
+ResultCache::Producer::~Producer()
+{
+    if (!published)
+    {
+        cache->finish(key, flight, nullptr);
+    }
+}
+
+void ResultCache::Producer::publish(Result result)
+{
+    published = true;
+    cache->finish(key, flight, move(result));
+}
+
+ResultCache::ResultCache(uint64_t maxBytes, const string &spillDir, uint64_t maxSpillBytes)
+    : maxBytes_(maxBytes), spillDir_(spillDir), maxSpillBytes_(maxSpillBytes)
+{
+    if (spillDir_.empty())
+    {
+        return;
+    }
+    filesystem::create_directories(spillDir_);
+    // Spill files from an earlier run are not indexed; clear them out.
+    for (const auto &f : filesystem::directory_iterator(spillDir_))
+    {
+        string name = f.path().filename().string();
+        if (f.is_regular_file() && name.size() == 68 && name.compare(64, 4, ".bin") == 0)
+        {
+            filesystem::remove(f.path());
+        }
+    }
+}
+
+ResultCache::~ResultCache()
+{
+    for (const auto &kv : spilled_)
+    {
+        std::remove(spill_path(kv.first).c_str());
+    }
+}
+
+ResultCache::Result ResultCache::acquire(const string &key, unique_ptr<Producer> *producer,
+                                         chrono::steady_clock::time_point deadline)
+{
+    deadline = min(deadline, chrono::steady_clock::now() + MAX_WAIT);
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        auto it = entries_.find(key);
+        if (it != entries_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            hits_++;
+            return it->second.data;
+        }
+
+        if (spilled_.count(key))
+        {
+            // Read back outside the lock; a concurrent eviction unlinking the
+            // file just turns this into a miss.
+            string path = spill_path(key);
+            lock.unlock();
+            auto data = make_shared<string>();
+            ifstream in(path, ios::binary);
+            bool ok = false;
+            if (in)
+            {
+                in.seekg(0, ios::end);
+                data->resize((size_t)in.tellg());
+                in.seekg(0);
+                ok = (bool)in.read(&(*data)[0], (streamsize)data->size());
+            }
+            lock.lock();
+            if (ok)
+            {
+                hits_++;
+                auto evicted = insert(key, data);
+                lock.unlock();
+                for (auto &e : evicted)
+                {
+                    spill(e.first, e.second);
+                }
+                return data;
+            }
+            unspill(key);
+            continue;
+        }
+
+        auto flight = flights_.find(key);
+        if (flight != flights_.end())
+        {
+            shared_ptr<Flight> f = flight->second;
+            coalesced_++;
+            if (!done_.wait_until(lock, deadline, [&]
+                                  { return f->done; }))
+            {
+                return nullptr; // not worth waiting longer: compute it alone
+            }
+            if (f->result)
+            {
+                return f->result;
+            }
+            continue; // the producer gave up: look again, maybe take over
+        }
+
+        misses_++;
+        auto f = make_shared<Flight>();
+        flights_[key] = f;
+        producer->reset(new Producer(this, key, f));
+        return nullptr;
+    }
+}
+
+void ResultCache::finish(const string &key, const shared_ptr<Flight> &flight, Result result)
+{
+    vector<pair<string, Result>> evicted;
+    {
+        lock_guard<mutex> lock(mutex_);
+        flight->done = true;
+        flight->result = result;
+        flights_.erase(key);
+        if (result && result->size() <= maxBytes_)
+        {
+            evicted = insert(key, result);
+        }
+    }
+    done_.notify_all();
+    for (auto &e : evicted)
+    {
+        spill(e.first, e.second);
+    }
+}
+
+// Add a body to the in-memory LRU and return what had to make room for it.
+// mutex_ must be held.
+vector<pair<string, ResultCache::Result>> ResultCache::insert(const string &key, Result result)
+{
+    vector<pair<string, Result>> evicted;
+    if (entries_.count(key))
+    {
+        return evicted;
+    }
+    unspill(key);
+    lru_.push_front(key);
+    entries_[key] = Entry{result, lru_.begin()};
+    bytes_ += result->size();
+    while (bytes_ > maxBytes_ && lru_.size() > 1)
+    {
+        auto victim = entries_.find(lru_.back());
+        bytes_ -= victim->second.data->size();
+        evicted.emplace_back(victim->first, victim->second.data);
+        entries_.erase(victim);
+        lru_.pop_back();
+        evictions_++;
+    }
+    return evicted;
+}
+
+// Write an evicted body to the spill directory (mutex_ must not be held),
+// then trim the spill area to its budget.
+void ResultCache::spill(const string &key, const Result &result)
+{
+    if (spillDir_.empty() || result->size() > maxSpillBytes_)
+    {
+        return;
+    }
+    string path = spill_path(key);
+    {
+        ofstream out(path + ".tmp", ios::binary);
+        if (!out.write(result->data(), (streamsize)result->size()))
+        {
+            std::remove((path + ".tmp").c_str());
+            return;
+        }
+    }
+    std::rename((path + ".tmp").c_str(), path.c_str());
+
+    lock_guard<mutex> lock(mutex_);
+    if (entries_.count(key))
+    {
+        std::remove(path.c_str()); // back in memory while it was written
+        return;
+    }
+    if (spilled_.count(key))
+    {
+        return; // spilled twice: the same file, already accounted for
+    }
+    spillLru_.push_front(key);
+    spilled_[key] = SpillEntry{result->size(), spillLru_.begin()};
+    spilledBytes_ += result->size();
+    while (spilledBytes_ > maxSpillBytes_)
+    {
+        unspill(spillLru_.back());
+    }
+}
+
+void ResultCache::unspill(const string &key)
+{
+    auto it = spilled_.find(key);
+    if (it == spilled_.end())
+    {
+        return;
+    }
+    std::remove(spill_path(key).c_str());
+    spilledBytes_ -= it->second.bytes;
+    spillLru_.erase(it->second.lru);
+    spilled_.erase(it);
+}
+
+ResultCache::Stats ResultCache::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{hits_, misses_, coalesced_, evictions_, entries_.size(), spilled_.size(), bytes_, spilledBytes_};
+}
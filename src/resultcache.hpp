@@ -0,0 +1,131 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+// Content-addressed cache of finished response bodies, keyed by a digest of
+// everything that determines the result (parameters, seed, output mode and
+// input). Bodies are kept in memory up to `maxBytes`, least recently used
+// first out; evicted bodies spill to files in `spillDir` (if set) up to
+// `maxSpillBytes`. Identical requests arriving while the first is still being
+// computed are coalesced: they wait for its result instead of recomputing.
+class ResultCache
+{
+public:
+    using Result = std::shared_ptr<const std::string>;
+
+    struct Stats
+    {
+        unsigned long long hits, misses, coalesced, evictions;
+        std::size_t entries, spilledEntries;
+        std::uint64_t bytes, spilledBytes;
+    };
+
+private:
+    struct Flight
+    {
+        bool done = false;
+        Result result; // null if the producer gave up
+    };
+
+public:
+    // Handed to the one request that computes a key. Destroying it without
+    // publish() abandons the flight, and one of the waiters takes over.
+    class Producer
+    {
+    public:
+        ~Producer();
+        void publish(Result result);
+        Producer(Producer const &) = delete;
+        void operator=(Producer const &) = delete;
+
+    private:
+        friend class ResultCache;
+        Producer(ResultCache *c, const std::string &k, std::shared_ptr<Flight> f)
+            : cache(c), key(k), flight(std::move(f)) {}
+        ResultCache *cache;
+        std::string key;
+        std::shared_ptr<Flight> flight;
+        bool published = false;
+    };
+
+    ResultCache(std::uint64_t maxBytes, const std::string &spillDir, std::uint64_t maxSpillBytes);
+    ~ResultCache();
+
+    bool enabled() const { return maxBytes_ > 0; }
+
+    // Longest a request waits on an identical one in flight, whose producer
+    // only publishes once its own response has been sent.
+    static constexpr std::chrono::seconds MAX_WAIT{30};
+
+    // The cached body for `key`, waiting out an identical in-flight request if
+    // there is one. On a miss, returns null and sets *producer: the caller
+    // must compute the body and publish() it. If that wait reaches `deadline`
+    // or MAX_WAIT, returns null without a producer: compute it uncached.
+    Result acquire(const std::string &key, std::unique_ptr<Producer> *producer,
+                   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+    Stats stats();
+
+    ResultCache(ResultCache const &) = delete;
+    void operator=(ResultCache const &) = delete;
+
+private:
+    struct Entry
+    {
+        Result data;
+        std::list<std::string>::iterator lru;
+    };
+    struct SpillEntry
+    {
+        std::uint64_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::uint64_t maxBytes_;
+    std::string spillDir_;
+    std::uint64_t maxSpillBytes_;
+
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::list<std::string> lru_, spillLru_; // most recently used at the front
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<std::string, SpillEntry> spilled_;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+    std::uint64_t bytes_ = 0, spilledBytes_ = 0;
+    unsigned long long hits_ = 0, misses_ = 0, coalesced_ = 0, evictions_ = 0;
+
+    void finish(const std::string &key, const std::shared_ptr<Flight> &flight, Result result);
+    std::vector<std::pair<std::string, Result>> insert(const std::string &key, Result result);
+    void spill(const std::string &key, const Result &result);
+    void unspill(const std::string &key); // mutex_ must be held
+    std::string spill_path(const std::string &key) const { return spillDir_ + "/" + key + ".bin"; }
+};
+
+#endif // RESULT_CACHE_H
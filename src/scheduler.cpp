@@ -0,0 +1,305 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "scheduler.hpp"
+#include "service.hpp"
+
+using namespace std;
+
+AdmissionScheduler::AdmissionScheduler(const Config &config)
+    : config_(config), rate_(config.initialRate > 0 ? config.initialRate : 1e9)
+{
+    if (config_.slots == 0)
+    {
+        config_.slots = 1;
+    }
+}
+
+AdmissionScheduler::Ticket::~Ticket()
+{
+    if (cpuHeld)
+    {
+        sched->finish_cpu(*this);
+    }
+    sched->finish_mem(*this);
+}
+
+void AdmissionScheduler::Ticket::begin()
+{
+    start = chrono::steady_clock::now();
+}
+
+void AdmissionScheduler::Ticket::release_cpu()
+{
+    if (cpuHeld)
+    {
+        sched->finish_cpu(*this);
+        cpuHeld = false;
+    }
+}
+
+// A request fits if a slot is free and both budgets have room. An oversized
+// request still runs alone (nothing else in flight) rather than starving.
+bool AdmissionScheduler::fits(const Waiter &w) const
+{
+    if (running_ == 0)
+    {
+        return true;
+    }
+    if (running_ >= config_.slots)
+    {
+        return false;
+    }
+    if (config_.cpuBudget && cpuInFlight_ + w.work > config_.cpuBudget)
+    {
+        return false;
+    }
+    if (config_.memBudget && memInFlight_ + w.bytes > config_.memBudget)
+    {
+        return false;
+    }
+    return true;
+}
+
+// Admit from the head of the fair queue while the head fits. Only the head is
+// considered, so a small late request cannot overtake a fairly-tagged large one.
+void AdmissionScheduler::pump()
+{
+    bool any = false;
+    while (!queue_.empty())
+    {
+        Waiter *head = *queue_.begin();
+        if (!fits(*head))
+        {
+            break;
+        }
+        queue_.erase(queue_.begin());
+        head->admitted = true;
+        if (head->granted)
+        {
+            auto it = async_.find(head->seq);
+            ready_.push_back(move(it->second));
+            async_.erase(it);
+        }
+        queuedWork_ -= head->work;
+        running_++;
+        cpuInFlight_ += head->work;
+        memInFlight_ += head->bytes;
+        admitted_++;
+        virtualTime_ = max(virtualTime_, head->startTag);
+        any = true;
+    }
+    if (any)
+    {
+        cv_.notify_all();
+    }
+}
+
+double AdmissionScheduler::estimated_wait() const
+{
+    return (double)(queuedWork_ + cpuInFlight_) / (rate_ * (double)config_.slots);
+}
+
+shared_ptr<AdmissionScheduler::Ticket> AdmissionScheduler::admit(const string &client, uint64_t work, uint64_t bytes,
+                                                                 chrono::steady_clock::time_point deadline)
+{
+    return enqueue(client, work, bytes, deadline);
+}
+
+unsigned long long AdmissionScheduler::admit_async(const string &client, uint64_t work, uint64_t bytes, Grant granted)
+{
+    unsigned long long id;
+    {
+        lock_guard<mutex> lock(mutex_);
+        unique_ptr<Waiter> w(new Waiter{0.0, 0.0, seq_++, work, bytes, false, move(granted)});
+        tag(*w, client);
+        id = w->seq;
+        queue_.insert(w.get());
+        queuedWork_ += work;
+        async_[id] = move(w);
+        pump();
+    }
+    deliver();
+    return id;
+}
+
+bool AdmissionScheduler::withdraw(unsigned long long id)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = async_.find(id);
+        if (it == async_.end())
+        {
+            return false;
+        }
+        queue_.erase(it->second.get());
+        queuedWork_ -= it->second->work;
+        async_.erase(it);
+        pump();
+    }
+    deliver();
+    return true;
+}
+
+void AdmissionScheduler::deliver()
+{
+    vector<unique_ptr<Waiter>> ready;
+    {
+        lock_guard<mutex> lock(mutex_);
+        ready.swap(ready_);
+    }
+    for (auto &w : ready)
+    {
+        w->granted(shared_ptr<Ticket>(new Ticket(this, w->work, w->bytes)));
+    }
+}
+
+double AdmissionScheduler::weight(const string &client) const
+{
+    auto wt = config_.weights.find(client);
+    return (wt != config_.weights.end() && wt->second > 0) ? wt->second : 1.0;
+}
+
+void AdmissionScheduler::tag(Waiter &w, const string &client)
+{
+    // Weighted fair queuing by virtual finish time: a client's next request
+    // starts no earlier than its previous one finished (in virtual time), is
+    // charged work/weight, and the queue is ordered by the resulting finish tag.
+    double &last = clientFinish_[client];
+    w.startTag = max(virtualTime_, last);
+    w.finishTag = w.startTag + (double)w.work / weight(client);
+    last = w.finishTag;
+    if (clientFinish_.size() > 4096)
+    {
+        // Forget clients whose tags have fallen behind virtual time; max() with
+        // virtualTime_ would ignore them anyway.
+        for (auto it = clientFinish_.begin(); it != clientFinish_.end();)
+        {
+            it = (it->second <= virtualTime_) ? clientFinish_.erase(it) : next(it);
+        }
+    }
+}
+
+void AdmissionScheduler::transfer(const string &from, const string &to, uint64_t work)
+{
+    if (from == to || work == 0)
+    {
+        return;
+    }
+    lock_guard<mutex> lock(mutex_);
+    auto last = clientFinish_.find(from);
+    if (last != clientFinish_.end())
+    {
+        last->second = max(virtualTime_, last->second - (double)work / weight(from));
+    }
+    double &next = clientFinish_[to];
+    next = max(virtualTime_, next) + (double)work / weight(to);
+}
+
+shared_ptr<AdmissionScheduler::Ticket> AdmissionScheduler::enqueue(const string &client, uint64_t work, uint64_t bytes,
+                                                                   chrono::steady_clock::time_point deadline)
+{
+    unique_lock<mutex> lock(mutex_);
+
+    Waiter w{0.0, 0.0, seq_++, work, bytes, false, {}};
+    const bool hasDeadline = (deadline != chrono::steady_clock::time_point::max());
+    bool mustWait = !queue_.empty() || !fits(w);
+    double wait = mustWait ? estimated_wait() : 0.0;
+    if (mustWait && wait > config_.maxQueueSeconds)
+    {
+        rejected_++;
+        throw ServiceError(429, "server overloaded, retry later", (int)ceil(wait));
+    }
+    if (hasDeadline)
+    {
+        double need = wait + (double)work / rate_;
+        if (chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(need)) > deadline)
+        {
+            expired_++;
+            throw ServiceError(503, "deadline cannot be met (estimated " + to_string(need) + " s)");
+        }
+    }
+
+    tag(w, client);
+    queue_.insert(&w);
+    queuedWork_ += work;
+    pump();
+    if (!ready_.empty())
+    {
+        lock.unlock();
+        deliver();
+        lock.lock();
+    }
+    auto admittedYet = [&]
+    { return w.admitted; };
+    bool ok = true;
+    if (hasDeadline)
+    {
+        ok = cv_.wait_until(lock, deadline, admittedYet);
+    }
+    else
+    {
+        cv_.wait(lock, admittedYet);
+    }
+    if (!ok)
+    {
+        queue_.erase(&w);
+        queuedWork_ -= work;
+        expired_++;
+        pump();
+        lock.unlock();
+        deliver();
+        throw ServiceError(503, "deadline expired while queued");
+    }
+    lock.unlock();
+    return shared_ptr<Ticket>(new Ticket(this, work, bytes));
+}
+
+void AdmissionScheduler::finish_cpu(Ticket &t)
+{
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - t.start).count();
+    {
+        lock_guard<mutex> lock(mutex_);
+        running_--;
+        cpuInFlight_ -= t.work;
+        if (elapsed > 1e-3 && t.work > 0)
+        {
+            rate_ = 0.8 * rate_ + 0.2 * ((double)t.work / elapsed);
+        }
+        pump();
+    }
+    deliver();
+}
+
+void AdmissionScheduler::finish_mem(Ticket &t)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        memInFlight_ -= t.bytes;
+        pump();
+    }
+    deliver();
+}
+
+AdmissionScheduler::Stats AdmissionScheduler::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{running_, queue_.size(), cpuInFlight_, memInFlight_, queuedWork_,
+                 admitted_, rejected_, expired_, rate_};
+}
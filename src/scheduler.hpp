@@ -0,0 +1,157 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Work-weighted admission control for simulation requests. Every request is
+// charged its estimated cost -- microcell-steps (numMicrocell * N) of CPU and
+// bytes of memory -- against global budgets, and waits for admission in a
+// weighted fair queue keyed by client: each request is tagged with a virtual
+// finish time, its start (the later of the current virtual time and the
+// client's previous finish tag) plus work / weight, and the smallest finish
+// tag is admitted first, so one client's giant request cannot hold every
+// other client behind it. Requests that would wait too long are refused up-front
+// (ServiceError 429, with a Retry-After from the queued work), and requests
+// with a deadline are dropped (ServiceError 503) once it cannot be met.
+class AdmissionScheduler
+{
+public:
+    struct Config
+    {
+        std::size_t slots = 4;                  // requests simulating at once
+        std::uint64_t cpuBudget = 0;            // microcell-steps in flight (0 = unlimited)
+        std::uint64_t memBudget = 0;            // bytes in flight (0 = unlimited)
+        double maxQueueSeconds = 30.0;          // refuse when the estimated wait exceeds this
+        double initialRate = 5e9;               // microcell-steps/s per slot, until measured
+        std::map<std::string, double> weights;  // per-client weights (default 1)
+    };
+
+    // Admission of one request; releases its budgets when destroyed. The CPU
+    // share can be handed back early (release_cpu()) when compute ends before
+    // the response has been sent. The measured rate is taken from begin() to
+    // release, so time spent receiving the body or queued for a thread after
+    // admission is not mistaken for simulation time.
+    class Ticket
+    {
+    public:
+        ~Ticket();
+        void begin(); // simulation starts now
+        void release_cpu();
+        Ticket(Ticket const &) = delete;
+        void operator=(Ticket const &) = delete;
+
+    private:
+        friend class AdmissionScheduler;
+        Ticket(AdmissionScheduler *s, std::uint64_t w, std::uint64_t b)
+            : sched(s), work(w), bytes(b), start(std::chrono::steady_clock::now()) {}
+        AdmissionScheduler *sched;
+        std::uint64_t work, bytes;
+        std::chrono::steady_clock::time_point start;
+        bool cpuHeld = true;
+    };
+
+    explicit AdmissionScheduler(const Config &config);
+
+    // Block until admitted. `deadline` bounds total time to completion; pass
+    // time_point::max() for none. Throws ServiceError (429 / 503) on refusal.
+    std::shared_ptr<Ticket> admit(const std::string &client, std::uint64_t work, std::uint64_t bytes,
+                                  std::chrono::steady_clock::time_point deadline =
+                                      std::chrono::steady_clock::time_point::max());
+
+    // Queue without blocking, and never refuse: for background work (jobs)
+    // that has already been accepted and can simply wait its fair turn.
+    // `granted` is called with the ticket once admitted (possibly before this
+    // returns, never with the scheduler locked). Returns an id for withdraw().
+    typedef std::function<void(std::shared_ptr<Ticket>)> Grant;
+    unsigned long long admit_async(const std::string &client, std::uint64_t work, std::uint64_t bytes, Grant granted);
+
+    // Take a still-queued admit_async() request out of the queue. Returns false
+    // if it has already been admitted (its callback has run or is running).
+    bool withdraw(unsigned long long id);
+
+    // Move `work` charged to `from` by a shared admission (a micro-batch) onto
+    // `to`, whose request it was: `to`'s later requests queue behind that work
+    // rather than `from`'s.
+    void transfer(const std::string &from, const std::string &to, std::uint64_t work);
+
+    struct Stats
+    {
+        std::size_t running, queued;
+        std::uint64_t cpuInFlight, memInFlight, queuedWork;
+        unsigned long long admitted, rejected, expired;
+        double rate; // measured microcell-steps/s per slot
+    };
+    Stats stats();
+
+    AdmissionScheduler(AdmissionScheduler const &) = delete;
+    void operator=(AdmissionScheduler const &) = delete;
+
+private:
+    struct Waiter
+    {
+        double startTag, finishTag;
+        unsigned long long seq;
+        std::uint64_t work, bytes;
+        bool admitted;
+        Grant granted; // admit_async() only
+        bool operator<(const Waiter &o) const { return finishTag < o.finishTag || (finishTag == o.finishTag && seq < o.seq); }
+    };
+    struct ByTag
+    {
+        bool operator()(const Waiter *a, const Waiter *b) const { return *a < *b; }
+    };
+
+    Config config_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::set<Waiter *, ByTag> queue_;
+    std::map<std::string, double> clientFinish_;
+    double virtualTime_ = 0.0;
+    std::map<unsigned long long, std::unique_ptr<Waiter>> async_; // queued admit_async() requests, by seq
+    std::vector<std::unique_ptr<Waiter>> ready_;                   // admitted, callback not yet run
+    unsigned long long seq_ = 1;
+    std::size_t running_ = 0;
+    std::uint64_t cpuInFlight_ = 0, memInFlight_ = 0, queuedWork_ = 0;
+    unsigned long long admitted_ = 0, rejected_ = 0, expired_ = 0;
+    double rate_;
+
+    std::shared_ptr<Ticket> enqueue(const std::string &client, std::uint64_t work, std::uint64_t bytes,
+                                    std::chrono::steady_clock::time_point deadline);
+    double weight(const std::string &client) const;
+    void tag(Waiter &w, const std::string &client); // mutex_ held
+    bool fits(const Waiter &w) const;
+    void pump(); // mutex_ held
+    void deliver(); // mutex_ not held; run the callbacks of admitted async requests
+    double estimated_wait() const; // mutex_ held; seconds until queued + running work drains
+    void finish_cpu(Ticket &t);
+    void finish_mem(Ticket &t);
+};
+
+#endif // SCHEDULER_H
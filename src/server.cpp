@@ -40,12 +40,28 @@
 #include "utilities.hpp"
 #include "pages.hpp"
 #include "ramlog.hpp"
+#include "service.hpp"
+#include "threadpool.hpp"
+#include "jobs.hpp"
+#include "scheduler.hpp"
+#include "resultcache.hpp"
+#include "digest.hpp"
+#include "devicecache.hpp"
+#include "sessions.hpp"
+#include "simcore.hpp"
+#include "unixsocket.hpp"
+#include "batch.hpp"
+#include "microbatch.hpp"
+#include "encoding.hpp"
+#include "cores.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "simd.hpp"
 #include <chrono>
 #include <ctime>
 #include <sstream>
 #include <memory>
 #include <vector>
-#include <map>
 #include <utility>
 #include <atomic>
 #include <mutex>
@@ -53,6 +69,8 @@
 #include <cstdint>
 #include <cstdlib>
 #include <algorithm>
+#include <fstream>
+#include <thread>
 
 #define COL_GREEN "\033[32;1m"  // Used for server messages
 #define COL_YELLOW "\033[33;1m" // Used for Warnings
@@ -69,49 +87,16 @@ std::string current_time(void)
   return timestr;
 }
 
-long message_sequence = 0;      // message sequence number (how many messages have been logged)
 // Print a ostringstream to stdout, and also log to the circular buffer RamLog for access with /logs
 // This function adds an [INFO] tag if no other tags are present. [ERROR] tags are red in stdout.
 // [WARN] tags are yellow (orange) in stdout.
 // The logging to the circular buffer RamLog logs preformatted HTML table rows, with appropriate
-// CSS classes for the quoted log level.
+// CSS classes for the quoted log level. The formatting and the writes happen on RamLog's own
+// thread, so logging costs a request thread no more than queueing the message.
 void message_print_log(std::ostringstream &message)
 {
-  message_sequence++;
-  std::string msg = message.str();
-
-  // if no tag is defined - give the message an INFO tag.
-  if (!((msg.find("[INFO]") != std::string::npos) || (msg.find("[ERROR]") != std::string::npos) || (msg.find("[WARN]") != std::string::npos)))
-  {
-    msg = "[INFO]  " + msg;
-  }
-
-  std::string message_class = ""; // CSS class (see pages.cpp) for message
-  std::string COL_START = "";   // ANSI code for stdout
-  std::string COL_STOP  = "";   // ANSI code for stdout
-  if (msg.find("[ERROR]") != std::string::npos)
-  {
-    // if message has an Error tag, give it the appropriate tags
-    message_class = "message-error";
-    COL_START = COL_RED;
-    COL_STOP = COL_RESET;
-  }
-  else if (msg.find("[WARN]") != std::string::npos)
-  {
-    // if message has an Warning tag, give it the appropriate tags
-    message_class = "message-warn";
-    COL_START = COL_YELLOW;
-    COL_STOP = COL_RESET;
-  }
-  else
-  {
-    // Otherwise, give the info tag
-    message_class = "message-info";
-  }
-
-  RamLog::getInstance().log("<tr><td class='sequence'>" + std::to_string(message_sequence) + "</td><td class='time'>" + current_time() + "</td><td class='message " + message_class + "'>" + msg + "</td></tr>");
+  RamLog::getInstance().log(message.str());
   message.str("");
-  std::cout << COL_START << msg << COL_STOP << std::endl;
 }
 
 // HTML-escape a string so attacker-controlled, request-derived data (e.g. req.path,
@@ -169,14 +154,8 @@ std::atomic<long long> requests_served{0}; // number of simulation requests serv
 std::atomic<long long> bytes_processed{0}; // number of bytes processed by server
 std::string last_request_time = "None";    // When the last request happened
 
-// Per-request DoS caps for POST /simspad. Simulation cost is O(N * numMicrocell), both
-// taken from the unauthenticated request; numMicrocell is bounded by MAX_MICROCELL in the
-// SiPM constructor, and these bound the waveform length and the total work product so a
-// crafted request cannot exhaust CPU/RAM (GHSA-f2ph-wv99-c83q). Tune to taste; the
-// canonical 5676-cell device at MAX_SAMPLES (~9.1e10) stays under MAX_WORK, so realistic
-// runs are unaffected and only pathological numMicrocell*N combinations are rejected.
-constexpr size_t MAX_SAMPLES = 16000000UL;          // ~122 MB of float64 input
-constexpr uint64_t MAX_WORK = 100000000000ULL;      // 1e11 microcell-steps per request
+// Per-request DoS caps (MAX_SAMPLES, MAX_WORK) live in service.hpp, shared by every
+// front end (GHSA-f2ph-wv99-c83q).
 
 // ---- CSRF / DNS-rebinding defenses (GHSA-x9fq-39h6-5x58) ----
 // The server binds loopback, but a browser the operator is using can still be coerced into
@@ -265,51 +244,49 @@ static bool state_change_authorised(const httplib::Request &req, httplib::Respon
 static std::string route_label(const std::string &path)
 {
   static const std::vector<std::string> known = {"/",        "/logs",    "/simspad", "/stop",
-                                                  "/metrics", "/healthz", "/version", "/favicon.ico"};
+                                                  "/metrics", "/healthz", "/version", "/favicon.ico",
+                                                  "/jobs",    "/sessions", "/simspad/batch"};
   for (const auto &route : known)
   {
     if (path == route)
       return route;
   }
-  return "other";
-}
-
-// Thread-safe counters for HTTP requests by route and status code, rendered in
-// the Prometheus text exposition format.
-class HttpRequestCounters
-{
-public:
-  static HttpRequestCounters &getInstance()
-  {
-    static HttpRequestCounters instance;
-    return instance;
-  }
-
-  void increment(const std::string &route, int status)
+  if (path.rfind("/jobs/", 0) == 0)
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    counts_[{route, status}]++;
+    return path.size() > 7 && path.compare(path.size() - 7, 7, "/result") == 0 ? "/jobs/{id}/result"
+                                                                                 : "/jobs/{id}";
   }
-
-  std::string render() const
+  if (path.rfind("/sessions/", 0) == 0)
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    std::ostringstream out;
-    out << "# HELP simspad_http_requests_total Total HTTP requests by path and status code.\n";
-    out << "# TYPE simspad_http_requests_total counter\n";
-    for (const auto &[key, count] : counts_)
-    {
-      out << "simspad_http_requests_total{path=\"" << key.first
-          << "\",status=\"" << key.second << "\"} " << count << "\n";
-    }
-    return out.str();
+    return path.size() > 8 && path.compare(path.size() - 8, 8, "/advance") == 0 ? "/sessions/{id}/advance"
+                                                                                 : "/sessions/{id}";
   }
+  return "other";
+}
 
-private:
-  HttpRequestCounters() = default;
-  mutable std::mutex mutex_;
-  std::map<std::pair<std::string, int>, long long> counts_;
-};
+// Every label route_label() can return, indexing the per-route request counters.
+static const std::vector<std::string> route_labels = {"/",
+                                                      "/logs",
+                                                      "/simspad",
+                                                      "/stop",
+                                                      "/metrics",
+                                                      "/healthz",
+                                                      "/version",
+                                                      "/favicon.ico",
+                                                      "/jobs",
+                                                      "/sessions",
+                                                      "/simspad/batch",
+                                                      "/jobs/{id}",
+                                                      "/jobs/{id}/result",
+                                                      "/sessions/{id}",
+                                                      "/sessions/{id}/advance",
+                                                      "other"};
+
+static size_t route_index(const std::string &path)
+{
+  const std::string label = route_label(path);
+  return std::find(route_labels.begin(), route_labels.end(), label) - route_labels.begin();
+}
 
 // ---- /favicon.ico ----
 
@@ -350,6 +327,111 @@ static const std::string &favicon_svg()
   return svg;
 }
 
+// Numeric / string server settings from the environment, with defaults.
+static unsigned long long env_u64(const char *name, unsigned long long fallback)
+{
+  const char *env = std::getenv(name);
+  return (env && *env) ? std::strtoull(env, nullptr, 10) : fallback;
+}
+
+static std::string env_str(const char *name, const std::string &fallback)
+{
+  const char *env = std::getenv(name);
+  return (env && *env) ? std::string(env) : fallback;
+}
+
+// Admission budgets from the environment. SIMSPAD_CLIENT_WEIGHTS is a comma-separated
+// list of client=weight pairs, where the client is an X-API-Key value or remote address.
+// Compute slots default to the cores this process may run on.
+static AdmissionScheduler::Config scheduler_config(const Topology &topology)
+{
+  AdmissionScheduler::Config config;
+  config.slots = std::max(1ULL, env_u64("SIMSPAD_COMPUTE_SLOTS", topology.cpus.size()));
+  config.cpuBudget = env_u64("SIMSPAD_CPU_BUDGET", 0);
+  config.memBudget = env_u64("SIMSPAD_MEM_BUDGET", 2ULL * 1024 * 1024 * 1024);
+  config.maxQueueSeconds = (double)env_u64("SIMSPAD_QUEUE_MAX_SECONDS", 30);
+  for (const std::string &pair : split_csv(env_str("SIMSPAD_CLIENT_WEIGHTS", "")))
+  {
+    size_t eq = pair.rfind('=');
+    double weight = (eq == std::string::npos) ? 0.0 : std::strtod(pair.c_str() + eq + 1, nullptr);
+    if (weight > 0.0)
+    {
+      config.weights[pair.substr(0, eq)] = weight;
+    }
+  }
+  return config;
+}
+
+// Device presets preloaded into the device cache at startup, in
+// dump_configuration() order: dt, numMicrocell, vBias, vBr, tauRecovery,
+// pdeMax, vChr, cCell, tauFwhm, digitalThreshold.
+static const std::vector<std::vector<double>> device_presets = {
+    {1e-11, 14410, 27.5, 24.5, 2.2 * 14e-9, 0.46, 2.04, 4.6e-14, 1.5e-9, 0.0}, // J30020 (examples/python/example.py)
+    {5e-11, 5676, 3.0, 0.0, 3.08e-8, 0.46, 2.04, 1.4e-14, 0.0, 0.0},           // README example device
+};
+
+// Preload the built-in presets, then any listed in the SIMSPAD_PRESETS file: one
+// X-SiPM-Params JSON object per line, whose optional meanPhotonsPerDt is kept warm.
+static void preload_devices(DeviceCache &devices)
+{
+  for (const auto &svars : device_presets)
+  {
+    devices.preload(svars, {});
+  }
+  std::string path = env_str("SIMSPAD_PRESETS", "");
+  if (path.empty())
+  {
+    return;
+  }
+  std::ifstream presets(path);
+  if (!presets)
+  {
+    std::cout << COL_RED << "Cannot open SIMSPAD_PRESETS file " << path << COL_RESET << std::endl;
+    return;
+  }
+  std::string line;
+  for (int n = 1; std::getline(presets, line); n++)
+  {
+    if (line.find('{') == std::string::npos)
+    {
+      continue; // blank line
+    }
+    try
+    {
+      double mean = -1.0;
+      std::vector<double> svars = parse_request_params(line, &mean);
+      devices.preload(svars, {mean});
+    }
+    catch (const std::exception &e)
+    {
+      std::cout << COL_RED << path << ":" << n << ": skipped preset: " << e.what() << COL_RESET << std::endl;
+    }
+  }
+}
+
+// Fair-queueing identity of a request: its API key when keys are checked
+// (SIMSPAD_API_KEY set), else its address -- an unchecked key would let any
+// client claim a fresh share, or another client's weight, per request.
+static std::string client_id(const httplib::Request &req)
+{
+  const char *apiKey = std::getenv("SIMSPAD_API_KEY");
+  const bool keyed = apiKey && *apiKey;
+  std::string key = keyed ? req.get_header_value("X-API-Key") : std::string();
+  return key.empty() ? req.remote_addr : key;
+}
+
+// Optional X-Deadline-Ms header: the client gives up after this many milliseconds,
+// so there is no point admitting the request once it can no longer finish in time.
+static std::chrono::steady_clock::time_point request_deadline(const httplib::Request &req)
+{
+  if (!req.has_header("X-Deadline-Ms"))
+  {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  unsigned long long ms = std::strtoull(req.get_header_value("X-Deadline-Ms").c_str(), nullptr, 10);
+  return std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+}
+
 int main(void)
 {
   cli_logo();
@@ -364,23 +446,107 @@ int main(void)
   Server srv; // HTTP
   // SSLServer srv; // HTTPS
 
-  // Limit Number of active threads - default to 12 if unset
-  srv.new_task_queue = []
-  { return new ThreadPool(4); };
+  // CPUs in our affinity mask and their NUMA nodes.
+  const Topology topology = Topology::detect();
+
+  // HTTP worker threads. Requests waiting for admission park one of these, so this
+  // is deliberately larger than the number of simulations allowed to run at once.
+  const size_t httpThreads =
+      std::max(1ULL, env_u64("SIMSPAD_HTTP_THREADS", std::max<size_t>(32, 2 * topology.cpus.size())));
+  srv.new_task_queue = [httpThreads]
+  { return new ThreadPool(httpThreads); };
 
   // Max payload size is 128 MB
   srv.set_payload_max_length(1024 * 1024 * 128);
 
+  // Per-request traces (X-SiPM-Trace: 1) are written here as Chrome trace-event
+  // JSON; unset, the header is ignored.
+  const std::string traceDir = env_str("SIMSPAD_TRACE_DIR", "");
+  std::atomic<unsigned long long> traceSeq{0};
+
+  // Asynchronous jobs (/jobs) run on a dedicated compute pool, never on the HTTP
+  // threads above, with inputs and results spooled to a bounded disk area.
+  // Both /simspad and jobs are admitted against the same CPU/memory budgets.
+  AdmissionScheduler scheduler(scheduler_config(topology));
+
+  // Seeded /simspad results, content-addressed; SIMSPAD_CACHE_BYTES=0 disables.
+  ResultCache cache(env_u64("SIMSPAD_CACHE_BYTES", 256ULL * 1024 * 1024), env_str("SIMSPAD_CACHE_SPILL_DIR", ""),
+                    env_u64("SIMSPAD_CACHE_SPILL_BYTES", 2ULL * 1024 * 1024 * 1024));
+  ComputePool computePool(env_u64("SIMSPAD_JOB_THREADS", topology.cpus.size()));
+  JobManager jobs(computePool, env_str("SIMSPAD_SPOOL_DIR", "/tmp/simspad-spool"),
+                  env_u64("SIMSPAD_SPOOL_MAX_BYTES", 2ULL * 1024 * 1024 * 1024),
+                  std::chrono::seconds(env_u64("SIMSPAD_JOB_TTL", 3600)), &scheduler);
+
+  // Device models (LUTs, age distributions) and pre-initialised microcell states
+  // kept across requests; warm states are refilled on the compute pool.
+  DeviceCache devices(env_u64("SIMSPAD_DEVICE_CACHE", 32), env_u64("SIMSPAD_WARM_STATES", 2),
+                      env_u64("SIMSPAD_WARM_BYTES", 256ULL * 1024 * 1024), &computePool);
+  preload_devices(devices);
+
+  // Idle cores lent to large unseeded runs, one pinned worker per leased core;
+  // SIMSPAD_SHARD_WORK=0 disables sharding.
+  CoreScheduler::Config coreConfig;
+  coreConfig.maxShards = env_u64("SIMSPAD_MAX_SHARDS", 0);
+  coreConfig.shardWork = env_u64("SIMSPAD_SHARD_WORK", 10000000000ULL);
+  coreConfig.pin = env_u64("SIMSPAD_PIN_CORES", 1) != 0;
+  CoreScheduler cores(topology, coreConfig);
+
+  // Request counters, latency histograms and work totals for GET /metrics,
+  // sharded per thread so recording them takes no lock.
+  MetricsRegistry metrics;
+  const MetricsRegistry::Id httpRequests = metrics.request_counter(
+      "simspad_http_requests_total", "Total HTTP requests by path and status code.", route_labels);
+  ServiceMetrics serviceMetrics(metrics);
+
+  // The simulation core shared by the HTTP and Unix-socket transports.
+  SimulationCore core(scheduler, devices, &cores, &serviceMetrics);
+
+  // Short concurrent /simspad requests for one device can be gathered into
+  // micro-batches while the server is busy; off unless SIMSPAD_MICROBATCH_US
+  // sets a window, since the lanes then share one core.
+  MicroBatcher batcher(scheduler, std::chrono::microseconds(env_u64("SIMSPAD_MICROBATCH_US", 0)),
+                       env_u64("SIMSPAD_MICROBATCH_SAMPLES", 65536), env_u64("SIMSPAD_MICROBATCH_LANES", 32));
+
+  // Optional binary transport for co-located clients (see unixsocket.hpp).
+  std::unique_ptr<UnixSocketServer> unixServer;
+  std::string unixPath = env_str("SIMSPAD_UNIX_SOCKET", "");
+  if (!unixPath.empty())
+  {
+    try
+    {
+      unixServer = std::make_unique<UnixSocketServer>(unixPath, core, env_u64("SIMSPAD_UNIX_THREADS", 8),
+                                                      [](const std::string &msg)
+                                                      {
+                                                        std::ostringstream message_buf;
+                                                        message_buf << msg;
+                                                        message_print_log(message_buf);
+                                                      });
+      std::ostringstream message_buf;
+      message_buf << "[INFO]  Listening on unix socket " << unixPath;
+      message_print_log(message_buf);
+    }
+    catch (const std::runtime_error &e)
+    {
+      std::ostringstream message_buf;
+      message_buf << "[WARN]  Unix socket disabled: " << e.what();
+      message_print_log(message_buf);
+    }
+  }
+
+  // Persistent sessions (/sessions): server-held SiPM state for closed-loop runs.
+  SessionManager sessions(env_u64("SIMSPAD_SESSION_MAX_BYTES", 1024ULL * 1024 * 1024),
+                          std::chrono::seconds(env_u64("SIMSPAD_SESSION_IDLE", 300)), &devices);
+
   // Defense-in-depth against XSS: a restrictive Content-Security-Policy on every response
   // so any markup that slips into a rendered page cannot execute script (GHSA-mvgv-c4rv-99ch).
   // img-src allows 'self' (favicon) and data: (the embedded base64 SVG logo).
   // Also tallies per-route, per-status request counters for GET /metrics; this runs for
   // every response (including those short-circuited by the pre-routing handler below).
-  srv.set_post_routing_handler([](const Request &req, Response &res)
+  srv.set_post_routing_handler([&](const Request &req, Response &res)
                                {
     res.set_header("Content-Security-Policy",
                    "default-src 'none'; style-src 'unsafe-inline'; img-src 'self' data:; base-uri 'none'; form-action 'none'");
-    HttpRequestCounters::getInstance().increment(route_label(req.path), res.status); });
+    metrics.count_request(httpRequests, route_index(req.path), res.status); });
 
   // Reject any request whose Host header is not allowlisted, before routing. This defeats
   // DNS-rebinding (a rebound attacker hostname won't match the loopback allowlist) across
@@ -478,9 +644,9 @@ int main(void)
     out << "# TYPE simspad_start_time_seconds gauge\n";
     out << "simspad_start_time_seconds " << start_time_epoch << "\n";
 
-    out << "# HELP simspad_build_info SimSPAD build version.\n";
+    out << "# HELP simspad_build_info SimSPAD build version and the instruction set of its kernels.\n";
     out << "# TYPE simspad_build_info gauge\n";
-    out << "simspad_build_info{version=\"" << VERSION << "\"} 1\n";
+    out << "simspad_build_info{version=\"" << VERSION << "\",kernels=\"" << isa_name(simd().isa) << "\"} 1\n";
 
     out << "# HELP simspad_simulation_requests_total Total POST /simspad simulation requests served.\n";
     out << "# TYPE simspad_simulation_requests_total counter\n";
@@ -490,7 +656,153 @@ int main(void)
     out << "# TYPE simspad_input_bytes_total counter\n";
     out << "simspad_input_bytes_total " << bytes_processed.load() << "\n";
 
-    out << HttpRequestCounters::getInstance().render();
+    out << "# HELP simspad_jobs Asynchronous jobs currently held, by status.\n";
+    out << "# TYPE simspad_jobs gauge\n";
+    auto jobCounts = jobs.counts();
+    for (JobStatus st : {JobStatus::Queued, JobStatus::Running, JobStatus::Done, JobStatus::Failed, JobStatus::Cancelled})
+    {
+      out << "simspad_jobs{status=\"" << job_status_name(st) << "\"} " << jobCounts[st] << "\n";
+    }
+
+    out << "# HELP simspad_job_spool_bytes Bytes of job spool space reserved.\n";
+    out << "# TYPE simspad_job_spool_bytes gauge\n";
+    out << "simspad_job_spool_bytes " << jobs.spool_bytes() << "\n";
+
+    auto sched = scheduler.stats();
+    out << "# HELP simspad_admission_running Simulations currently admitted and running.\n";
+    out << "# TYPE simspad_admission_running gauge\n";
+    out << "simspad_admission_running " << sched.running << "\n";
+
+    out << "# HELP simspad_admission_queued Simulations waiting for admission.\n";
+    out << "# TYPE simspad_admission_queued gauge\n";
+    out << "simspad_admission_queued " << sched.queued << "\n";
+
+    out << "# HELP simspad_admission_queued_work Microcell-steps of work waiting for admission.\n";
+    out << "# TYPE simspad_admission_queued_work gauge\n";
+    out << "simspad_admission_queued_work " << sched.queuedWork << "\n";
+
+    out << "# HELP simspad_admission_cpu_in_flight Microcell-steps of admitted work not yet finished.\n";
+    out << "# TYPE simspad_admission_cpu_in_flight gauge\n";
+    out << "simspad_admission_cpu_in_flight " << sched.cpuInFlight << "\n";
+
+    out << "# HELP simspad_admission_memory_bytes Estimated bytes held by admitted requests.\n";
+    out << "# TYPE simspad_admission_memory_bytes gauge\n";
+    out << "simspad_admission_memory_bytes " << sched.memInFlight << "\n";
+
+    out << "# HELP simspad_admission_total Admission decisions, by outcome.\n";
+    out << "# TYPE simspad_admission_total counter\n";
+    out << "simspad_admission_total{outcome=\"admitted\"} " << sched.admitted << "\n";
+    out << "simspad_admission_total{outcome=\"rejected\"} " << sched.rejected << "\n";
+    out << "simspad_admission_total{outcome=\"expired\"} " << sched.expired << "\n";
+
+    out << "# HELP simspad_admission_rate Measured throughput per slot, in microcell-steps per second.\n";
+    out << "# TYPE simspad_admission_rate gauge\n";
+    out << "simspad_admission_rate " << sched.rate << "\n";
+
+    auto cached = cache.stats();
+    out << "# HELP simspad_cache_requests_total Result cache lookups for seeded requests, by outcome.\n";
+    out << "# TYPE simspad_cache_requests_total counter\n";
+    out << "simspad_cache_requests_total{outcome=\"hit\"} " << cached.hits << "\n";
+    out << "simspad_cache_requests_total{outcome=\"miss\"} " << cached.misses << "\n";
+    out << "simspad_cache_requests_total{outcome=\"coalesced\"} " << cached.coalesced << "\n";
+
+    out << "# HELP simspad_cache_evictions_total Results evicted from the in-memory cache.\n";
+    out << "# TYPE simspad_cache_evictions_total counter\n";
+    out << "simspad_cache_evictions_total " << cached.evictions << "\n";
+
+    out << "# HELP simspad_cache_entries Results held in the cache, by tier.\n";
+    out << "# TYPE simspad_cache_entries gauge\n";
+    out << "simspad_cache_entries{tier=\"memory\"} " << cached.entries << "\n";
+    out << "simspad_cache_entries{tier=\"disk\"} " << cached.spilledEntries << "\n";
+
+    out << "# HELP simspad_cache_bytes Bytes of results held in the cache, by tier.\n";
+    out << "# TYPE simspad_cache_bytes gauge\n";
+    out << "simspad_cache_bytes{tier=\"memory\"} " << cached.bytes << "\n";
+    out << "simspad_cache_bytes{tier=\"disk\"} " << cached.spilledBytes << "\n";
+
+    auto sess = sessions.stats();
+    out << "# HELP simspad_sessions Live simulation sessions.\n";
+    out << "# TYPE simspad_sessions gauge\n";
+    out << "simspad_sessions " << sess.sessions << "\n";
+
+    out << "# HELP simspad_session_bytes Bytes of microcell state held by live sessions.\n";
+    out << "# TYPE simspad_session_bytes gauge\n";
+    out << "simspad_session_bytes " << sess.bytes << "\n";
+
+    out << "# HELP simspad_sessions_evicted_total Sessions evicted after idling past the timeout.\n";
+    out << "# TYPE simspad_sessions_evicted_total counter\n";
+    out << "simspad_sessions_evicted_total " << sess.evicted << "\n";
+
+    auto mb = batcher.stats();
+    out << "# HELP simspad_microbatches_total Micro-batches of concurrent small /simspad requests run.\n";
+    out << "# TYPE simspad_microbatches_total counter\n";
+    out << "simspad_microbatches_total " << mb.batches << "\n";
+
+    out << "# HELP simspad_microbatch_lanes_total Requests run as lanes of micro-batches.\n";
+    out << "# TYPE simspad_microbatch_lanes_total counter\n";
+    out << "simspad_microbatch_lanes_total " << mb.lanes << "\n";
+
+    auto cs = cores.stats();
+    out << "# HELP simspad_cores CPUs available to the server.\n";
+    out << "# TYPE simspad_cores gauge\n";
+    out << "simspad_cores " << cs.cores << "\n";
+
+    out << "# HELP simspad_numa_nodes NUMA nodes spanned by those CPUs.\n";
+    out << "# TYPE simspad_numa_nodes gauge\n";
+    out << "simspad_numa_nodes " << cs.nodes << "\n";
+
+    out << "# HELP simspad_cores_leased Helper cores currently running shards of large requests.\n";
+    out << "# TYPE simspad_cores_leased gauge\n";
+    out << "simspad_cores_leased " << cs.leased << "\n";
+
+    out << "# HELP simspad_parallel_runs_total Requests sharded across several cores.\n";
+    out << "# TYPE simspad_parallel_runs_total counter\n";
+    out << "simspad_parallel_runs_total " << cs.parallelRuns << "\n";
+
+    if (unixServer)
+    {
+      auto uds = unixServer->stats();
+      out << "# HELP simspad_unix_connections_total Connections accepted on the Unix socket.\n";
+      out << "# TYPE simspad_unix_connections_total counter\n";
+      out << "simspad_unix_connections_total " << uds.connections << "\n";
+
+      out << "# HELP simspad_unix_requests_total Simulations admitted over the Unix socket.\n";
+      out << "# TYPE simspad_unix_requests_total counter\n";
+      out << "simspad_unix_requests_total " << uds.requests << "\n";
+
+      out << "# HELP simspad_unix_received_bytes_total Waveform bytes received over the Unix socket.\n";
+      out << "# TYPE simspad_unix_received_bytes_total counter\n";
+      out << "simspad_unix_received_bytes_total " << uds.bytesIn << "\n";
+
+      out << "# HELP simspad_unix_shared_memory_requests_total Simulations run in place in client shared memory.\n";
+      out << "# TYPE simspad_unix_shared_memory_requests_total counter\n";
+      out << "simspad_unix_shared_memory_requests_total " << uds.sharedRequests << "\n";
+    }
+
+    auto dev = devices.stats();
+    out << "# HELP simspad_device_cache_requests_total Device model lookups, by outcome.\n";
+    out << "# TYPE simspad_device_cache_requests_total counter\n";
+    out << "simspad_device_cache_requests_total{outcome=\"hit\"} " << dev.modelHits << "\n";
+    out << "simspad_device_cache_requests_total{outcome=\"miss\"} " << dev.modelMisses << "\n";
+
+    out << "# HELP simspad_warm_state_requests_total Requests for a pre-initialised device, by outcome.\n";
+    out << "# TYPE simspad_warm_state_requests_total counter\n";
+    out << "simspad_warm_state_requests_total{outcome=\"hit\"} " << dev.warmHits << "\n";
+    out << "simspad_warm_state_requests_total{outcome=\"miss\"} " << dev.warmMisses << "\n";
+
+    out << "# HELP simspad_device_models Device models held in the device cache.\n";
+    out << "# TYPE simspad_device_models gauge\n";
+    out << "simspad_device_models " << dev.models << "\n";
+
+    out << "# HELP simspad_warm_states Pre-initialised devices ready to hand out.\n";
+    out << "# TYPE simspad_warm_states gauge\n";
+    out << "simspad_warm_states " << dev.warmStates << "\n";
+
+    out << "# HELP simspad_warm_state_bytes Bytes of microcell state held by warm devices.\n";
+    out << "# TYPE simspad_warm_state_bytes gauge\n";
+    out << "simspad_warm_state_bytes " << dev.warmBytes << "\n";
+
+    out << metrics.render();
 
     res.set_content(out.str(), "text/plain; version=0.0.4; charset=utf-8"); });
 
@@ -499,9 +811,10 @@ int main(void)
   srv.Get("/healthz", [](const Request & /*req*/, Response &res)
           { res.set_content("ok\n", "text/plain"); });
 
-  // Build version, e.g. for deployment tracking (also in simspad_build_info on /metrics).
+  // Build version, e.g. for deployment tracking, and the kernels' instruction set
+  // chosen for this CPU (both also in simspad_build_info on /metrics).
   srv.Get("/version", [](const Request & /*req*/, Response &res)
-          { res.set_content(std::string(VERSION) + "\n", "text/plain"); });
+          { res.set_content(std::string(VERSION) + "\nkernels: " + isa_name(simd().isa) + "\n", "text/plain"); });
 
   // Browser favicon: the SimSPAD logo SVG (also embedded as a data: URI on the HTML pages).
   srv.Get("/favicon.ico", [](const Request & /*req*/, Response &res)
@@ -514,11 +827,21 @@ int main(void)
   // waveform -- little-endian float64, expected photons-per-dt striking the
   // whole array, one value per time step. The response is streamed back as
   // `application/octet-stream`: little-endian float64 charge-per-step, the same
-  // length as the input, produced in bounded-memory chunks off the streaming
-  // core (no giant output buffer, no positional parameter header).
-  srv.Post("/simspad", [](const Request &req, Response &res)
+  // length as the input (no positional parameter header). With
+  // `X-SiPM-Output: events` the response is instead the sparse detection-event
+  // list (`application/x-simspad-events`, packed 20-byte records).
+  //
+  // The body is read through the content receiver and decoded to float64 as
+  // it arrives, checked against the limits as it grows; the run is admitted
+  // once it is complete and simulated 65536 samples at a time in the content
+  // provider, each chunk's output sent as it is produced, so only the input is
+  // held in full. The initial microcell ages are seeded from an optional
+  // "meanPhotonsPerDt" key in X-SiPM-Params, or else from the mean of the
+  // whole input.
+  srv.Post("/simspad", [&](const Request &req, Response &res, const ContentReader &content_reader)
            {
     last_request_time = current_time();
+    const auto arrived = std::chrono::steady_clock::now();
     std::ostringstream message_buf;
     using namespace std;
     message_buf << "==================== GOT POST ====================" << std::endl;
@@ -535,129 +858,487 @@ int main(void)
       return;
     }
 
+    auto reject = [&](int status, const string &why)
+    {
+      res.status = status;
+      res.set_content(why, "text/plain");
+      message_buf << "[ERROR] rejected request: " << html_escape(why); // may echo request headers
+      message_print_log(message_buf);
+    };
+
     // --- device parameters (JSON header) ---
     string paramJson = req.get_header_value("X-SiPM-Params");
     if (paramJson.empty())
     {
-      res.status = 400;
-      res.set_content("missing X-SiPM-Params header (JSON device parameters)", "text/plain");
-      message_buf << "[ERROR] rejected request: no X-SiPM-Params header";
-      message_print_log(message_buf);
+      reject(400, "missing X-SiPM-Params header (JSON device parameters)");
+      return;
+    }
+    if (req.is_multipart_form_data())
+    {
+      reject(400, "multipart bodies are not supported (expect a float64 octet-stream)");
       return;
     }
 
-    map<string, double> pm = parse_flat_json(paramJson);
-    static const char *keys[10] = {"dt", "numMicrocell", "vBias", "vBr", "tauRecovery",
-                                   "pdeMax", "vChr", "cCell", "tauFwhm", "digitalThreshold"};
-    vector<double> svars(10);
-    for (int i = 0; i < 10; i++)
+    double seedMean = -1.0;
+    vector<double> svars;
+    try
+    {
+      svars = parse_request_params(paramJson, &seedMean);
+    }
+    catch (const ServiceError &e)
+    {
+      reject(e.status, e.what());
+      return;
+    }
+
+    // Negotiated wire encodings (see encoding.hpp): the body's is an
+    // `encoding` parameter on its Content-Type, the response's one on Accept.
+    WireFormat inFormat, outFormat;
+    try
+    {
+      inFormat = parse_wire_format(req.get_header_value("Content-Type"), 415);
+      outFormat = parse_wire_format(req.get_header_value("Accept"), 406);
+    }
+    catch (const ServiceError &e)
+    {
+      reject(e.status, e.what());
+      return;
+    }
+    std::unique_ptr<WireDecoder> decoder;
+    if (inFormat.encoding != Encoding::F64)
     {
-      auto kv = pm.find(keys[i]);
-      if (kv == pm.end())
+      decoder = std::make_unique<WireDecoder>(inFormat);
+    }
+    // Samples in a body of `bytes`, where the encoding fixes it (else 0).
+    auto samples_in = [&](size_t bytes) -> size_t
+    {
+      switch (inFormat.encoding)
       {
-        res.status = 400;
-        res.set_content(string("X-SiPM-Params missing key: ") + keys[i], "text/plain");
-        message_buf << "[ERROR] rejected request: params missing key " << keys[i];
-        message_print_log(message_buf);
+      case Encoding::F64:
+        return bytes / sizeof(double);
+      case Encoding::F32:
+        return bytes / sizeof(float);
+      default:
+        return 0;
+      }
+    };
+
+    // Declared waveform length. Chunked uploads carry no Content-Length, so the
+    // limits are also enforced on the running sample count while receiving.
+    size_t declaredBytes = 0;
+    if (req.has_header("Content-Length"))
+    {
+      declaredBytes = (size_t)strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+      if (inFormat.encoding == Encoding::F64 && declaredBytes % sizeof(double) != 0)
+      {
+        reject(400, "body length " + to_string(declaredBytes) + " is not a multiple of 8 (expect a float64 waveform)");
+        return;
+      }
+      if (inFormat.encoding == Encoding::F32 && declaredBytes % sizeof(float) != 0)
+      {
+        reject(400, "body length " + to_string(declaredBytes) + " is not a multiple of 4 (expect a float32 waveform)");
         return;
       }
-      svars[i] = kv->second;
     }
-
-    // --- optical-input waveform (octet-stream body) ---
-    const string &body = req.body;
-    if (body.size() % sizeof(double) != 0)
+    size_t N = samples_in(declaredBytes);
+
+    // Optional X-SiPM-Seed makes the run reproducible (and cacheable, below).
+    // Optional sparse output: `X-SiPM-Output: events` replaces the dense float64
+    // stream with packed 20-byte (step <u8, cell <u4, charge <f8) detection
+    // records, so the response scales with detections rather than samples.
+    SimulationRequest sreq;
+    sreq.svars = svars;
+    sreq.seedMean = seedMean;
+    sreq.seeded = req.has_header("X-SiPM-Seed");
+    sreq.samples = N;
+    sreq.events = (req.get_header_value("X-SiPM-Output") == "events");
+    sreq.client = client_id(req);
+    sreq.deadline = request_deadline(req);
+    const bool wantEvents = sreq.events;
+    const std::string contentType = wantEvents ? "application/x-simspad-events" : outFormat.media_type();
+    const bool encodeOutput = !wantEvents && outFormat.encoding != Encoding::F64;
+
+    // Build the device first (from the device cache) and check the declared length.
+    std::unique_ptr<SimulationRun> run;
+    try
     {
-      res.status = 400;
-      res.set_content("body length is not a multiple of 8 (expect a float64 waveform)", "text/plain");
-      message_buf << "[ERROR] rejected request: body length " << body.size() << " not a multiple of 8";
-      message_print_log(message_buf);
+      if (sreq.seeded)
+      {
+        sreq.seed = parse_seed(req.get_header_value("X-SiPM-Seed"));
+      }
+      run = core.prepare(sreq);
+    }
+    catch (const ServiceError &e)
+    {
+      reject(e.status, e.what());
       return;
     }
-    size_t N = body.size() / sizeof(double);
 
-    // Bound per-request work before allocating or simulating (GHSA-f2ph-wv99-c83q).
-    // Cap the waveform length first so we never copy an oversized body.
-    if (N > MAX_SAMPLES)
+    // Optional `X-SiPM-Trace: 1` (with SIMSPAD_TRACE_DIR set): record this
+    // request's stages and write them to <dir>/<id>.json once the response
+    // has been sent; the reply's X-SiPM-Trace header names the file.
+    std::shared_ptr<Tracer> tracer;
+    std::string tracePath;
+    if (!traceDir.empty() && req.get_header_value("X-SiPM-Trace") == "1")
     {
-      res.status = 413;
-      res.set_content("input waveform too long (max " + std::to_string(MAX_SAMPLES) + " samples)", "text/plain");
-      message_buf << "[ERROR] rejected request: " << N << " samples exceeds MAX_SAMPLES " << MAX_SAMPLES;
+      const auto epoch = std::chrono::system_clock::now().time_since_epoch();
+      const std::string id = "simspad-" + to_string(std::chrono::duration_cast<std::chrono::milliseconds>(epoch).count()) +
+                             "-" + to_string(traceSeq++);
+      tracer = std::make_shared<Tracer>();
+      tracePath = traceDir + "/" + id + ".json";
+      run->set_tracer(tracer);
+      res.set_header("X-SiPM-Trace", id + ".json");
+    }
+
+    // Stream the response in bounded-size chunks. The provider runs after this
+    // handler returns, hence the shared_ptr captures; the admission ticket holds
+    // the request's memory budget until the response has been sent.
+    auto serve = [&](ResultCache::Result output)
+    {
+      auto pos = make_shared<size_t>(0);
+      res.set_chunked_content_provider(
+          contentType,
+          [output, pos, ticket = run->ticket(), encodeOutput, outFormat, arrived, tracer, tracePath,
+           firstByte = make_shared<std::chrono::steady_clock::time_point>(),
+           &serviceMetrics](size_t /*offset*/, httplib::DataSink &sink) -> bool
+          {
+            const size_t chunk = (1u << 16) * sizeof(double); // 512 KiB per block
+            size_t n = (output->size() - *pos < chunk) ? (output->size() - *pos) : chunk;
+            if (*pos == 0)
+            {
+              *firstByte = std::chrono::steady_clock::now();
+              serviceMetrics.registry.observe(serviceMetrics.firstByte, ServiceMetrics::since(arrived));
+            }
+            if (n > 0)
+            {
+              bool sent;
+              if (encodeOutput)
+              {
+                // Each chunk becomes one block of the negotiated encoding.
+                std::vector<double> samples(n / sizeof(double));
+                std::memcpy(samples.data(), output->data() + *pos, n);
+                std::string block;
+                encode_samples(outFormat, samples.data(), samples.size(), block);
+                sent = sink.write(block.data(), block.size());
+              }
+              else
+              {
+                sent = sink.write(output->data() + *pos, n);
+              }
+              if (!sent)
+              {
+                return false; // client went away
+              }
+              *pos += n;
+            }
+            if (*pos >= output->size())
+            {
+              sink.done();
+              serviceMetrics.registry.observe(serviceMetrics.latency, ServiceMetrics::since(arrived));
+              if (tracer)
+              {
+                const auto now = std::chrono::steady_clock::now();
+                tracer->record("respond", *firstByte, now);
+                tracer->record("request", arrived, now);
+                try
+                {
+                  tracer->write_json(tracePath);
+                }
+                catch (const std::exception &e)
+                {
+                  RamLog::getInstance().log(std::string("[ERROR] ") + e.what());
+                }
+              }
+            }
+            return true;
+          });
+    };
+
+    // A short dense request (Content-Length known) may share a micro-batch with
+    // concurrent ones for the same device; its body is read in full first.
+    if (batcher.eligible(sreq))
+    {
+      std::string small;
+      small.reserve(declaredBytes);
+      bool received = content_reader([&](const char *data, size_t len)
+      {
+        if (small.size() + len > declaredBytes)
+        {
+          return false;
+        }
+        small.append(data, len);
+        return true;
+      });
+      if (!received || small.size() != declaredBytes)
+      {
+        reject(400, "failed to read request body");
+        return;
+      }
+      vector<double> in(N);
+      if (!decoder)
+      {
+        memcpy(in.data(), small.data(), declaredBytes);
+      }
+      ResultCache::Result output;
+      try
+      {
+        if (decoder)
+        {
+          in.clear();
+          decoder->feed(small.data(), small.size(), [&](const double *x, size_t n)
+                        { in.insert(in.end(), x, x + n); });
+          decoder->finish();
+        }
+        output = make_shared<string>(batcher.run(*run, in));
+      }
+      catch (const ServiceError &e)
+      {
+        if (e.retryAfter > 0)
+        {
+          res.set_header("Retry-After", to_string(e.retryAfter));
+        }
+        reject(e.status, e.what());
+        return;
+      }
+      bytes_processed += (long)declaredBytes;
+      message_buf << "Simulated " << N << " samples in a micro-batch";
       message_print_log(message_buf);
+      serve(output);
+      requests_served++;
       return;
     }
-    bytes_processed += (long)body.size();
 
-    // Build the device first. Invalid/out-of-range parameters throw from the SiPM
-    // constructor (length, finiteness, numMicrocell range) and become a clean 400
-    // here rather than an uncaught 500.
-    std::shared_ptr<SiPM> sipm;
-    try
+    // The body is received in full, decoded to float64 as it arrives with the
+    // limits checked on the running sample count, before the run is admitted:
+    // cpp-httplib sends nothing until this handler returns, so simulating
+    // during the upload would not bring the first byte forward, and a slow
+    // uploader must not hold a compute slot. The simulation then runs a chunk
+    // at a time in the content provider, streaming each chunk's output.
+    // A seeded run is reproducible, and therefore cacheable: its body is also
+    // hashed together with the params, seed and output mode, so repeats are
+    // answered from the result cache and identical requests in flight at once
+    // share a single computation.
+    auto input = make_shared<string>(); // float64 samples
+    input->reserve(decoder ? 0 : declaredBytes);
+    const bool cacheable = sreq.seeded && cache.enabled();
+    Sha256 key;
+    if (cacheable)
     {
-      sipm = make_shared<SiPM>(svars);
+      key.update(paramJson + "\n" + to_string(sreq.seed) + "\n" + (wantEvents ? "events" : "dense") + "\n" +
+                 inFormat.media_type() + "\n");
     }
-    catch (const std::invalid_argument &e)
+    string failure;
+    int failStatus = 0;
+    bool received;
     {
-      res.status = 400;
-      res.set_content(std::string("invalid device parameters: ") + e.what(), "text/plain");
-      message_buf << "[ERROR] rejected request: " << e.what();
-      message_print_log(message_buf);
+      TraceSpan span(tracer.get(), "receive body");
+      received = content_reader([&](const char *data, size_t len)
+      {
+        try
+        {
+          if (cacheable)
+          {
+            key.update(data, len);
+          }
+          if (decoder)
+          {
+            decoder->feed(data, len, [&](const double *x, size_t n)
+                          { input->append(reinterpret_cast<const char *>(x), n * sizeof(double)); });
+          }
+          else
+          {
+            input->append(data, len);
+          }
+          check_request_limits(run->device(), input->size() / sizeof(double));
+        }
+        catch (const ServiceError &e)
+        {
+          failStatus = e.status;
+          failure = e.what();
+          return false;
+        }
+        return true;
+      });
+      if (received && !failStatus && decoder)
+      {
+        try
+        {
+          decoder->finish();
+        }
+        catch (const ServiceError &e)
+        {
+          failStatus = e.status;
+          failure = e.what();
+        }
+      }
+    }
+    if (failStatus)
+    {
+      reject(failStatus, failure);
       return;
     }
-
-    // Work-product budget. numMicrocell is already capped to MAX_MICROCELL, so this
-    // only rejects pathological numMicrocell*N combinations (e.g. a tiny body with a
-    // huge cell count) without affecting realistic simulations.
-    if ((uint64_t)sipm->numMicrocell * (uint64_t)N > MAX_WORK)
+    if (!received)
     {
-      res.status = 413;
-      res.set_content("simulation too large (numMicrocell * samples exceeds the per-request budget)", "text/plain");
-      message_buf << "[ERROR] rejected request: work "
-                  << ((uint64_t)sipm->numMicrocell * (uint64_t)N) << " exceeds MAX_WORK " << MAX_WORK;
-      message_print_log(message_buf);
+      reject(400, "failed to read request body");
+      return;
+    }
+    if (input->size() % sizeof(double) != 0)
+    {
+      reject(400, "body length " + to_string(input->size()) + " is not a multiple of 8 (expect a float64 waveform)");
       return;
     }
+    N = input->size() / sizeof(double);
+    run->declare(N);
+    if (seedMean < 0.0)
+    {
+      run->seed_from(input_mean(reinterpret_cast<const double *>(input->data()), N));
+    }
+    bytes_processed += (long)input->size();
 
-    // The chunked provider below outlives this handler call, so copy the input
-    // out of the (soon-to-be-destroyed) request.
-    auto input = make_shared<vector<double>>(N);
-    memcpy(input->data(), body.data(), body.size());
+    std::unique_ptr<ResultCache::Producer> producer;
+    if (cacheable)
+    {
+      ResultCache::Result hit = cache.acquire(key.hex_digest(), &producer, sreq.deadline);
+      if (hit)
+      {
+        res.set_header("X-SiPM-Cache", "hit");
+        serve(hit);
+        message_buf << "Served " << hit->size() << " bytes from the result cache";
+        message_print_log(message_buf);
+        requests_served++;
+        return;
+      }
+      res.set_header("X-SiPM-Cache", "miss");
+    }
 
-    // Seed the initial age distribution from the raw mean light level (matching
-    // the in-memory simulate()).
-    double rawSum = 0.0;
-    for (size_t i = 0; i < N; i++)
+    // Wait for a fair share of the compute budget.
+    try
     {
-      rawSum += (*input)[i];
+      run->admit();
+    }
+    catch (const ServiceError &e)
+    {
+      if (e.retryAfter > 0)
+      {
+        res.set_header("Retry-After", to_string(e.retryAfter));
+      }
+      reject(e.status, e.what());
+      return;
     }
-    sipm->init_state(N ? rawSum / (double)N : 0.0, (unsigned long)N);
 
-    message_buf << "Streaming " << N << " samples (" << body.size() << " bytes in)";
+    message_buf << "Streaming " << N << " samples (" << input->size() << " bytes in)";
     message_print_log(message_buf);
 
-    // Stream the response in bounded-memory chunks straight off the streaming
-    // core. The provider runs after this handler returns, hence the shared_ptr
-    // captures (sipm/input outlive the request; pos carries progress).
-    auto pos = make_shared<size_t>(0);
+    // The provider outlives this handler call and holds the run (and with it
+    // the admission ticket) until the response has been sent. A cached run
+    // also collects its raw output for the cache.
+    struct Progress
+    {
+      size_t pos = 0;
+      bool finished = false;
+      bool started = false;
+      std::chrono::steady_clock::time_point firstByte;
+      std::shared_ptr<std::string> whole;
+    };
+    auto progress = make_shared<Progress>();
+    if (producer)
+    {
+      progress->whole = make_shared<string>();
+    }
     res.set_chunked_content_provider(
-        "application/octet-stream",
-        [sipm, input, pos, N](size_t /*offset*/, httplib::DataSink &sink) -> bool
+        contentType,
+        [run = std::shared_ptr<SimulationRun>(std::move(run)), input, progress,
+         producer = std::shared_ptr<ResultCache::Producer>(std::move(producer)), wantEvents, encodeOutput, outFormat,
+         arrived, tracer, tracePath, &serviceMetrics](size_t /*offset*/, httplib::DataSink &sink) -> bool
         {
-          const size_t chunk = 1u << 16; // 65536 samples per block
-          size_t n = (N - *pos < chunk) ? (N - *pos) : chunk;
-          if (n > 0)
+          const size_t chunk = (1u << 16) * sizeof(double); // 65536 samples per block
+          std::string raw; // dense float64 or packed events
+          SimulationRun::Sink emit = [&](const double *out, size_t n, vector<DetectionEvent> &events)
           {
-            vector<double> out(n);
-            sipm->simulate_chunk(input->data() + *pos, out.data(), n);
-            if (!sink.write(reinterpret_cast<const char *>(out.data()), n * sizeof(double)))
+            if (wantEvents)
+            {
+              size_t at = raw.size();
+              raw.resize(at + events.size() * EVENT_RECORD_BYTES);
+              for (size_t i = 0; i < events.size(); i++)
+              {
+                pack_event(events[i], &raw[at + i * EVENT_RECORD_BYTES]);
+              }
+              events.clear();
+            }
+            else
+            {
+              raw.append(reinterpret_cast<const char *>(out), n * sizeof(double));
+            }
+          };
+          try
+          {
+            if (progress->pos < input->size())
+            {
+              size_t n = (input->size() - progress->pos < chunk) ? (input->size() - progress->pos) : chunk;
+              run->feed(input->data() + progress->pos, n, emit);
+              progress->pos += n;
+            }
+            else if (!progress->finished)
+            {
+              run->finish(emit);
+              progress->finished = true;
+              string().swap(*input);
+            }
+          }
+          catch (const std::exception &e)
+          {
+            RamLog::getInstance().log(std::string("[ERROR] simulation failed mid-response: ") + e.what());
+            return false;
+          }
+
+          if (!raw.empty())
+          {
+            if (!progress->started)
+            {
+              progress->started = true;
+              progress->firstByte = std::chrono::steady_clock::now();
+              serviceMetrics.registry.observe(serviceMetrics.firstByte, ServiceMetrics::since(arrived));
+            }
+            if (progress->whole)
+            {
+              progress->whole->append(raw);
+            }
+            std::string block;
+            if (encodeOutput)
+            {
+              // Each chunk becomes one block of the negotiated encoding.
+              std::vector<double> samples(raw.size() / sizeof(double));
+              std::memcpy(samples.data(), raw.data(), raw.size());
+              encode_samples(outFormat, samples.data(), samples.size(), block);
+            }
+            const std::string &wire = encodeOutput ? block : raw;
+            if (!sink.write(wire.data(), wire.size()))
             {
               return false; // client went away
             }
-            *pos += n;
           }
-          if (*pos >= N)
+          if (progress->finished)
           {
+            if (producer)
+            {
+              producer->publish(progress->whole);
+            }
             sink.done();
+            serviceMetrics.registry.observe(serviceMetrics.latency, ServiceMetrics::since(arrived));
+            if (tracer)
+            {
+              const auto now = std::chrono::steady_clock::now();
+              tracer->record("respond", progress->started ? progress->firstByte : now, now);
+              tracer->record("request", arrived, now);
+              try
+              {
+                tracer->write_json(tracePath);
+              }
+              catch (const std::exception &e)
+              {
+                RamLog::getInstance().log(std::string("[ERROR] ") + e.what());
+              }
+            }
           }
           return true;
         });
@@ -666,5 +1347,373 @@ int main(void)
     message_buf << "==================== GOODBYE  ====================";
     message_print_log(message_buf); });
 
+  // ---- Asynchronous jobs ----
+  //
+  // POST /jobs takes the same X-SiPM-Params header and float64 body as /simspad
+  // (Content-Length required), spools the input to disk and answers 202 with
+  // the job id at once. GET /jobs/{id} reports status, progress and an ETA;
+  // GET /jobs/{id}/result streams the float64 result once done; DELETE
+  // /jobs/{id} cancels and deletes. All four are gated like /simspad.
+  srv.Post("/jobs", [&](const Request &req, Response &res, const ContentReader &content_reader)
+           {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    std::ostringstream message_buf;
+    auto reject = [&](int status, const std::string &why)
+    {
+      res.status = status;
+      res.set_content(why, "text/plain");
+      message_buf << "[ERROR] rejected job: " << html_escape(why); // may echo request headers
+      message_print_log(message_buf);
+    };
+
+    std::string paramJson = req.get_header_value("X-SiPM-Params");
+    if (paramJson.empty())
+    {
+      reject(400, "missing X-SiPM-Params header (JSON device parameters)");
+      return;
+    }
+    if (!req.has_header("Content-Length"))
+    {
+      reject(411, "POST /jobs requires a Content-Length");
+      return;
+    }
+    size_t bytes = (size_t)std::strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+    if (bytes % sizeof(double) != 0)
+    {
+      reject(400, "body length " + std::to_string(bytes) + " is not a multiple of 8 (expect a float64 waveform)");
+      return;
+    }
+    size_t N = bytes / sizeof(double);
+
+    std::shared_ptr<Job> job;
+    try
+    {
+      double seedMean = -1.0;
+      std::vector<double> svars = parse_request_params(paramJson, &seedMean);
+      SiPM sipm(svars); // validate before spooling anything
+      check_request_limits(sipm, N);
+      bool seeded = req.has_header("X-SiPM-Seed");
+      uint64_t seed = seeded ? parse_seed(req.get_header_value("X-SiPM-Seed")) : 0;
+      job = jobs.create(svars, seedMean, N);
+      job->seeded = seeded;
+      job->seed = seed;
+      job->client = client_id(req);
+    }
+    catch (const std::invalid_argument &e)
+    {
+      reject(400, std::string("invalid device parameters: ") + e.what());
+      return;
+    }
+    catch (const ServiceError &e)
+    {
+      reject(e.status, e.what());
+      return;
+    }
+
+    std::ofstream spool(job->inputPath, std::ios::binary);
+    size_t received = 0;
+    bool ok = spool && content_reader([&](const char *data, size_t len)
+    {
+      received += len;
+      if (received > bytes)
+      {
+        return false;
+      }
+      spool.write(data, (std::streamsize)len);
+      return (bool)spool;
+    });
+    spool.close();
+    if (!ok || received != bytes)
+    {
+      jobs.abandon(job);
+      reject(400, "failed to read the job input body");
+      return;
+    }
+    bytes_processed += (long)bytes;
+    jobs.start(job);
+
+    message_buf << "Queued job " << job->id << " (" << N << " samples)";
+    message_print_log(message_buf);
+    res.status = 202;
+    res.set_header("Location", "/jobs/" + job->id);
+    res.set_content(jobs.status_json(*job), "application/json"); });
+
+  srv.Get(R"(/jobs/([0-9a-f]{16}))", [&](const Request &req, Response &res)
+          {
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    auto job = jobs.find(req.matches[1]);
+    if (!job)
+    {
+      res.status = 404;
+      res.set_content("no such job", "text/plain");
+      return;
+    }
+    res.set_content(jobs.status_json(*job), "application/json"); });
+
+  srv.Get(R"(/jobs/([0-9a-f]{16})/result)", [&](const Request &req, Response &res)
+          {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    auto job = jobs.find(req.matches[1]);
+    if (!job)
+    {
+      res.status = 404;
+      res.set_content("no such job", "text/plain");
+      return;
+    }
+    if (job->status.load() != JobStatus::Done)
+    {
+      res.status = 409;
+      res.set_content(std::string("job is ") + job_status_name(job->status.load()), "text/plain");
+      return;
+    }
+    // Stream the spooled result straight from disk. The open handle keeps the
+    // data readable even if the job is deleted mid-transfer.
+    auto fin = std::make_shared<std::ifstream>(job->outputPath, std::ios::binary);
+    if (!*fin)
+    {
+      res.status = 410;
+      res.set_content("job result is no longer available", "text/plain");
+      return;
+    }
+    res.set_content_provider(
+        job->samples * sizeof(double), "application/octet-stream",
+        [fin](size_t offset, size_t length, httplib::DataSink &sink) -> bool
+        {
+          std::vector<char> buf(std::min(length, (size_t)(1u << 19)));
+          fin->seekg((std::streamoff)offset);
+          std::streamsize got = fin->read(buf.data(), (std::streamsize)buf.size()).gcount();
+          return got > 0 && sink.write(buf.data(), (size_t)got);
+        }); });
+
+  srv.Delete(R"(/jobs/([0-9a-f]{16}))", [&](const Request &req, Response &res)
+             {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    if (!jobs.remove(req.matches[1]))
+    {
+      res.status = 404;
+      res.set_content("no such job", "text/plain");
+      return;
+    }
+    res.set_content("deleted\n", "text/plain"); });
+
+  // ---- Batches ----
+  //
+  // POST /simspad/batch carries many framed waveforms (see batch.hpp), each
+  // with its own parameters or the shared X-SiPM-Params header, simulated in
+  // parallel on the compute pool; the reply frames the results in input order.
+  srv.Post("/simspad/batch", [&](const Request &req, Response &res)
+           {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    std::vector<BatchItem> items;
+    try
+    {
+      SimulationRequest base;
+      base.client = client_id(req);
+      base.deadline = request_deadline(req);
+      base.seeded = req.has_header("X-SiPM-Seed");
+      if (base.seeded)
+      {
+        base.seed = parse_seed(req.get_header_value("X-SiPM-Seed"));
+      }
+      items = parse_batch(req.body, req.get_header_value("X-SiPM-Params"), base);
+    }
+    catch (const ServiceError &e)
+    {
+      res.status = e.status;
+      res.set_content(e.what(), "text/plain");
+      return;
+    }
+    std::string framed = run_batch(core, computePool, items);
+    bytes_processed += (long long)req.body.size();
+
+    std::ostringstream message_buf;
+    message_buf << "[INFO]  batch of " << items.size() << " waveforms from " << client_id(req);
+    message_print_log(message_buf);
+    res.set_content(framed, "application/x-simspad-batch"); });
+
+  // ---- Persistent sessions ----
+  //
+  // POST /sessions takes an X-SiPM-Params header (and optional X-SiPM-Seed), no
+  // body, and answers 201 with the session id. Each POST /sessions/{id}/advance
+  // then pushes a float64 chunk through the session's SiPM, continuing from the
+  // microcell state the previous chunk left, and returns the response chunk (or
+  // its detection events, with X-SiPM-Output: events); X-SiPM-Step is the
+  // session sample index of its first sample. GET /sessions/{id} reports the
+  // session; DELETE /sessions/{id} ends it. Idle sessions are evicted.
+  srv.Post("/sessions", [&](const Request &req, Response &res)
+           {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    std::string paramJson = req.get_header_value("X-SiPM-Params");
+    if (paramJson.empty())
+    {
+      res.status = 400;
+      res.set_content("missing X-SiPM-Params header (JSON device parameters)", "text/plain");
+      return;
+    }
+    std::shared_ptr<Session> session;
+    try
+    {
+      double seedMean = -1.0;
+      std::vector<double> svars = parse_request_params(paramJson, &seedMean);
+      uint64_t seed = 0;
+      bool seeded = req.has_header("X-SiPM-Seed");
+      if (seeded)
+      {
+        seed = parse_seed(req.get_header_value("X-SiPM-Seed"));
+      }
+      // Seeding the ages at creation costs about one step of every microcell.
+      auto admit = [&](const SiPM &sipm)
+      {
+        check_request_limits(sipm, 1);
+        return scheduler.admit(client_id(req), sipm.numMicrocell, (uint64_t)sipm.numMicrocell * sizeof(double),
+                               request_deadline(req));
+      };
+      session = sessions.create(svars, seedMean, seeded ? &seed : nullptr, admit);
+    }
+    catch (const std::invalid_argument &e)
+    {
+      res.status = 400;
+      res.set_content(std::string("invalid device parameters: ") + e.what(), "text/plain");
+      return;
+    }
+    catch (const ServiceError &e)
+    {
+      if (e.retryAfter > 0)
+      {
+        res.set_header("Retry-After", std::to_string(e.retryAfter));
+      }
+      res.status = e.status;
+      res.set_content(e.what(), "text/plain");
+      return;
+    }
+    res.status = 201;
+    res.set_header("Location", "/sessions/" + session->id);
+    res.set_content(sessions.status_json(*session), "application/json"); });
+
+  srv.Post(R"(/sessions/([0-9a-f]{16})/advance)", [&](const Request &req, Response &res)
+           {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    auto session = sessions.find(req.matches[1]);
+    if (!session)
+    {
+      res.status = 404;
+      res.set_content("no such session", "text/plain");
+      return;
+    }
+    if (req.body.size() % sizeof(double) != 0)
+    {
+      res.status = 400;
+      res.set_content("body length is not a multiple of 8 (expect a float64 waveform)", "text/plain");
+      return;
+    }
+    size_t n = req.body.size() / sizeof(double);
+    std::shared_ptr<AdmissionScheduler::Ticket> ticket;
+    try
+    {
+      check_request_limits(*session->sipm, n);
+      ticket = scheduler.admit(client_id(req), (uint64_t)session->sipm->numMicrocell * n,
+                               (uint64_t)n * 2 * sizeof(double), request_deadline(req));
+    }
+    catch (const ServiceError &e)
+    {
+      if (e.retryAfter > 0)
+      {
+        res.set_header("Retry-After", std::to_string(e.retryAfter));
+      }
+      res.status = e.status;
+      res.set_content(e.what(), "text/plain");
+      return;
+    }
+
+    // The body need not be 8-byte aligned; copy it into a double buffer.
+    std::vector<double> in(n), out(n);
+    std::memcpy(in.data(), req.body.data(), n * sizeof(double));
+    const bool wantEvents = (req.get_header_value("X-SiPM-Output") == "events");
+    std::vector<DetectionEvent> events;
+    unsigned long long first = sessions.advance(*session, in.data(), out.data(), n, wantEvents ? &events : nullptr);
+    bytes_processed += (long)(n * sizeof(double));
+
+    res.set_header("X-SiPM-Step", std::to_string(first));
+    if (wantEvents)
+    {
+      std::string packed(events.size() * EVENT_RECORD_BYTES, '\0');
+      for (size_t i = 0; i < events.size(); i++)
+      {
+        pack_event(events[i], &packed[i * EVENT_RECORD_BYTES]);
+      }
+      res.set_content(packed, "application/x-simspad-events");
+    }
+    else
+    {
+      res.set_content(reinterpret_cast<const char *>(out.data()), n * sizeof(double), "application/octet-stream");
+    } });
+
+  srv.Get(R"(/sessions/([0-9a-f]{16}))", [&](const Request &req, Response &res)
+          {
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    auto session = sessions.find(req.matches[1]);
+    if (!session)
+    {
+      res.status = 404;
+      res.set_content("no such session", "text/plain");
+      return;
+    }
+    res.set_content(sessions.status_json(*session), "application/json"); });
+
+  srv.Delete(R"(/sessions/([0-9a-f]{16}))", [&](const Request &req, Response &res)
+             {
+    log_access(req, res.status);
+    if (!state_change_authorised(req, res))
+    {
+      return;
+    }
+    if (!sessions.remove(req.matches[1]))
+    {
+      res.status = 404;
+      res.set_content("no such session", "text/plain");
+      return;
+    }
+    res.set_content("deleted\n", "text/plain"); });
+
   srv.listen("127.0.0.1", 33232);
+
+  if (unixServer)
+  {
+    unixServer->stop();
+  }
+
+  // Stop outstanding jobs and let the compute pool drain before the job
+  // manager it calls back into goes out of scope.
+  jobs.cancel_all();
+  computePool.shutdown();
 }
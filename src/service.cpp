@@ -0,0 +1,239 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include "service.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+vector<double> parse_request_params(const string &json, double *seedMean)
+{
+    static const char *keys[10] = {"dt", "numMicrocell", "vBias", "vBr", "tauRecovery",
+                                   "pdeMax", "vChr", "cCell", "tauFwhm", "digitalThreshold"};
+    map<string, double> pm = parse_flat_json(json);
+    vector<double> svars(10);
+    for (int i = 0; i < 10; i++)
+    {
+        auto kv = pm.find(keys[i]);
+        if (kv == pm.end())
+        {
+            throw ServiceError(400, string("X-SiPM-Params missing key: ") + keys[i]);
+        }
+        svars[i] = kv->second;
+    }
+    auto mean = pm.find("meanPhotonsPerDt");
+    *seedMean = (mean != pm.end() && mean->second >= 0.0) ? mean->second : -1.0;
+    return svars;
+}
+
+uint64_t parse_seed(const string &text)
+{
+    uint64_t seed = 0;
+    bool ok = !text.empty() && text.size() <= 20;
+    for (char c : text)
+    {
+        if (c < '0' || c > '9' || seed > (UINT64_MAX - (uint64_t)(c - '0')) / 10)
+        {
+            ok = false;
+            break;
+        }
+        seed = seed * 10 + (uint64_t)(c - '0');
+    }
+    if (!ok)
+    {
+        throw ServiceError(400, "X-SiPM-Seed must be an unsigned 64-bit decimal integer");
+    }
+    return seed;
+}
+
+string random_id()
+{
+    static mutex idMutex;
+    static mt19937_64 engine(random_device{}());
+    lock_guard<mutex> lock(idMutex);
+    ostringstream o;
+    o << hex << setw(16) << setfill('0') << engine();
+    return o.str();
+}
+
+void check_request_limits(const SiPM &sipm, size_t N)
+{
+    if (N > MAX_SAMPLES)
+    {
+        throw ServiceError(413, "input waveform too long (max " + to_string(MAX_SAMPLES) + " samples)");
+    }
+    // numMicrocell is already capped to MAX_MICROCELL, so this only rejects
+    // pathological numMicrocell*N combinations (e.g. a tiny body with a huge
+    // cell count) without affecting realistic simulations.
+    if ((uint64_t)sipm.numMicrocell * (uint64_t)N > MAX_WORK)
+    {
+        throw ServiceError(413, "simulation too large (numMicrocell * samples exceeds the per-request budget)");
+    }
+}
+
+double input_mean(const double *in, size_t n)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += in[i];
+    }
+    return n ? sum / (double)n : 0.0;
+}
+
+StreamingSimulation::StreamingSimulation(shared_ptr<SiPM> sipm_in, double seedMean_in, size_t expectedSamples,
+                                         Init init_in, Step step_in)
+    : sipm(std::move(sipm_in)), init(std::move(init_in)), step(std::move(step_in)), seedMean(seedMean_in),
+      expected(expectedSamples)
+{
+    inBuf.resize(PREFIX_SAMPLES);
+    outBuf.resize(PREFIX_SAMPLES);
+    if (seedMean < 0.0)
+    {
+        prefix.reserve(PREFIX_SAMPLES);
+    }
+}
+
+// Seed the microcell ages and simulate the held-back prefix.
+void StreamingSimulation::start(const Emit &emit)
+{
+    double mean = seedMean;
+    if (mean < 0.0)
+    {
+        mean = input_mean(prefix.data(), prefix.size());
+    }
+    unsigned long nSteps = (unsigned long)(expected ? expected : prefix.size());
+    if (init)
+    {
+        init(*sipm, mean, nSteps);
+    }
+    else
+    {
+        sipm->init_state(mean, nSteps);
+    }
+    started = true;
+    if (!prefix.empty())
+    {
+        run(prefix.data(), prefix.size(), emit);
+        prefix.clear();
+        prefix.shrink_to_fit();
+    }
+}
+
+void StreamingSimulation::run(const double *in, size_t n, const Emit &emit)
+{
+    while (n > 0)
+    {
+        size_t m = n < outBuf.size() ? n : outBuf.size();
+        if (step)
+        {
+            step(in, outBuf.data(), m);
+        }
+        else
+        {
+            sipm->simulate_chunk(in, outBuf.data(), m);
+        }
+        emit(outBuf.data(), m);
+        in += m;
+        n -= m;
+    }
+}
+
+void StreamingSimulation::feed(const char *data, size_t len, const Emit &emit)
+{
+    while (len > 0)
+    {
+        // Reassemble whole samples into the (aligned) input buffer, carrying a
+        // sample split across two reads in `partial`.
+        size_t n = 0;
+        if (nPartial > 0)
+        {
+            size_t take = sizeof(double) - nPartial < len ? sizeof(double) - nPartial : len;
+            memcpy(partial + nPartial, data, take);
+            nPartial += take;
+            data += take;
+            len -= take;
+            if (nPartial < sizeof(double))
+            {
+                return;
+            }
+            memcpy(&inBuf[0], partial, sizeof(double));
+            nPartial = 0;
+            n = 1;
+        }
+        size_t whole = len / sizeof(double);
+        if (whole > inBuf.size() - n)
+        {
+            whole = inBuf.size() - n;
+        }
+        memcpy(&inBuf[n], data, whole * sizeof(double));
+        data += whole * sizeof(double);
+        len -= whole * sizeof(double);
+        n += whole;
+        if (len > 0 && len < sizeof(double))
+        {
+            memcpy(partial, data, len);
+            nPartial = len;
+            len = 0;
+        }
+        nSamples += n;
+
+        if (!started)
+        {
+            size_t room = PREFIX_SAMPLES - prefix.size();
+            size_t keep = n < room ? n : room;
+            if (seedMean < 0.0)
+            {
+                prefix.insert(prefix.end(), inBuf.begin(), inBuf.begin() + keep);
+            }
+            else
+            {
+                keep = 0;
+            }
+            if (seedMean >= 0.0 || prefix.size() == PREFIX_SAMPLES)
+            {
+                start(emit);
+            }
+            if (started && keep < n)
+            {
+                run(inBuf.data() + keep, n - keep, emit);
+            }
+        }
+        else
+        {
+            run(inBuf.data(), n, emit);
+        }
+    }
+}
+
+void StreamingSimulation::finish(const Emit &emit)
+{
+    if (nPartial != 0)
+    {
+        throw ServiceError(400, "body length is not a multiple of 8 (expect a float64 waveform)");
+    }
+    if (!started && nSamples > 0)
+    {
+        start(emit);
+    }
+}
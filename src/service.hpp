@@ -0,0 +1,123 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include "sipm.hpp"
+
+// Transport-independent core of the simulation server: request limits,
+// parameter parsing and the incremental streaming driver. Kept free of
+// cpp-httplib so every front end (HTTP today) shares the same rules.
+
+// Per-request DoS caps. Simulation cost is O(N * numMicrocell), both taken from the
+// unauthenticated request; numMicrocell is bounded by MAX_MICROCELL in the SiPM
+// constructor, and these bound the waveform length and the total work product so a
+// crafted request cannot exhaust CPU/RAM (GHSA-f2ph-wv99-c83q). Tune to taste; the
+// canonical 5676-cell device at MAX_SAMPLES (~9.1e10) stays under MAX_WORK, so realistic
+// runs are unaffected and only pathological numMicrocell*N combinations are rejected.
+constexpr std::size_t MAX_SAMPLES = 16000000UL;     // ~122 MB of float64 input
+constexpr std::uint64_t MAX_WORK = 100000000000ULL; // 1e11 microcell-steps per request
+
+// A request the core refuses, carrying the HTTP status a front end should answer with
+// and, for overload refusals, the seconds after which a retry is worthwhile.
+class ServiceError : public std::runtime_error
+{
+public:
+    ServiceError(int status_in, const std::string &what, int retryAfter_in = 0)
+        : std::runtime_error(what), status(status_in), retryAfter(retryAfter_in) {}
+    int status;
+    int retryAfter;
+};
+
+// Parse the flat-JSON device parameters of a request into the SiPM parameter
+// vector (dump_configuration() order). Throws ServiceError(400) on a missing
+// key. If the object also carries "meanPhotonsPerDt", it is stored in
+// *seedMean (otherwise *seedMean is set to -1: derive it from the input).
+std::vector<double> parse_request_params(const std::string &json, double *seedMean);
+
+// Parse an X-SiPM-Seed value: a decimal unsigned 64-bit integer. Throws
+// ServiceError(400) on anything else.
+std::uint64_t parse_seed(const std::string &text);
+
+// 64 random bits as 16 hex digits: unguessable enough that a job or session
+// id acts as a capability for it.
+std::string random_id();
+
+// Reject a waveform of N samples on `sipm` that exceeds MAX_SAMPLES or
+// MAX_WORK (ServiceError 413).
+void check_request_limits(const SiPM &sipm, std::size_t N);
+
+// Mean of the n samples at `in` (0 when n is 0): the photons/dt that seeds the
+// microcell ages of a whole waveform, as the command line tool does.
+double input_mean(const double *in, std::size_t n);
+
+// Incremental driver for one streaming simulation fed with raw little-endian
+// float64 bytes as they arrive (e.g. HTTP body chunks), in arbitrary splits.
+// The initial microcell ages are seeded from `seedMean` photons/dt when it is
+// >= 0, else from the mean of the first PREFIX_SAMPLES samples, which are held
+// back until then. That fallback is only for input of unbounded length (e.g.
+// framed Unix-socket streams); callers holding the whole waveform pass its
+// input_mean() instead. Output samples are handed to `emit` as they are produced.
+// The ages are set by `init` if given (e.g. from a cached age distribution,
+// or not at all for an already-initialised SiPM), else by SiPM::init_state().
+class StreamingSimulation
+{
+public:
+    using Emit = std::function<void(const double *out, std::size_t n)>;
+    using Init = std::function<void(SiPM &sipm, double meanPhotonsPerDt, unsigned long nSteps)>;
+    using Step = std::function<void(const double *in, double *out, std::size_t n)>;
+
+    static constexpr std::size_t PREFIX_SAMPLES = 1u << 16;
+
+    // `init` and `step` replace sipm->init_state() / simulate_chunk() when set.
+    StreamingSimulation(std::shared_ptr<SiPM> sipm, double seedMean, std::size_t expectedSamples,
+                        Init init = nullptr, Step step = nullptr);
+
+    void feed(const char *data, std::size_t len, const Emit &emit);
+
+    // Flush a still-buffered prefix. Throws ServiceError(400) if the input
+    // ended part-way through a sample.
+    void finish(const Emit &emit);
+
+    std::size_t samples() const { return nSamples; }
+
+private:
+    std::shared_ptr<SiPM> sipm;
+    Init init;
+    Step step;
+    double seedMean;
+    std::size_t expected;
+    std::size_t nSamples = 0;
+    bool started = false;
+    char partial[sizeof(double)];
+    std::size_t nPartial = 0;
+    std::vector<double> prefix;
+    std::vector<double> inBuf, outBuf;
+
+    void start(const Emit &emit);
+    void run(const double *in, std::size_t n, const Emit &emit);
+};
+
+#endif // SERVICE_H
@@ -0,0 +1,199 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include "sessions.hpp"
+#include "service.hpp"
+
+using namespace std;
+
+static int64_t now_ticks()
+{
+    return (int64_t)chrono::steady_clock::now().time_since_epoch().count();
+}
+
+SessionManager::SessionManager(uint64_t maxBytes, chrono::seconds idleTimeout, DeviceCache *devices)
+    : maxBytes_(maxBytes), idleTimeout_(idleTimeout), devices_(devices)
+{
+}
+
+shared_ptr<Session> SessionManager::create(const vector<double> &svars, double seedMean, const uint64_t *seed,
+                                           const Admit &admit)
+{
+    // Reserve the state budget before anything is allocated. Parameters the
+    // SiPM will reject are charged one cell until it does.
+    double cells = (svars.size() > 1 && svars[1] >= 1.0 && svars[1] <= (double)MAX_MICROCELL) ? svars[1] : 1.0;
+    const uint64_t bytes = (uint64_t)cells * sizeof(double) + sizeof(SiPM);
+    {
+        lock_guard<mutex> lock(mutex_);
+        evict_idle();
+        if (usedBytes_ + bytes > maxBytes_)
+        {
+            throw ServiceError(507, "session memory is full (" + to_string(usedBytes_) + " of " +
+                                        to_string(maxBytes_) + " bytes in use)");
+        }
+        usedBytes_ += bytes;
+    }
+
+    auto session = make_shared<Session>();
+    session->bytes = bytes;
+    try
+    {
+        session->sipm = devices_ ? devices_->device(svars) : make_shared<SiPM>(svars);
+        session->seedMean = seedMean;
+        if (seed)
+        {
+            session->sipm->seed(*seed);
+        }
+        // With a known flux, initialise now so the first advance starts at once.
+        if (seedMean > 0.0)
+        {
+            shared_ptr<AdmissionScheduler::Ticket> ticket;
+            if (admit)
+            {
+                ticket = admit(*session->sipm);
+            }
+            if (devices_)
+            {
+                devices_->init_state(*session->sipm, seedMean, 1);
+            }
+            else
+            {
+                session->sipm->init_state(seedMean, 1);
+            }
+            session->initialised = true;
+        }
+    }
+    catch (...)
+    {
+        lock_guard<mutex> lock(mutex_);
+        usedBytes_ -= bytes;
+        throw;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    created_++;
+    session->id = random_id();
+    session->lastUsed = now_ticks();
+    sessions_[session->id] = session;
+    return session;
+}
+
+shared_ptr<Session> SessionManager::find(const string &id)
+{
+    lock_guard<mutex> lock(mutex_);
+    evict_idle();
+    auto it = sessions_.find(id);
+    if (it == sessions_.end())
+    {
+        return nullptr;
+    }
+    it->second->lastUsed = now_ticks();
+    return it->second;
+}
+
+bool SessionManager::remove(const string &id)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = sessions_.find(id);
+    if (it == sessions_.end())
+    {
+        return false;
+    }
+    usedBytes_ -= it->second->bytes;
+    sessions_.erase(it);
+    return true;
+}
+
+unsigned long long SessionManager::advance(Session &session, const double *in, double *out, size_t n,
+                                           vector<DetectionEvent> *events)
+{
+    // Marks the session busy, so it is not evicted mid-advance however long it takes.
+    struct Busy
+    {
+        Session &s;
+        explicit Busy(Session &s_in) : s(s_in) { s.active++; }
+        ~Busy()
+        {
+            s.lastUsed = now_ticks();
+            s.active--;
+        }
+    } busy(session);
+
+    lock_guard<mutex> lock(session.mutex);
+    if (!session.initialised && n > 0)
+    {
+        // No flux given at creation: seed the ages from this first chunk.
+        double sum = 0.0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += in[i];
+        }
+        if (devices_)
+        {
+            devices_->init_state(*session.sipm, sum / (double)n, (unsigned long)n);
+        }
+        else
+        {
+            session.sipm->init_state(sum / (double)n, (unsigned long)n);
+        }
+        session.initialised = true;
+    }
+    unsigned long long first = session.samples;
+    session.sipm->set_event_sink(events);
+    session.sipm->simulate_chunk(in, out, n);
+    session.sipm->set_event_sink(nullptr);
+    session.samples += n;
+    return first;
+}
+
+string SessionManager::status_json(Session &session)
+{
+    lock_guard<mutex> lock(session.mutex);
+    double idle = chrono::duration<double>(chrono::steady_clock::duration(now_ticks() - session.lastUsed.load())).count();
+    ostringstream o;
+    o << "{\"id\": \"" << session.id << "\", \"numMicrocell\": " << session.sipm->numMicrocell
+      << ", \"samples\": " << session.samples << ", \"detections\": " << session.sipm->detection_count()
+      << ", \"idleSeconds\": " << idle << ", \"idleTimeoutSeconds\": " << idleTimeout_.count() << "}";
+    return o.str();
+}
+
+void SessionManager::evict_idle()
+{
+    const int64_t cutoff = now_ticks() - (int64_t)chrono::duration_cast<chrono::steady_clock::duration>(idleTimeout_).count();
+    for (auto it = sessions_.begin(); it != sessions_.end();)
+    {
+        Session &s = *it->second;
+        if (s.active == 0 && s.lastUsed < cutoff)
+        {
+            usedBytes_ -= s.bytes;
+            evicted_++;
+            it = sessions_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+SessionManager::Stats SessionManager::stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    evict_idle();
+    return Stats{sessions_.size(), usedBytes_, created_, evicted_};
+}
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "sipm.hpp"
+#include "devicecache.hpp"
+#include "scheduler.hpp"
+
+// A server-held SiPM whose microcell state persists between calls, for
+// closed-loop use: each advance continues from where the last one stopped.
+struct Session
+{
+    std::string id;
+    std::shared_ptr<SiPM> sipm;
+    double seedMean;          // photons/dt seeding the ages, or <= 0 for the first chunk's mean
+    std::uint64_t bytes;      // charged against the manager's budget
+    std::mutex mutex;         // serialises advances; guards the fields below
+    bool initialised = false;
+    unsigned long long samples = 0; // samples advanced so far
+
+    std::atomic<int> active{0}; // advances in progress (never evicted meanwhile)
+    std::atomic<std::int64_t> lastUsed{0}; // steady_clock ticks of the last call
+};
+
+// Owns the sessions behind the server's /sessions API. Sessions idle for
+// longer than `idleTimeout` are evicted, and the microcell state of all live
+// sessions is bounded to `maxBytes`.
+class SessionManager
+{
+public:
+    SessionManager(std::uint64_t maxBytes, std::chrono::seconds idleTimeout, DeviceCache *devices = nullptr);
+
+    // Admission for the initialisation done at creation (given a flux): called
+    // with the new device, it returns the ticket held while the state is
+    // seeded, or throws to refuse.
+    typedef std::function<std::shared_ptr<AdmissionScheduler::Ticket>(const SiPM &)> Admit;
+
+    // Create a session for `svars`; `seed` (if non-null) makes it reproducible.
+    // The state budget is reserved before the device is built. Throws
+    // std::invalid_argument for bad parameters, ServiceError(507) when the
+    // state budget is exhausted, and whatever `admit` throws.
+    std::shared_ptr<Session> create(const std::vector<double> &svars, double seedMean, const std::uint64_t *seed,
+                                    const Admit &admit = nullptr);
+
+    std::shared_ptr<Session> find(const std::string &id);
+
+    bool remove(const std::string &id);
+
+    // Push `n` samples through the session, writing `out[0..n)`, and return
+    // the sample index of in[0] within the session. Detection events are
+    // appended to `events` if given.
+    unsigned long long advance(Session &session, const double *in, double *out, std::size_t n,
+                               std::vector<DetectionEvent> *events);
+
+    std::string status_json(Session &session);
+
+    struct Stats
+    {
+        std::size_t sessions;
+        std::uint64_t bytes;
+        unsigned long long created, evicted;
+    };
+    Stats stats();
+
+    SessionManager(SessionManager const &) = delete;
+    void operator=(SessionManager const &) = delete;
+
+private:
+    std::uint64_t maxBytes_;
+    std::chrono::seconds idleTimeout_;
+    DeviceCache *devices_;
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Session>> sessions_;
+    std::uint64_t usedBytes_ = 0;
+    unsigned long long created_ = 0, evicted_ = 0;
+
+    void evict_idle(); // mutex_ must be held
+};
+
+#endif // SESSIONS_H
@@ -0,0 +1,320 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdexcept>
+#include "simcore.hpp"
+
+using namespace std;
+
+ServiceMetrics::ServiceMetrics(MetricsRegistry &r) : registry(r)
+{
+    const vector<double> seconds = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+                                    0.25,   0.5,   1,      2.5,   5,    10,    30,   60};
+    queueWait = r.histogram("simspad_queue_wait_seconds", "Time simulations waited for admission.", seconds);
+    setup = r.histogram("simspad_setup_seconds", "Time spent seeding microcell states (init_state) per simulation.",
+                        seconds);
+    simulate = r.histogram("simspad_simulate_seconds", "Time spent simulating per simulation.", seconds);
+    firstByte = r.histogram("simspad_time_to_first_byte_seconds",
+                            "Time from a simulation request to the first byte of its response.", seconds);
+    latency = r.histogram("simspad_request_duration_seconds",
+                          "Time from a simulation request to the end of its response.", seconds);
+    stepCost = r.histogram("simspad_step_cost_nanoseconds", "Simulate time per microcell-step, per simulation.",
+                           {0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100});
+    steps = r.counter("simspad_microcell_steps_total", "Microcell-steps simulated.");
+    samplesIn = r.counter("simspad_samples_in_total", "Input samples simulated.");
+    samplesOut = r.counter("simspad_samples_out_total", "Output samples produced.");
+    if (SiPM::ENGINE_STATS)
+    {
+        photons = r.counter("simspad_engine_photons_total", "Photons drawn by the engine.");
+        alreadyFired = r.counter("simspad_engine_already_fired_total",
+                                 "Photons striking a microcell that had fired in the same step.");
+        pdeRejected = r.counter("simspad_engine_pde_rejections_total", "Photons failing the PDE test.");
+        subThreshold = r.counter("simspad_engine_subthreshold_firings_total",
+                                 "Microcell firings below the digital threshold.");
+        detections = r.counter("simspad_engine_detections_total", "Microcell firings adding charge to the output.");
+        lutSaturated = r.counter("simspad_engine_lut_saturated_total",
+                                 "Strikes on microcells older than the lookup tables' time range.");
+    }
+}
+
+double ServiceMetrics::since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+unique_ptr<SimulationRun> SimulationCore::prepare(const SimulationRequest &req)
+{
+    // Invalid/out-of-range parameters throw from the SiPM constructor (length,
+    // finiteness, numMicrocell range) and become a clean 400.
+    const bool warm = !req.seeded && req.seedMean > 0.0;
+    shared_ptr<SiPM> sipm;
+    try
+    {
+        sipm = warm ? devices_.warm_device(req.svars, req.seedMean) : devices_.device(req.svars);
+    }
+    catch (const invalid_argument &e)
+    {
+        throw ServiceError(400, string("invalid device parameters: ") + e.what());
+    }
+    if (req.seeded)
+    {
+        sipm->seed(req.seed);
+    }
+    // Bound per-request work before reading or simulating (GHSA-f2ph-wv99-c83q).
+    check_request_limits(*sipm, req.samples);
+    return unique_ptr<SimulationRun>(new SimulationRun(req, sipm, warm, scheduler_, devices_, cores_, metrics_));
+}
+
+SimulationRun::~SimulationRun()
+{
+    sipm->set_event_sink(nullptr);
+}
+
+void SimulationRun::cost(uint64_t &work, uint64_t &bytes) const
+{
+    // Undeclared lengths are charged at the maximum; the memory estimate
+    // covers the microcell state, the held-back prefix and the output (the
+    // latter two stay with the client when run in place).
+    uint64_t chargedN = req.samples ? req.samples : MAX_SAMPLES;
+    uint64_t buffered = req.inPlace ? 0 : StreamingSimulation::PREFIX_SAMPLES + chargedN;
+    work = (uint64_t)sipm->numMicrocell * chargedN;
+    bytes = (sipm->numMicrocell + buffered) * sizeof(double);
+}
+
+void SimulationRun::admit()
+{
+    uint64_t work, bytes;
+    cost(work, bytes);
+    auto start = chrono::steady_clock::now();
+    TraceSpan span(tracer_.get(), "queue wait");
+    ticket_ = scheduler.admit(req.client, work, bytes, req.deadline);
+    if (metrics)
+    {
+        metrics->registry.observe(metrics->queueWait, ServiceMetrics::since(start));
+    }
+    setup();
+}
+
+void SimulationRun::admit_async(function<void()> granted)
+{
+    uint64_t work, bytes;
+    cost(work, bytes);
+    auto start = chrono::steady_clock::now();
+    scheduler.admit_async(req.client, work, bytes,
+                          [this, start, granted](shared_ptr<AdmissionScheduler::Ticket> ticket)
+                          {
+                              ticket_ = std::move(ticket);
+                              if (metrics)
+                              {
+                                  metrics->registry.observe(metrics->queueWait, ServiceMetrics::since(start));
+                              }
+                              granted();
+                          });
+}
+
+void SimulationRun::join(shared_ptr<AdmissionScheduler::Ticket> ticket)
+{
+    ticket_ = std::move(ticket);
+    joined = true;
+    setup();
+}
+
+void SimulationRun::setup()
+{
+    configured = true;
+    // Only the run's own core is admitted; helpers come from whatever the
+    // other running requests leave idle, and none while others queue.
+    if (cores && !joined && !req.seeded && req.samples)
+    {
+        AdmissionScheduler::Stats load = scheduler.stats();
+        auto lease = cores->lease((uint64_t)sipm->numMicrocell * req.samples, load.running, load.queued);
+        if (lease)
+        {
+            engine = make_unique<ParallelEngine>(*sipm, std::move(lease));
+            engine->set_tracer(tracer_.get());
+        }
+    }
+    if (engine)
+    {
+        init = [this](SiPM &, double mean, unsigned long nSteps)
+        { engine->init_state(mean, nSteps); };
+        step = [this](const double *in, double *out, size_t n)
+        { engine->simulate_chunk(in, out, n); };
+        if (req.events)
+        {
+            engine->set_event_sink(&events);
+        }
+        return;
+    }
+    if (warm)
+    {
+        init = [](SiPM &, double, unsigned long) {}; // already initialised
+    }
+    else if (req.seedMean >= 0.0)
+    {
+        init = [this](SiPM &s, double mean, unsigned long nSteps)
+        { devices.init_state(s, mean, nSteps); };
+    }
+    if (req.events)
+    {
+        sipm->set_event_sink(&events);
+    }
+}
+
+StreamingSimulation &SimulationRun::stream()
+{
+    if (!sim)
+    {
+        // Timed wrappers around the device work, for the metrics.
+        auto timedInit = [this](SiPM &s, double mean, unsigned long nSteps)
+        {
+            ticket_->begin(); // the prefix has arrived; compute starts here
+            auto start = chrono::steady_clock::now();
+            TraceSpan span(tracer_.get(), "init_state");
+            if (init)
+            {
+                init(s, mean, nSteps);
+            }
+            else
+            {
+                s.init_state(mean, nSteps);
+            }
+            setupSeconds += ServiceMetrics::since(start);
+        };
+        auto timedStep = [this](const double *in, double *out, size_t n)
+        {
+            auto start = chrono::steady_clock::now();
+            TraceSpan span(tracer_.get(), "simulate", chunks++);
+            if (step)
+            {
+                step(in, out, n);
+            }
+            else
+            {
+                sipm->simulate_chunk(in, out, n);
+            }
+            simulateSeconds += ServiceMetrics::since(start);
+        };
+        sim = make_unique<StreamingSimulation>(sipm, req.seedMean, req.samples, timedInit, timedStep);
+    }
+    return *sim;
+}
+
+void SimulationRun::feed(const char *data, size_t len, const Sink &sink)
+{
+    check_request_limits(*sipm, stream().samples() + len / sizeof(double));
+    sim->feed(data, len, [&](const double *out, size_t n)
+              {
+                  emitted += n;
+                  sink(out, n, events);
+              });
+}
+
+void SimulationRun::finish(const Sink &sink)
+{
+    stream().finish([&](const double *out, size_t n)
+                    {
+                        emitted += n;
+                        sink(out, n, events);
+                    });
+    sipm->set_event_sink(nullptr);
+    if (engine)
+    {
+        engine->release();
+    }
+    ticket_->release_cpu();
+    record();
+}
+
+void SimulationRun::record()
+{
+    if (!metrics)
+    {
+        return;
+    }
+    MetricsRegistry &r = metrics->registry;
+    const uint64_t n = samples(), work = (uint64_t)sipm->numMicrocell * n;
+    r.observe(metrics->setup, setupSeconds);
+    r.observe(metrics->simulate, simulateSeconds);
+    r.add(metrics->steps, work);
+    r.add(metrics->samplesIn, n);
+    r.add(metrics->samplesOut, emitted);
+    if (work > 0)
+    {
+        r.observe(metrics->stepCost, simulateSeconds * 1e9 / (double)work);
+    }
+    if (SiPM::ENGINE_STATS)
+    {
+        EngineStats st = engine_stats();
+        r.add(metrics->photons, st.photons);
+        r.add(metrics->alreadyFired, st.alreadyFired);
+        r.add(metrics->pdeRejected, st.pdeRejected);
+        r.add(metrics->subThreshold, st.subThreshold);
+        r.add(metrics->detections, st.detections);
+        r.add(metrics->lutSaturated, st.lutSaturated);
+    }
+}
+
+void SimulationRun::simulate(const double *in, double *out, size_t n)
+{
+    check_request_limits(*sipm, n);
+    if (!configured)
+    {
+        setup(); // admitted by admit_async(): set up on the simulating thread
+    }
+    if (!joined)
+    {
+        ticket_->begin(); // a shared ticket is started by its batch
+    }
+    // Seed from the given mean, or else from the mean of the whole input.
+    double mean = req.seedMean >= 0.0 ? req.seedMean : input_mean(in, n);
+    // Derived fluxes go through the device cache too: short runs (batches)
+    // repeat them, and computing the age distribution dominates their cost.
+    auto start = chrono::steady_clock::now();
+    {
+        TraceSpan span(tracer_.get(), "init_state");
+        if (init)
+        {
+            init(*sipm, mean, (unsigned long)n);
+        }
+        else
+        {
+            devices.init_state(*sipm, mean, (unsigned long)n);
+        }
+    }
+    setupSeconds = ServiceMetrics::since(start);
+    start = chrono::steady_clock::now();
+    {
+        TraceSpan span(tracer_.get(), "simulate", 0);
+        if (engine)
+        {
+            engine->simulate_chunk(in, out, n);
+            engine->release();
+        }
+        else
+        {
+            sipm->simulate_chunk(in, out, n);
+        }
+    }
+    simulateSeconds = ServiceMetrics::since(start);
+    simulated = emitted = n;
+    if (!joined)
+    {
+        ticket_->release_cpu();
+    }
+    record();
+}
@@ -0,0 +1,186 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMCORE_H
+#define SIMCORE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "sipm.hpp"
+#include "service.hpp"
+#include "scheduler.hpp"
+#include "devicecache.hpp"
+#include "cores.hpp"
+#include "parallel.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+// One simulation request, whichever transport it arrived on.
+struct SimulationRequest
+{
+    std::vector<double> svars; // dump_configuration() order
+    double seedMean = -1.0;    // photons/dt seeding the ages, or < 0 to take it from the input
+    bool seeded = false;       // reproducible run from `seed`
+    std::uint64_t seed = 0;
+    std::size_t samples = 0; // declared input length, 0 if unknown
+    bool events = false;     // also collect detection events
+    bool inPlace = false;    // waveform in client memory, run by simulate()
+    std::string client;      // fair-queueing identity
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+// Request timings and work in the server's metrics registry. Runs record
+// queue wait, setup, simulate time and work; transports record time to first
+// byte and total latency, which depend on how they reply.
+struct ServiceMetrics
+{
+    explicit ServiceMetrics(MetricsRegistry &registry);
+
+    MetricsRegistry &registry;
+    MetricsRegistry::Id queueWait, setup, simulate, firstByte, latency, stepCost;
+    MetricsRegistry::Id steps, samplesIn, samplesOut;
+    // Engine counters (see EngineStats), when compiled in.
+    MetricsRegistry::Id photons = 0, alreadyFired = 0, pdeRejected = 0, subThreshold = 0, detections = 0, lutSaturated = 0;
+
+    static double since(std::chrono::steady_clock::time_point start);
+};
+
+// A prepared simulation: device built and limits checked, waiting to be
+// admitted and fed. Input is raw little-endian float64 in arbitrary splits;
+// output blocks go to a Sink as they are produced.
+class SimulationRun
+{
+public:
+    // n dense output samples, plus (events mode) the detections among them,
+    // which the sink should consume and clear.
+    using Sink = std::function<void(const double *out, std::size_t n, std::vector<DetectionEvent> &events)>;
+
+    ~SimulationRun();
+
+    // Set the input length once known (before admit()).
+    void declare(std::size_t samples) { req.samples = samples; }
+
+    // Seed the ages from `mean` photons/dt rather than the streamed prefix,
+    // e.g. the input_mean() of a body received in full (before admit()).
+    void seed_from(double mean) { req.seedMean = mean; }
+
+    // Record the run's stages (queue wait, init_state, each simulated chunk,
+    // per-shard work) as spans; set before admit() or join().
+    void set_tracer(std::shared_ptr<Tracer> tracer) { tracer_ = std::move(tracer); }
+    Tracer *tracer() const { return tracer_.get(); }
+
+    // Wait for admission. Throws ServiceError 429 (with retryAfter) or 503.
+    void admit();
+
+    // Instead of admit(): queue for admission without blocking or refusal, for
+    // work already accepted (batch items); `deadline` is not enforced.
+    // `granted` runs once the run is admitted, possibly on another request's
+    // thread, so it should only hand the run to a worker that calls simulate().
+    void admit_async(std::function<void()> granted);
+
+    // Instead of admit(): run under an admission granted to a whole
+    // micro-batch, whose owner releases its CPU share.
+    void join(std::shared_ptr<AdmissionScheduler::Ticket> ticket);
+
+    // Throws ServiceError 413 once the input outgrows the request limits.
+    void feed(const char *data, std::size_t len, const Sink &sink);
+
+    // End of input: flush held-back samples and release the CPU budget.
+    // Throws ServiceError(400) if the input stopped part-way through a sample.
+    void finish(const Sink &sink);
+
+    // Whole-input path (shared memory, batches): simulate `in` straight into
+    // `out`, without the streaming buffers, then release the CPU budget (a
+    // joined run leaves that to its batch). Without a seeding mean the ages
+    // are seeded from the mean of all of `in`. Throws ServiceError 413.
+    void simulate(const double *in, double *out, std::size_t n);
+
+    std::size_t samples() const { return sim ? sim->samples() : simulated; }
+    SiPM &device() { return *sipm; }
+    unsigned long long detections() const { return engine ? engine->detection_count() : sipm->detection_count(); }
+    std::size_t shards() const { return engine ? engine->shards() : 1; }
+    EngineStats engine_stats() const { return engine ? engine->engine_stats() : sipm->engine_stats(); }
+    const SimulationRequest &request() const { return req; }
+
+    // The admission ticket, holding the request's memory budget; keep it
+    // alive until the reply has been sent.
+    std::shared_ptr<AdmissionScheduler::Ticket> ticket() const { return ticket_; }
+
+private:
+    friend class SimulationCore;
+    SimulationRun(SimulationRequest r, std::shared_ptr<SiPM> s, bool w, AdmissionScheduler &a, DeviceCache &d,
+                  CoreScheduler *c, ServiceMetrics *m)
+        : req(std::move(r)), sipm(std::move(s)), warm(w), scheduler(a), devices(d), cores(c), metrics(m) {}
+
+    SimulationRequest req;
+    std::shared_ptr<SiPM> sipm;
+    bool warm;
+    AdmissionScheduler &scheduler;
+    DeviceCache &devices;
+    CoreScheduler *cores;
+    ServiceMetrics *metrics;
+    std::shared_ptr<AdmissionScheduler::Ticket> ticket_;
+    std::unique_ptr<ParallelEngine> engine; // set when helper cores were leased
+    StreamingSimulation::Init init;
+    StreamingSimulation::Step step;
+    std::unique_ptr<StreamingSimulation> sim;
+    std::size_t simulated = 0;
+    bool joined = false;
+    bool configured = false; // setup() has run
+    std::vector<DetectionEvent> events;
+    double setupSeconds = 0.0, simulateSeconds = 0.0;
+    std::size_t emitted = 0;
+    std::shared_ptr<Tracer> tracer_;
+    long long chunks = 0;
+
+    void cost(std::uint64_t &work, std::uint64_t &bytes) const;
+    void setup();
+    StreamingSimulation &stream();
+    void record();
+};
+
+// The simulation core behind every server transport: devices come from the
+// device cache (already initialised when the flux is known and the run is
+// unseeded) and every run is admitted by the scheduler. With a core
+// scheduler, large unseeded runs of known length are sharded across the
+// cores it can spare.
+class SimulationCore
+{
+public:
+    SimulationCore(AdmissionScheduler &scheduler, DeviceCache &devices, CoreScheduler *cores = nullptr,
+                   ServiceMetrics *metrics = nullptr)
+        : scheduler_(scheduler), devices_(devices), cores_(cores), metrics_(metrics) {}
+
+    // Build the device for `req` and check the declared length against the
+    // limits. Throws ServiceError 400 (bad parameters) or 413.
+    std::unique_ptr<SimulationRun> prepare(const SimulationRequest &req);
+
+    ServiceMetrics *metrics() const { return metrics_; }
+
+private:
+    AdmissionScheduler &scheduler_;
+    DeviceCache &devices_;
+    CoreScheduler *cores_;
+    ServiceMetrics *metrics_;
+};
+
+#endif // SIMCORE_H
@@ -0,0 +1,265 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "simd.hpp"
+
+using namespace std;
+
+// Each kernel body is written once, as plain loops for the auto-vectoriser,
+// and inlined into one wrapper per instruction set; a wrapper's target
+// attribute lets the compiler use that set's registers and instructions.
+#define SIMSPAD_INLINE static inline __attribute__((always_inline))
+
+SIMSPAD_INLINE ChunkSummary summarise_body(const double *x, size_t n)
+{
+    double sum = 0.0, lo = x[0], hi = x[0];
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += x[i];
+        lo = x[i] < lo ? x[i] : lo;
+        hi = x[i] > hi ? x[i] : hi;
+    }
+    return ChunkSummary{sum, lo, hi};
+}
+
+SIMSPAD_INLINE double peak_abs_body(const double *x, size_t n)
+{
+    double peak = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double a = fabs(x[i]);
+        peak = a > peak ? a : peak;
+    }
+    return peak;
+}
+
+SIMSPAD_INLINE void scale_body(const double *x, double a, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = a * x[i];
+    }
+}
+
+SIMSPAD_INLINE void accumulate_body(const double *x, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] += x[i];
+    }
+}
+
+SIMSPAD_INLINE void to_f32_body(const double *x, char *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float f = (float)x[i];
+        memcpy(out + i * sizeof(float), &f, sizeof(float));
+    }
+}
+
+SIMSPAD_INLINE void to_i16_body(const double *x, double scale, char *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        double q = nearbyint(x[i] / scale);
+        int16_t v = (int16_t)(q > 32767.0 ? 32767.0 : q < -32768.0 ? -32768.0 : q);
+        memcpy(out + i * sizeof(int16_t), &v, sizeof(int16_t));
+    }
+}
+
+SIMSPAD_INLINE void convolve_body(const double *x, size_t n, const double *k, size_t m, double *out)
+{
+    // Only the valid taps of each output, so the inner loop is branch-free.
+    const size_t half = m / 2;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t jlo = i < half ? half - i : 0;
+        size_t jhi = n + half - i < m ? n + half - i : m;
+        const double *xi = x + (i + jlo - half), *ki = k + jlo;
+        double acc = 0.0;
+        for (size_t j = 0; j < jhi - jlo; j++)
+        {
+            acc += ki[j] * xi[j];
+        }
+        out[i] = acc;
+    }
+}
+
+SIMSPAD_INLINE void exp_body(const ExpPolynomial &p, const double *x, double *out, size_t n)
+{
+    // In blocks, so each Horner step is one vector loop over the block.
+    const size_t block = 64;
+    double r[block], k[block];
+    for (size_t at = 0; at < n; at += block)
+    {
+        const size_t m = n - at < block ? n - at : block;
+        for (size_t i = 0; i < m; i++)
+        {
+            double v = x[at + i] > -708.0 ? x[at + i] : -708.0;
+            k[i] = nearbyint(v * 1.4426950408889634);          // round(x / ln2)
+            r[i] = (v - k[i] * 6.93147180369123816490e-01) - k[i] * 1.90821492927058770002e-10; // two-part ln2
+        }
+        double acc[block];
+        for (size_t i = 0; i < m; i++)
+        {
+            acc[i] = p.coef[p.degree];
+        }
+        for (int d = p.degree - 1; d >= 0; d--)
+        {
+            const double c = p.coef[d];
+            for (size_t i = 0; i < m; i++)
+            {
+                acc[i] = acc[i] * r[i] + c;
+            }
+        }
+        for (size_t i = 0; i < m; i++)
+        {
+            // 2^k from the exponent bits: k + 1023 lands in the low mantissa
+            // bits of k + 1023 + 2^52, then moves to the exponent field.
+            double biased = k[i] + (1023.0 + 4503599627370496.0);
+            uint64_t bits;
+            memcpy(&bits, &biased, sizeof(bits));
+            bits <<= 52;
+            double scale;
+            memcpy(&scale, &bits, sizeof(scale));
+            out[at + i] = x[at + i] > -708.0 ? acc[i] * scale : 0.0;
+        }
+    }
+}
+
+#define SIMSPAD_KERNELS(ATTR, SUFFIX, ISA)                                                   \
+    ATTR static ChunkSummary summarise_##SUFFIX(const double *x, size_t n)                   \
+    {                                                                                        \
+        return summarise_body(x, n);                                                         \
+    }                                                                                        \
+    ATTR static double peak_abs_##SUFFIX(const double *x, size_t n)                          \
+    {                                                                                        \
+        return peak_abs_body(x, n);                                                          \
+    }                                                                                        \
+    ATTR static void scale_##SUFFIX(const double *x, double a, double *out, size_t n)        \
+    {                                                                                        \
+        scale_body(x, a, out, n);                                                            \
+    }                                                                                        \
+    ATTR static void accumulate_##SUFFIX(const double *x, double *out, size_t n)             \
+    {                                                                                        \
+        accumulate_body(x, out, n);                                                          \
+    }                                                                                        \
+    ATTR static void to_f32_##SUFFIX(const double *x, char *out, size_t n)                   \
+    {                                                                                        \
+        to_f32_body(x, out, n);                                                              \
+    }                                                                                        \
+    ATTR static void to_i16_##SUFFIX(const double *x, double scale, char *out, size_t n)     \
+    {                                                                                        \
+        to_i16_body(x, scale, out, n);                                                       \
+    }                                                                                        \
+    ATTR static void convolve_##SUFFIX(const double *x, size_t n, const double *k, size_t m, \
+                                       double *out)                                          \
+    {                                                                                        \
+        convolve_body(x, n, k, m, out);                                                      \
+    }                                                                                        \
+    ATTR static void exp_##SUFFIX(const ExpPolynomial &p, const double *x, double *out, size_t n) \
+    {                                                                                        \
+        exp_body(p, x, out, n);                                                              \
+    }                                                                                        \
+    static const SimdKernels kernels_##SUFFIX = {ISA, summarise_##SUFFIX, peak_abs_##SUFFIX, \
+                                                 scale_##SUFFIX, accumulate_##SUFFIX,        \
+                                                 to_f32_##SUFFIX, to_i16_##SUFFIX, convolve_##SUFFIX, \
+                                                 exp_##SUFFIX};
+
+SIMSPAD_KERNELS(, sse42, Isa::SSE42)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMSPAD_MULTI_ISA 1
+#if defined(__clang__)
+#define SIMSPAD_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw,avx2,fma")))
+#else
+#define SIMSPAD_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw,avx2,fma,prefer-vector-width=512")))
+#endif
+SIMSPAD_KERNELS(__attribute__((target("avx2,fma"))), avx2, Isa::AVX2)
+SIMSPAD_KERNELS(SIMSPAD_AVX512, avx512, Isa::AVX512)
+#endif
+
+ExpPolynomial ExpPolynomial::for_error(double relError)
+{
+    // Taylor remainder on |r| <= ln2/2: |r|^(d+1) / (d+1)! * e^|r|.
+    const double rmax = 0.5 * 0.6931471805599453;
+    relError = relError > MIN_ERROR ? relError : MIN_ERROR;
+    ExpPolynomial p;
+    double term = 1.0; // rmax^d / d!
+    p.coef[0] = 1.0;
+    for (int d = 1; d <= MAX_DEGREE; d++)
+    {
+        p.coef[d] = p.coef[d - 1] / d;
+        term *= rmax / d;
+        p.degree = d;
+        p.bound = term * rmax / (d + 1) * exp(rmax);
+        if (p.bound <= relError)
+        {
+            break;
+        }
+    }
+    return p;
+}
+
+const char *isa_name(Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::AVX2:
+        return "avx2";
+    case Isa::AVX512:
+        return "avx512";
+    default:
+        return "sse4.2";
+    }
+}
+
+static const SimdKernels &select_kernels()
+{
+#ifdef SIMSPAD_MULTI_ISA
+    Isa cap = Isa::AVX512;
+    const char *env = getenv("SIMSPAD_ISA");
+    if (env)
+    {
+        string want = env;
+        cap = want == "sse4.2" || want == "sse42" ? Isa::SSE42 : want == "avx2" ? Isa::AVX2 : Isa::AVX512;
+    }
+    __builtin_cpu_init();
+    if (cap >= Isa::AVX512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw"))
+    {
+        return kernels_avx512;
+    }
+    if (cap >= Isa::AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return kernels_avx2;
+    }
+#endif
+    return kernels_sse42;
+}
+
+const SimdKernels &simd()
+{
+    static const SimdKernels &chosen = select_kernels();
+    return chosen;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+
+// Vectorisable array kernels, each compiled for several x86 instruction sets
+// and chosen once, on first use, from what the CPU supports: the same binary
+// runs the AVX2 or AVX-512 variant where available and the SSE4.2 baseline
+// (the build's -msse4.2) elsewhere. SIMSPAD_ISA=sse4.2|avx2|avx512 in the
+// environment caps the choice, e.g. to compare variants.
+enum class Isa
+{
+    SSE42,
+    AVX2,
+    AVX512
+};
+
+const char *isa_name(Isa isa);
+
+// exp(x) as 2^k p(r), with x = k ln2 + r, |r| <= ln2/2 and p the Taylor
+// polynomial of the lowest degree whose relative error stays within the bound
+// asked for. Bounds below 1e-13 are raised to it: near |x| = 700 rounding in
+// the range reduction (reassociated under -ffast-math) reaches that. Arguments
+// below -708 give 0.
+struct ExpPolynomial
+{
+    static constexpr int MAX_DEGREE = 16;
+    static constexpr double MIN_ERROR = 1e-13;
+    int degree = 0;
+    double coef[MAX_DEGREE + 1] = {}; // coef[i] = 1 / i!
+    double bound = 0.0;               // relative error bound of the truncation
+
+    static ExpPolynomial for_error(double relError);
+};
+
+struct ChunkSummary
+{
+    double sum, min, max; // of n > 0 samples
+};
+
+struct SimdKernels
+{
+    Isa isa;
+    ChunkSummary (*summarise)(const double *x, std::size_t n);
+    double (*peak_abs)(const double *x, std::size_t n);
+    // out[i] = a * x[i]; out may be x.
+    void (*scale)(const double *x, double a, double *out, std::size_t n);
+    // out[i] += x[i]
+    void (*accumulate)(const double *x, double *out, std::size_t n);
+    // n little-endian float32s (unaligned) from x.
+    void (*to_f32)(const double *x, char *out, std::size_t n);
+    // n little-endian int16s (unaligned): x[i] / scale, rounded and clamped.
+    void (*to_i16)(const double *x, double scale, char *out, std::size_t n);
+    // Centred convolution: out[i] = sum_j k[j] x[i + j - m/2] over valid indices.
+    void (*convolve)(const double *x, std::size_t n, const double *k, std::size_t m, double *out);
+    // out[i] = exp(x[i]) by `p`; out may be x.
+    void (*exp)(const ExpPolynomial &p, const double *x, double *out, std::size_t n);
+};
+
+// The variant for this CPU.
+const SimdKernels &simd();
+
+#endif // SIMD_H
@@ -30,6 +30,12 @@
 #define PBSTR "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||"
 #define PBWIDTH 60
 
+#if SIMSPAD_ENGINE_STATS
+#define ENGINE_COUNT(counter, n) (stats.counter += (n))
+#else
+#define ENGINE_COUNT(counter, n) ((void)0)
+#endif
+
 using namespace std;
 
 void cli_logo(void)
@@ -241,6 +247,20 @@ void SiPM::seed_engines()
     renewalEngine.seed(random_device{}());
 }
 
+// Deterministic seeding: one engine per stream, each from its own seed_seq so
+// the three streams are decorrelated even for adjacent seeds.
+void SiPM::seed(uint64_t seedValue)
+{
+    const uint32_t lo = (uint32_t)seedValue, hi = (uint32_t)(seedValue >> 32);
+    seed_seq poissonSeq{lo, hi, 0u};
+    seed_seq unifSeq{lo, hi, 1u};
+    seed_seq renewalSeq{lo, hi, 2u};
+    poissonEngine.seed(poissonSeq);
+    unifRandomEngine.seed(unifSeq);
+    renewalEngine.seed(renewalSeq);
+    unif.reset();
+}
+
 // Random double between range a and b.
 double SiPM::unif_rand_double(double a, double b)
 {
@@ -272,8 +292,32 @@ unsigned long SiPM::unif_rand_int(unsigned long a, unsigned long b)
 // The true distribution for general input is more complicated and needs investigation.
 // This is run at simulation time.
 void SiPM::init_state(double meanInPhotonsDt, unsigned long nSteps) // inclusion adds ~ 35ps/ucell dt in SIM
+{
+    init_state(age_distribution(meanInPhotonsDt, nSteps));
+}
+
+// Sample fresh microcell ages from a (possibly shared) age distribution.
+void SiPM::init_state(const AgeDistribution &ages)
 {
     simClock = 0.0; // restart the simulation clock for a fresh streaming run
+    simStep = 0;
+    detections = 0;
+    stats = EngineStats();
+    microcellTimes.clear(); // re-initialising must replace, not append to, the ages
+    select_kernel();        // parameters may have been changed since construction
+
+    // randomly sample this distribution
+    std::piecewise_constant_distribution<> d;
+    for (unsigned long i = 0; (unsigned long)i < numMicrocell; i++)
+    {
+        microcellTimes.push_back(-d(renewalEngine, ages)); // negative as in the past - before simulation has begun
+    }
+}
+
+// The expensive half of init_state(): build the time-since-last-detection
+// distribution for a mean flux. Depends only on the device and the flux.
+SiPM::AgeDistribution SiPM::age_distribution(double meanInPhotonsDt, unsigned long nSteps)
+{
     if (meanInPhotonsDt == 0)
     {
         // prevent errors with distribution generation - assume one photon arriving?
@@ -325,13 +369,99 @@ void SiPM::init_state(double meanInPhotonsDt, unsigned long nSteps) // inclusion
     // Generate time since last detection distribution
     // $f_x(t) = \frac {\int_t^{\infty} f_t(t) dt} {\int_0^{\infty} \int_t^{\infty} f_t(t) dt dt}$
     // use piecewise linear as an approximation
-    std::piecewise_constant_distribution<> d(T.begin(), T.end(), weights.begin());
+    return AgeDistribution(T.begin(), T.end(), weights.begin());
+}
 
-    // randomly sample this distribution
-    for (unsigned long i = 0; (unsigned long)i < numMicrocell; i++)
+// Mean DC response from the renewal model of one microcell: photons strike
+// it at rate lambda and a cell of age t fires with probability pde(t), so its
+// next firing age T has survival S(t) = exp(-lambda * int_0^t pde) and density
+// f_t = lambda * pde * S (as in age_distribution()). The mean interval is
+// int S dt, the time-averaged voltage int S V dt over that, and each interval
+// delivers V(T) * cCell when V(T) clears the digital threshold.
+SteadyState SiPM::steady_state(double photonsPerDt) const
+{
+    if (!is_finite_double(photonsPerDt) || photonsPerDt < 0)
+    {
+        throw invalid_argument("steady_state() needs a finite, non-negative photons per dt");
+    }
+    SteadyState ss;
+    ss.photonRate = photonsPerDt / dt;
+    ss.meanOvervoltage = vOver;
+    const double lambda = photonsPerDt / (dt * numMicrocell);  // photons per second per cell
+    const double pdeFull = pdeMax * (1 - exp(-(vOver / vChr))); // PDE of a recharged cell
+    if (lambda <= 0 || pdeFull <= 0)
+    {
+        return ss; // no detections: every cell stays recharged
+    }
+
+    // Integrate step by step out to 20 tauRecovery, where the cell is
+    // recharged to ~2e-9 of vOver, then the exponential tail in closed form.
+    // Each step is at most 1% of tauRecovery and keeps the chance of firing
+    // within it under 1% (bounding the PDE's rise by its slope at t = 0), so
+    // the cost stays at a few thousand steps from dark to saturation. A step
+    // ends on tThreshold.
+    const double tEnd = 20 * tauRecovery;
+    const double resolution = 0.01;
+    const double slope = pdeMax * vOver / (vChr * tauRecovery); // largest d(pde)/dt
+
+    // Charge needs V(T) > digitalThreshold * vOver, i.e. T > tThreshold
+    const double vThreshold = digitalThreshold * vOver;
+    const double tThreshold = vThreshold <= 0      ? 0.0
+                              : digitalThreshold < 1 ? -tauRecovery * log1p(-digitalThreshold)
+                                                     : 2 * tEnd; // never
+    double intS = 0, intSV = 0; // int S dt, int S V dt
+    double intF = 0, intFV = 0; // int f dt, int f V dt over the charged ages
+    double t = 0, S = 1, v = 0, pde = 0;
+    bool tail = true;
+    const double cuts[2] = {min(tThreshold, tEnd), tEnd};
+    for (int seg = 0; seg < 2 && tail; seg++)
+    {
+        const bool charged = seg == 1 || tThreshold <= 0;
+        while (t < cuts[seg] && tail)
+        {
+            // largest h with lambda * (pde + slope * h) * h <= resolution
+            double h = 2 * resolution / (lambda * (pde + sqrt(pde * pde + 4 * slope * resolution / lambda)));
+            h = min(h, resolution * tauRecovery);
+            h = t + h < cuts[seg] ? h : cuts[seg] - t;
+            t = t + h < cuts[seg] ? t + h : cuts[seg];
+            const double v1 = vOver * (1 - exp(-t / tauRecovery));
+            const double pde1 = pdeMax * (1 - exp(-(v1 / vChr)));
+            // S decays exactly by the step's trapezoidal hazard a, and the
+            // fires in the step (f dt) are S - S1
+            const double a = 0.5 * h * lambda * (pde + pde1);
+            const double S1 = S * exp(-a);
+            const double meanS = a > 0 ? -S * expm1(-a) / a : S;
+            intS += h * meanS;
+            intSV += h * meanS * 0.5 * (v + v1);
+            if (charged)
+            {
+                intF += S - S1;
+                intFV += (S - S1) * 0.5 * (v + v1);
+            }
+            v = v1;
+            pde = pde1;
+            S = S1;
+            tail = S > 1e-18; // nothing left to integrate
+        }
+    }
+    if (tail)
     {
-        microcellTimes.push_back(-d(renewalEngine)); // negative as in the past - before simulation has begun
+        const double mean = S / (lambda * pdeFull); // int_tEnd^inf S dt
+        intS += mean;
+        intSV += vOver * mean;
+        if (vOver > vThreshold)
+        {
+            intF += S;
+            intFV += vOver * S;
+        }
     }
+
+    ss.detectionRate = numMicrocell * intF / intS;
+    ss.effectivePde = ss.detectionRate / ss.photonRate;
+    ss.meanOvervoltage = intSV / intS;
+    ss.meanCharge = intF > 0 ? cCell * intFV / intF : 0.0;
+    ss.ibias = numMicrocell * cCell * intFV / intS;
+    return ss;
 }
 
 // Convenience wrapper: seed the initial microcell ages from an in-memory light
@@ -352,28 +482,94 @@ void SiPM::init_spads(vector<double> light)
 // init_state()/init_spads() must have been called once beforehand.
 void SiPM::simulate_chunk(const double *in, double *out, size_t n)
 {
+    (this->*chunkKernel)(in, out, n);
+}
+
+// Pick the step kernel for the current parameters. The threshold test can
+// only reject when digitalThreshold * vOver > 0 (both are clamped to >= 0);
+// with a zero product every cell that passes the PDE test has a positive
+// voltage, so the analog kernel drops the test without changing results.
+void SiPM::select_kernel(void)
+{
+    static const ChunkKernel kernels[3][2] = {
+        {&SiPM::simulate_chunk_as<false, Recovery::LUT>, &SiPM::simulate_chunk_as<true, Recovery::LUT>},
+        {&SiPM::simulate_chunk_as<false, Recovery::Exact>, &SiPM::simulate_chunk_as<true, Recovery::Exact>},
+        {&SiPM::simulate_chunk_as<false, Recovery::FastExp>, &SiPM::simulate_chunk_as<true, Recovery::FastExp>},
+    };
+    const bool digital = digitalThreshold * vOver > 0.0;
+    chunkKernel = kernels[(int)recoveryModel][digital ? 1 : 0];
+}
+
+void SiPM::set_recovery(Recovery model, double expError)
+{
+    recoveryModel = model;
+    expPoly = ExpPolynomial::for_error(expError);
+    select_kernel();
+}
+
+template <bool Digital, Recovery Model>
+void SiPM::simulate_chunk_as(const double *in, double *out, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    // DC input (common for whole chunks): clamp and set up the Poisson
+    // distribution once. reset() drops the normal variate it may cache
+    // (large means), so the draws match constructing it every step.
+    bool constant = true;
+    for (size_t i = 1; i < n && constant; i++)
+    {
+        constant = in[i] == in[0];
+    }
+    if (constant)
+    {
+        poisson_distribution<int> photons(in[0] > 0.0 ? in[0] : 0.0);
+        for (size_t i = 0; i < n; i++)
+        {
+            photons.reset();
+            out[i] = simulate_microcells<Digital, Model>(simClock, photons);
+            simClock += dt;
+            simStep++;
+        }
+        return;
+    }
     for (size_t i = 0; i < n; i++)
     {
         // If expected num of photons per bit is negative, set to zero
-        double l = in[i] > 0.0 ? in[i] : 0.0;
-        out[i] = simulate_microcells(simClock, l);
+        poisson_distribution<int> photons(in[i] > 0.0 ? in[i] : 0.0);
+        out[i] = simulate_microcells<Digital, Model>(simClock, photons);
         simClock += dt;
+        simStep++;
     }
 }
 
+// Attach (or detach, with nullptr) a vector that receives a DetectionEvent for
+// every detection that adds charge to the output. The vector is only appended
+// to; draining it between chunks is the caller's job.
+void SiPM::set_event_sink(vector<DetectionEvent> *sink)
+{
+    eventSink = sink;
+}
+
 // For a single time step, simulate all the microcells in the SiPM detector
 // This function relies on the internal private state microcellTimes, which stores the
 // times when the last detection occured for each microcell.
-// Inputs are the current time T, and the expected number of photons for this time step
-// arriving at the detector
-double SiPM::simulate_microcells(double T, double photonsPerDt)
+// Inputs are the current time T, and the distribution of the number of photons
+// arriving at the detector in this time step
+template <bool Digital, Recovery Model>
+double SiPM::simulate_microcells(double T, poisson_distribution<int> &photons)
 {
+    if (Model == Recovery::FastExp)
+    {
+        return simulate_microcells_batched<Digital>(T, photons);
+    }
     double output = 0; // output charge for a single time step
     double volt = 0;   // voltage for microcell
 
     // randomly sample poisson parameter lambda input to generate number of incoming photons
-    poisson_distribution<int> distribution(photonsPerDt);
-    unsigned long poissonPhotons = distribution(poissonEngine); // Number of incident photons
+    unsigned long poissonPhotons = photons(poissonEngine); // Number of incident photons
+    ENGINE_COUNT(photons, poissonPhotons);
 
     unsigned long struck_cell;                         // index of the microcell struck with a photon
     for (unsigned long j = 0; j < poissonPhotons; j++) // for each incident photon...
@@ -383,21 +579,188 @@ double SiPM::simulate_microcells(double T, double photonsPerDt)
 
         if (T == microcellTimes[struck_cell]) // if ucell has already been struck, skip it INVALID READ
         {
+            ENGINE_COUNT(alreadyFired, 1);
             continue;
         }
-        if (unif_rand_double(0, 1) < pde_LUT(T - microcellTimes[struck_cell])) // PDE detection test INVALID READ
+        const double age = T - microcellTimes[struck_cell];
+        double pde;
+        if (Model == Recovery::Exact)
+        {
+            volt = volt_from_time(age); // needed for the PDE anyway
+            pde = pde_from_volt(volt);
+        }
+        else
         {
-            volt = volt_LUT(T - microcellTimes[struck_cell]); // calculate ucell voltage INVALID READ
-            microcellTimes[struck_cell] = T;                  // set detection time INVALID WRITE
-            if (volt > digitalThreshold * vOver)              // digital threshold test
+            ENGINE_COUNT(lutSaturated, age > tVecLUT[LUTSize - 1]);
+            pde = pde_LUT(age);
+        }
+        if (unif_rand_double(0, 1) < pde) // PDE detection test INVALID READ
+        {
+            if (Model == Recovery::LUT)
+            {
+                volt = volt_LUT(age); // calculate ucell voltage INVALID READ
+            }
+            microcellTimes[struck_cell] = T;                 // set detection time INVALID WRITE
+            if (!Digital || volt > digitalThreshold * vOver) // digital threshold test
             {
                 output += volt * cCell; // add fired microcell to output
+                detections++;
+                if (eventSink)
+                {
+                    eventSink->push_back({simStep, struck_cell, volt * cCell});
+                }
+            }
+            else
+            {
+                ENGINE_COUNT(subThreshold, 1);
+            }
+        }
+        else
+        {
+            ENGINE_COUNT(pdeRejected, 1);
+        }
+    }
+    return output;
+}
+
+// simulate_microcells() for Recovery::FastExp: every strike of the step is
+// drawn first and the recovery of all the struck cells evaluated in one
+// vectorised pass. Ages from the start of the step are all the PDE test
+// needs: a cell's age only changes when it fires, and a cell that has fired
+// in this step is skipped. (The random draws come in a different order from
+// the other models, so seeded runs differ from theirs.)
+template <bool Digital>
+double SiPM::simulate_microcells_batched(double T, poisson_distribution<int> &photons)
+{
+    unsigned long poissonPhotons = photons(poissonEngine);
+    ENGINE_COUNT(photons, poissonPhotons);
+    if (poissonPhotons == 0)
+    {
+        return 0.0;
+    }
+    if (struckCells.size() < poissonPhotons)
+    {
+        struckCells.resize(poissonPhotons);
+        struckArg.resize(poissonPhotons);
+        struckVolt.resize(poissonPhotons);
+        struckPde.resize(poissonPhotons);
+    }
+    for (unsigned long j = 0; j < poissonPhotons; j++)
+    {
+        struckCells[j] = unif_rand_int(0, numMicrocell);
+        struckArg[j] = T - microcellTimes[struckCells[j]];
+    }
+    fast_recovery(struckArg.data(), struckVolt.data(), struckPde.data(), poissonPhotons, struckArg.data());
+
+    double output = 0;
+    for (unsigned long j = 0; j < poissonPhotons; j++)
+    {
+        const unsigned long cell = struckCells[j];
+        if (T == microcellTimes[cell])
+        {
+            ENGINE_COUNT(alreadyFired, 1);
+            continue;
+        }
+        if (unif_rand_double(0, 1) < struckPde[j])
+        {
+            const double volt = struckVolt[j];
+            microcellTimes[cell] = T;
+            if (!Digital || volt > digitalThreshold * vOver)
+            {
+                output += volt * cCell;
+                detections++;
+                if (eventSink)
+                {
+                    eventSink->push_back({simStep, cell, volt * cCell});
+                }
+            }
+            else
+            {
+                ENGINE_COUNT(subThreshold, 1);
             }
         }
+        else
+        {
+            ENGINE_COUNT(pdeRejected, 1);
+        }
     }
     return output;
 }
 
+// V(t) = vOver (1 - exp(-t / tauRecovery)), PDE(V) = pdeMax (1 - exp(-V / vChr)),
+// both through the polynomial exp. `scratch` may be `ages`.
+void SiPM::fast_recovery(const double *ages, double *volt, double *pde, size_t n, double *scratch) const
+{
+    const SimdKernels &k = simd();
+    const double invTau = 1.0 / tauRecovery, invChr = 1.0 / vChr;
+    k.scale(ages, -invTau, scratch, n);
+    k.exp(expPoly, scratch, scratch, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        volt[i] = vOver * (1.0 - scratch[i]);
+    }
+    k.scale(volt, -invChr, scratch, n);
+    k.exp(expPoly, scratch, scratch, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        pde[i] = pdeMax * (1.0 - scratch[i]);
+    }
+}
+
+RecoveryError SiPM::recovery_error(unsigned long points) const
+{
+    RecoveryError err;
+    if (recoveryModel == Recovery::Exact || points < 2)
+    {
+        return err;
+    }
+    vector<double> ages(points), volt(points), pde(points), scratch(points);
+    for (unsigned long i = 0; i < points; i++)
+    {
+        ages[i] = 20.0 * tauRecovery * (double)i / (double)(points - 1);
+    }
+    if (recoveryModel == Recovery::FastExp)
+    {
+        fast_recovery(ages.data(), volt.data(), pde.data(), points, scratch.data());
+    }
+    else
+    {
+        for (unsigned long i = 0; i < points; i++)
+        {
+            volt[i] = volt_LUT(ages[i]);
+            pde[i] = pde_LUT(ages[i]);
+        }
+    }
+    for (unsigned long i = 0; i < points; i++)
+    {
+        const double v = vOver * (1 - exp(-ages[i] / tauRecovery));
+        const double p = pdeMax * (1 - exp(-(v / vChr)));
+        err.volt = max(err.volt, fabs(volt[i] - v));
+        err.pde = max(err.pde, fabs(pde[i] - p));
+    }
+    err.volt = vOver > 0 ? err.volt / vOver : 0.0;
+    err.pde = pdeMax > 0 ? err.pde / pdeMax : 0.0;
+    return err;
+}
+
+EngineStats SiPM::engine_stats(void) const
+{
+    EngineStats s = stats;
+    s.detections = ENGINE_STATS ? detections : 0;
+    return s;
+}
+
+EngineStats &EngineStats::operator+=(const EngineStats &other)
+{
+    photons += other.photons;
+    alreadyFired += other.alreadyFired;
+    pdeRejected += other.pdeRejected;
+    subThreshold += other.subThreshold;
+    detections += other.detections;
+    lutSaturated += other.lutSaturated;
+    return *this;
+}
+
 //// UTILITY FUNCTIONS
 
 // progress bar
@@ -527,6 +890,7 @@ void SiPM::input_sanitation() // inclusion adds ~ 10ps/ucell dt in SIM
         digitalThreshold = 0;
         invalid_argument("Digital Threshold cannot be less than zero");
     }
+    select_kernel();
 }
 
 //// LOOKUP TABLE PARAMS AND FUNCTIONS
@@ -24,6 +24,8 @@
 #include <cmath>
 #include <algorithm>
 #include <random>
+#include <cstdint>
+#include "simd.hpp"
 
 // Progress bar defines
 #define PBSTR "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||"
@@ -43,6 +45,75 @@ void cli_logo(void);
 // crafted parameter set cannot exhaust memory/CPU (GHSA-c79g-qphv-xjxh, GHSA-f2ph-wv99-c83q).
 constexpr unsigned long MAX_MICROCELL = 10000000UL; // 1e7
 
+// A single microcell detection that contributed charge to the output, as
+// recorded by the optional event sink (see SiPM::set_event_sink()). `step` is
+// the sample index since init_state(), `cell` the struck microcell and `charge`
+// the fired charge (microcell voltage * cCell) added to out[step].
+struct DetectionEvent
+{
+    unsigned long long step;
+    unsigned long cell;
+    double charge;
+};
+
+// Engine counters inside simulate_microcells(), for --stats and the server's
+// metrics. Build with -DSIMSPAD_ENGINE_STATS=0 (make STATS=0) to compile them
+// out of the inner loop; they then stay zero.
+#ifndef SIMSPAD_ENGINE_STATS
+#define SIMSPAD_ENGINE_STATS 1
+#endif
+
+// Counts since init_state(). Every photon drawn strikes a cell and ends in
+// exactly one of: alreadyFired (that cell fired earlier in the same step),
+// pdeRejected, subThreshold (fired, but below digitalThreshold * vOver, so
+// no charge) or detections. lutSaturated counts the strikes on cells older
+// than the lookup tables' time range, which see the fully recharged values.
+struct EngineStats
+{
+    unsigned long long photons = 0;
+    unsigned long long alreadyFired = 0;
+    unsigned long long pdeRejected = 0;
+    unsigned long long subThreshold = 0;
+    unsigned long long detections = 0;
+    unsigned long long lutSaturated = 0;
+
+    EngineStats &operator+=(const EngineStats &other);
+};
+
+// How simulate_chunk() evaluates microcell recovery (voltage and PDE against
+// the time since the cell last fired):
+//   LUT      linear interpolation in 20-point tables (the default)
+//   Exact    the closed form, with two exp() per struck cell
+//   FastExp  the closed form with a polynomial exp to a chosen error bound,
+//            vectorised over the cells struck in each step
+enum class Recovery
+{
+    LUT,
+    Exact,
+    FastExp
+};
+
+// Largest errors of a recovery model against the exact closed form, over
+// cell ages up to 20 tauRecovery, as fractions of vOver and pdeMax.
+struct RecoveryError
+{
+    double volt = 0.0;
+    double pde = 0.0;
+};
+
+// DC response of the renewal model behind init_state(), from
+// SiPM::steady_state(). Rates and currents are for the whole array; a
+// detection is a fire that produces charge (above the digital threshold).
+struct SteadyState
+{
+    double photonRate = 0.0;      // incident photons per second
+    double detectionRate = 0.0;   // detections per second
+    double effectivePde = 0.0;    // detections per incident photon
+    double meanOvervoltage = 0.0; // time-averaged microcell overvoltage (V)
+    double meanCharge = 0.0;      // mean charge per detection (C)
+    double ibias = 0.0;           // mean bias current (A)
+};
+
 class SiPM
 {
 public:
@@ -87,13 +158,58 @@ public:
     // wrapper over these two.
     void init_state(double meanPhotonsPerDt, unsigned long nSteps);
 
+    // init_state() in two halves, so the distribution of microcell ages (the
+    // costly part, fixed by the device and the flux) can be built once and
+    // shared between SiPMs with identical parameters.
+    using AgeDistribution = std::piecewise_constant_distribution<double>::param_type;
+    AgeDistribution age_distribution(double meanPhotonsPerDt, unsigned long nSteps);
+    void init_state(const AgeDistribution &ages);
+
+    // Mean response to a constant `photonsPerDt`, by numerically integrating
+    // the inter-detection density rather than by simulating. Uses the exact
+    // recovery curves, so Monte Carlo agrees with it to within noise under
+    // Recovery::Exact or FastExp (the LUT's interpolation biases it by ~0.3%).
+    SteadyState steady_state(double photonsPerDt) const;
+
     void simulate_chunk(const double *in, double *out, std::size_t n);
 
+    // Optional sparse output. While a sink is attached, simulate_chunk() also
+    // appends one DetectionEvent per charge-producing detection; the caller
+    // drains/clears the vector between chunks. Pass nullptr to detach.
+    void set_event_sink(std::vector<DetectionEvent> *sink);
+
+    // Make the run reproducible: reseed every random engine deterministically
+    // from `seed` (call before init_state()). Unseeded SiPMs draw fresh
+    // entropy from std::random_device at construction.
+    void seed(std::uint64_t seedValue);
+
+    // Number of charge-producing detections since init_state().
+    unsigned long long detection_count(void) const { return detections; }
+
+    // Engine counters since init_state(); all zero when compiled out.
+    static constexpr bool ENGINE_STATS = SIMSPAD_ENGINE_STATS;
+    EngineStats engine_stats(void) const;
+
     std::vector<double> shape_output(std::vector<double> inputVec);
 
+    // Choose the recovery model; `expError` is the relative error bound of
+    // the polynomial exp for Recovery::FastExp (see ExpPolynomial).
+    void set_recovery(Recovery model, double expError = 1e-9);
+    Recovery recovery(void) const { return recoveryModel; }
+    const ExpPolynomial &exp_polynomial(void) const { return expPoly; }
+
+    // Accuracy of the current model against exact exp(), on `points` ages.
+    RecoveryError recovery_error(unsigned long points = 100000) const;
+
 private:
+    friend struct SiPMBench; // bench/bench.cpp times the private kernels
+
     std::vector<double> microcellTimes;
     double simClock = 0.0; // running simulation time, carried across chunks
+    unsigned long long simStep = 0; // running sample index, carried across chunks
+    std::vector<DetectionEvent> *eventSink = nullptr; // optional detection event list
+    unsigned long long detections = 0; // charge-producing detections since init_state()
+    EngineStats stats;                 // engine counters since init_state() (see SIMSPAD_ENGINE_STATS)
 
     std::mt19937_64 poissonEngine;
     std::mt19937_64 unifRandomEngine;
@@ -108,7 +224,33 @@ private:
 
     void init_spads(std::vector<double> light);
 
-    double simulate_microcells(double T, double photonsPerDt);
+    // The step kernel is specialised at compile time on the device (analog or
+    // digital threshold, recovery model); select_kernel() picks the
+    // instantiation once the parameters are known, and the chunk loop then
+    // also specialises on DC (constant) or varying input.
+    using ChunkKernel = void (SiPM::*)(const double *in, double *out, std::size_t n);
+    ChunkKernel chunkKernel = nullptr;
+    Recovery recoveryModel = Recovery::LUT;
+    ExpPolynomial expPoly = ExpPolynomial::for_error(1e-9);
+
+    // FastExp scratch: the cells struck in a step, their exp() arguments and
+    // results (voltages, then PDEs).
+    std::vector<unsigned long> struckCells;
+    std::vector<double> struckArg, struckVolt, struckPde;
+
+    void select_kernel(void);
+
+    template <bool Digital, Recovery Model>
+    void simulate_chunk_as(const double *in, double *out, std::size_t n);
+
+    template <bool Digital, Recovery Model>
+    double simulate_microcells(double T, std::poisson_distribution<int> &photons);
+
+    template <bool Digital>
+    double simulate_microcells_batched(double T, std::poisson_distribution<int> &photons);
+
+    // Voltages and PDEs of cells of the given ages, by the polynomial exp.
+    void fast_recovery(const double *ages, double *volt, double *pde, std::size_t n, double *scratch) const;
 
     void print_progress(double percentage) const;
 
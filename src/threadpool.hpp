@@ -0,0 +1,59 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+// Fixed-size pool of compute threads, separate from the HTTP I/O threads, so
+// long simulations never occupy a connection worker. Tasks run FIFO.
+class ComputePool
+{
+public:
+    explicit ComputePool(std::size_t threads);
+    ~ComputePool();
+
+    void enqueue(std::function<void()> task);
+
+    // Finish queued tasks and join the workers. Idempotent; also run by the
+    // destructor.
+    void shutdown();
+
+    std::size_t size() const { return workers_.size(); }
+    std::size_t queued() const;
+
+    ComputePool(ComputePool const &) = delete;
+    void operator=(ComputePool const &) = delete;
+
+private:
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    void work();
+};
+
+#endif // THREAD_POOL_H
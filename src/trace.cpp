@@ -0,0 +1,90 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "trace.hpp"
+
+using namespace std;
+
+Tracer::Tracer(size_t capacity) : origin_(Clock::now()), events_(capacity) {}
+
+void Tracer::record(const char *name, Clock::time_point start, Clock::time_point end, long long chunk)
+{
+    size_t at = next_.fetch_add(1, memory_order_relaxed);
+    if (at >= events_.size())
+    {
+        return;
+    }
+    thread_local const int64_t tid = (int64_t)syscall(SYS_gettid);
+    events_[at] = {name, chrono::duration_cast<chrono::nanoseconds>(start - origin_).count(),
+                   chrono::duration_cast<chrono::nanoseconds>(end - start).count(), tid, chunk};
+}
+
+size_t Tracer::size() const
+{
+    size_t n = next_.load(memory_order_acquire);
+    return n < events_.size() ? n : events_.size();
+}
+
+size_t Tracer::dropped() const
+{
+    size_t n = next_.load(memory_order_acquire);
+    return n > events_.size() ? n - events_.size() : 0;
+}
+
+// Call once every traced thread is done (timestamps are in microseconds, as the format expects).
+void Tracer::write_json(ostream &out) const
+{
+    const size_t n = size();
+    const int64_t pid = (int64_t)getpid();
+    out << "{\"traceEvents\": [\n";
+    set<int64_t> threads;
+    for (size_t i = 0; i < n; i++)
+    {
+        const Event &e = events_[i];
+        threads.insert(e.tid);
+        out << "{\"name\": \"" << e.name << "\", \"cat\": \"simspad\", \"ph\": \"X\", \"ts\": " << e.start / 1000 << "."
+            << to_string(1000 + e.start % 1000).substr(1) << ", \"dur\": " << e.duration / 1000 << "."
+            << to_string(1000 + e.duration % 1000).substr(1) << ", \"pid\": " << pid << ", \"tid\": " << e.tid;
+        if (e.chunk >= 0)
+        {
+            out << ", \"args\": {\"chunk\": " << e.chunk << "}";
+        }
+        out << "},\n";
+    }
+    for (int64_t tid : threads)
+    {
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << (tid == pid ? "main" : "worker " + to_string(tid)) << "\"}},\n";
+    }
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"args\": {\"name\": \"simspad\"}}\n";
+    out << "], \"displayTimeUnit\": \"ns\", \"otherData\": {\"droppedSpans\": " << dropped() << "}}\n";
+}
+
+void Tracer::write_json(const string &filename) const
+{
+    ofstream out(filename);
+    if (!out)
+    {
+        throw runtime_error("cannot open trace output file: " + filename);
+    }
+    write_json(out);
+}
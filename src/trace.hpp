@@ -0,0 +1,91 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Timed spans of the pipeline stages (reading, init_state, simulation,
+// writing, ...) for viewing in chrome://tracing or Perfetto. Spans from any
+// thread go into a buffer allocated up front, claimed with one atomic
+// increment; spans past its capacity are counted and dropped. Names must be
+// string literals (they are stored as pointers).
+class Tracer
+{
+public:
+    explicit Tracer(std::size_t capacity = 1u << 16);
+
+    using Clock = std::chrono::steady_clock;
+
+    // A completed span on the calling thread; `chunk` (if >= 0) is shown as an argument.
+    void record(const char *name, Clock::time_point start, Clock::time_point end, long long chunk = -1);
+
+    // Chrome trace-event JSON ("X" complete events, one track per thread).
+    void write_json(std::ostream &out) const;
+    void write_json(const std::string &filename) const;
+
+    std::size_t size() const;
+    std::size_t dropped() const;
+
+private:
+    struct Event
+    {
+        const char *name;
+        std::int64_t start, duration; // ns since the tracer was made
+        std::int64_t tid;
+        long long chunk;
+    };
+
+    Clock::time_point origin_;
+    std::vector<Event> events_;
+    std::atomic<std::size_t> next_{0};
+};
+
+// Records the span from construction to destruction; a no-op without a tracer.
+class TraceSpan
+{
+public:
+    TraceSpan(Tracer *tracer, const char *name, long long chunk = -1)
+        : tracer_(tracer), name_(name), chunk_(chunk), start_(tracer ? Tracer::Clock::now() : Tracer::Clock::time_point())
+    {
+    }
+    ~TraceSpan()
+    {
+        if (tracer_)
+        {
+            tracer_->record(name_, start_, Tracer::Clock::now(), chunk_);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    Tracer *tracer_;
+    const char *name_;
+    long long chunk_;
+    Tracer::Clock::time_point start_;
+};
+
+#endif // TRACE_H
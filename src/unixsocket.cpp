@@ -0,0 +1,584 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "unixsocket.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+static bool read_all(int fd, void *buf, size_t n)
+{
+    char *p = static_cast<char *>(buf);
+    while (n > 0)
+    {
+        ssize_t got = ::recv(fd, p, n, 0);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false; // EOF, error or receive timeout
+        }
+        p += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = static_cast<const char *>(buf);
+    while (n > 0)
+    {
+        ssize_t put = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            return false;
+        }
+        p += put;
+        n -= (size_t)put;
+    }
+    return true;
+}
+
+template <typename T>
+static T get_le(const unsigned char *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(T)); // the wire format is little-endian, as is the host
+    return v;
+}
+
+template <typename T>
+static void put_le(string &out, T v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+static bool send_status(int fd, int status, uint32_t retryAfter, const string &message)
+{
+    string out("SSPR", 4);
+    put_le<uint16_t>(out, 1);
+    put_le<uint16_t>(out, (uint16_t)status);
+    put_le<uint32_t>(out, retryAfter);
+    put_le<uint32_t>(out, (uint32_t)message.size());
+    out += message;
+    return write_all(fd, out.data(), out.size());
+}
+
+// Announce a mid-request error; always false, as the connection then closes.
+static bool send_error(int fd, int status, const string &message)
+{
+    string out;
+    put_le<uint32_t>(out, UnixSocketServer::ERROR_FRAME);
+    put_le<uint16_t>(out, (uint16_t)status);
+    put_le<uint16_t>(out, 0);
+    put_le<uint32_t>(out, (uint32_t)message.size());
+    out += message;
+    write_all(fd, out.data(), out.size());
+    return false;
+}
+
+// Read the shared-memory descriptor and the segment fd riding along with it
+// (*segment stays -1 if none came).
+static bool read_descriptor(int fd, int *segment, uint64_t *inOffset, uint64_t *outOffset)
+{
+    unsigned char d[16];
+    size_t got = 0;
+    while (got < sizeof(d))
+    {
+        iovec iov{d + got, sizeof(d) - got};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int)))
+            {
+                int received;
+                memcpy(&received, CMSG_DATA(c), sizeof(int));
+                if (*segment < 0)
+                {
+                    *segment = received;
+                }
+                else
+                {
+                    close(received);
+                }
+            }
+        }
+        got += (size_t)n;
+    }
+    *inOffset = get_le<uint64_t>(d);
+    *outOffset = get_le<uint64_t>(d + 8);
+    return true;
+}
+
+UnixSocketServer::UnixSocketServer(const string &path, SimulationCore &core, size_t threads, Logger log)
+    : path_(path), core_(core), log_(std::move(log)), workers_(threads)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path_.empty() || path_.size() >= sizeof(addr.sun_path))
+    {
+        throw runtime_error("unix socket path is empty or too long: " + path_);
+    }
+    memcpy(addr.sun_path, path_.c_str(), path_.size());
+
+    // Replace a stale socket from an earlier run, but never any other file.
+    struct stat st;
+    if (lstat(path_.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            throw runtime_error(path_ + " exists and is not a socket");
+        }
+        unlink(path_.c_str());
+    }
+
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0)
+    {
+        throw runtime_error(string("socket: ") + strerror(errno));
+    }
+    // Owner-only, set before listen() so no one else can ever connect.
+    if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        chmod(path_.c_str(), 0600) != 0 || listen(listenFd_, 64) != 0)
+    {
+        int err = errno;
+        close(listenFd_);
+        throw runtime_error("cannot listen on " + path_ + ": " + strerror(err));
+    }
+    acceptor_ = thread([this]
+                       { accept_loop(); });
+}
+
+UnixSocketServer::~UnixSocketServer()
+{
+    stop();
+}
+
+void UnixSocketServer::stop()
+{
+    if (stopping_.exchange(true))
+    {
+        return;
+    }
+    if (acceptor_.joinable())
+    {
+        acceptor_.join();
+    }
+    close(listenFd_);
+    unlink(path_.c_str());
+    {
+        lock_guard<mutex> lock(openMutex_);
+        for (int fd : open_)
+        {
+            shutdown(fd, SHUT_RD); // unblock connections waiting for a request
+        }
+    }
+    workers_.shutdown();
+}
+
+void UnixSocketServer::accept_loop()
+{
+    while (!stopping_)
+    {
+        pollfd p{listenFd_, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0)
+        {
+            continue;
+        }
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        connections_++;
+        workers_.enqueue([this, fd]
+                         { serve(fd); });
+    }
+}
+
+void UnixSocketServer::serve(int fd)
+{
+    {
+        lock_guard<mutex> lock(openMutex_);
+        open_.insert(fd);
+    }
+    // Idle or stalled peers must not hold a worker forever.
+    timeval timeout{60, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Fair-queueing identity: the peer's uid.
+    string client = "unix";
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+    {
+        client = "unix:uid=" + to_string(cred.uid);
+    }
+
+    while (!stopping_ && serve_one(fd, client))
+    {
+    }
+    {
+        lock_guard<mutex> lock(openMutex_);
+        open_.erase(fd);
+    }
+    close(fd);
+}
+
+bool UnixSocketServer::fail(int fd, int status, const string &message)
+{
+    if (log_)
+    {
+        log_("[ERROR] unix socket request failed: " + message);
+    }
+    return send_error(fd, status, message);
+}
+
+// One request/response exchange; false once the connection should close.
+bool UnixSocketServer::serve_one(int fd, const string &client)
+{
+    unsigned char h[HEADER_BYTES];
+    if (!read_all(fd, h, sizeof(h)))
+    {
+        return false;
+    }
+    const auto arrived = chrono::steady_clock::now();
+
+    if (memcmp(h, "SSPQ", 4) != 0 || get_le<uint16_t>(h + 4) != 1)
+    {
+        send_status(fd, 400, 0, "bad magic or unsupported protocol version");
+        return false;
+    }
+    const uint16_t flags = get_le<uint16_t>(h + 6);
+    const bool f32In = flags & 2, f32Out = flags & 8;
+
+    SimulationRequest req;
+    req.svars.resize(10);
+    for (int i = 0; i < 10; i++)
+    {
+        req.svars[i] = get_le<double>(h + 8 + 8 * i);
+    }
+    req.seedMean = get_le<double>(h + 88);
+    req.seeded = flags & 1;
+    req.seed = get_le<uint64_t>(h + 96);
+    req.samples = (size_t)get_le<uint64_t>(h + 104);
+    req.events = flags & 4;
+    req.client = client;
+    uint32_t deadlineMs = get_le<uint32_t>(h + 112);
+    if (deadlineMs)
+    {
+        req.deadline = chrono::steady_clock::now() + chrono::milliseconds(deadlineMs);
+    }
+    if (!(req.seedMean >= 0.0))
+    {
+        req.seedMean = -1.0; // also maps a NaN to "from the input"
+    }
+
+    if (flags & 16)
+    {
+        int segment = -1;
+        uint64_t inOffset, outOffset;
+        if (!read_descriptor(fd, &segment, &inOffset, &outOffset))
+        {
+            if (segment >= 0)
+            {
+                close(segment);
+            }
+            return false;
+        }
+        if (segment < 0)
+        {
+            send_status(fd, 400, 0, "shared-memory request without a segment descriptor");
+            return false;
+        }
+        if (flags & (2 | 4 | 8))
+        {
+            close(segment);
+            send_status(fd, 400, 0, "shared memory carries a dense float64 waveform only");
+            return false;
+        }
+        req.inPlace = true;
+        bool more = serve_shared(fd, segment, inOffset, outOffset, req, arrived);
+        close(segment);
+        return more;
+    }
+
+    unique_ptr<SimulationRun> run;
+    try
+    {
+        run = core_.prepare(req);
+        run->admit();
+    }
+    catch (const ServiceError &e)
+    {
+        send_status(fd, e.status, (uint32_t)e.retryAfter, e.what());
+        return false;
+    }
+    if (!send_status(fd, 200, 0, ""))
+    {
+        return false;
+    }
+    requests_++;
+
+    string out;
+    SimulationRun::Sink sink = [&](const double *o, size_t n, vector<DetectionEvent> &events)
+    {
+        if (req.events)
+        {
+            size_t at = out.size();
+            out.resize(at + events.size() * EVENT_RECORD_BYTES);
+            for (size_t i = 0; i < events.size(); i++)
+            {
+                pack_event(events[i], &out[at + i * EVENT_RECORD_BYTES]);
+            }
+            events.clear();
+        }
+        else if (f32Out)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                put_le<float>(out, (float)o[i]);
+            }
+        }
+        else
+        {
+            out.append(reinterpret_cast<const char *>(o), n * sizeof(double));
+        }
+    };
+    ServiceMetrics *metrics = core_.metrics();
+    bool replied = false;
+    auto send_frame = [&]
+    {
+        if (metrics && !replied)
+        {
+            metrics->registry.observe(metrics->firstByte, ServiceMetrics::since(arrived));
+        }
+        replied = true;
+        string len;
+        put_le<uint32_t>(len, (uint32_t)out.size());
+        bool ok = write_all(fd, len.data(), len.size()) && write_all(fd, out.data(), out.size());
+        out.clear();
+        return ok;
+    };
+
+    const size_t sampleBytes = f32In ? sizeof(float) : sizeof(double);
+    vector<char> frame;
+    vector<double> widened;
+    for (;;)
+    {
+        uint32_t frameLen;
+        if (!read_all(fd, &frameLen, sizeof(frameLen)))
+        {
+            return false;
+        }
+        if (frameLen == 0)
+        {
+            break;
+        }
+        if (frameLen > MAX_FRAME_BYTES || frameLen % sampleBytes != 0)
+        {
+            return fail(fd, 400, "input frame length must be a multiple of the sample size, up to " +
+                                       to_string(MAX_FRAME_BYTES) + " bytes");
+        }
+        frame.resize(frameLen);
+        if (!read_all(fd, frame.data(), frameLen))
+        {
+            return false;
+        }
+        bytesIn_ += frameLen;
+        try
+        {
+            if (f32In)
+            {
+                size_t n = frameLen / sizeof(float);
+                widened.resize(n);
+                for (size_t i = 0; i < n; i++)
+                {
+                    widened[i] = get_le<float>(reinterpret_cast<const unsigned char *>(&frame[i * sizeof(float)]));
+                }
+                run->feed(reinterpret_cast<const char *>(widened.data()), n * sizeof(double), sink);
+            }
+            else
+            {
+                run->feed(frame.data(), frameLen, sink);
+            }
+        }
+        catch (const ServiceError &e)
+        {
+            return fail(fd, e.status, e.what());
+        }
+        if (!send_frame())
+        {
+            return false;
+        }
+    }
+
+    try
+    {
+        run->finish(sink);
+    }
+    catch (const ServiceError &e)
+    {
+        return fail(fd, e.status, e.what());
+    }
+    string trailer;
+    put_le<uint64_t>(trailer, run->samples());
+    put_le<uint64_t>(trailer, run->detections());
+    if (!send_frame() || !write_all(fd, trailer.data(), trailer.size()))
+    {
+        return false;
+    }
+    if (metrics)
+    {
+        metrics->registry.observe(metrics->latency, ServiceMetrics::since(arrived));
+    }
+    return true;
+}
+
+// A shared-memory request: the waveform is read from and the response written
+// to the client's segment in place.
+bool UnixSocketServer::serve_shared(int fd, int segment, uint64_t inOffset, uint64_t outOffset,
+                                    const SimulationRequest &req, chrono::steady_clock::time_point arrived)
+{
+    const uint64_t n = req.samples, bytes = n * sizeof(double);
+    struct stat st;
+    string invalid;
+    // The client keeps the segment open while it is mapped here; if it could
+    // still shrink it, touching the lost pages would SIGBUS the server. Only a
+    // memfd sealed against shrinking is accepted, and the seal is checked
+    // before the size so the size cannot change after it is read.
+    int seals = fcntl(segment, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK))
+    {
+        invalid = "the segment must be a memfd sealed with F_SEAL_SHRINK";
+    }
+    else if (fstat(segment, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        invalid = "the descriptor is not a shared-memory segment";
+    }
+    else if (n == 0 || n > MAX_SAMPLES || inOffset % sizeof(double) || outOffset % sizeof(double) ||
+             inOffset > (uint64_t)st.st_size || (uint64_t)st.st_size - inOffset < bytes ||
+             outOffset > (uint64_t)st.st_size || (uint64_t)st.st_size - outOffset < bytes ||
+             (inOffset < outOffset + bytes && outOffset < inOffset + bytes))
+    {
+        invalid = "shared-memory input and output must be disjoint, aligned ranges of the declared "
+                  "sample count (at most " + to_string(MAX_SAMPLES) + ") inside the segment";
+    }
+    if (!invalid.empty())
+    {
+        send_status(fd, 400, 0, invalid);
+        return false;
+    }
+
+    unique_ptr<SimulationRun> run;
+    try
+    {
+        run = core_.prepare(req);
+        run->admit();
+    }
+    catch (const ServiceError &e)
+    {
+        send_status(fd, e.status, (uint32_t)e.retryAfter, e.what());
+        return false;
+    }
+    void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment, 0);
+    if (map == MAP_FAILED)
+    {
+        send_status(fd, 400, 0, string("cannot map the segment: ") + strerror(errno));
+        return false;
+    }
+    if (!send_status(fd, 200, 0, ""))
+    {
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+    requests_++;
+    sharedRequests_++;
+
+    char *base = static_cast<char *>(map);
+    bool ok = true;
+    try
+    {
+        run->simulate(reinterpret_cast<const double *>(base + inOffset), reinterpret_cast<double *>(base + outOffset),
+                      (size_t)n);
+    }
+    catch (const ServiceError &e)
+    {
+        ok = fail(fd, e.status, e.what());
+    }
+    munmap(map, (size_t)st.st_size);
+    if (!ok)
+    {
+        return false;
+    }
+
+    // Completion: an empty last frame and the trailer.
+    string done;
+    put_le<uint32_t>(done, 0);
+    put_le<uint64_t>(done, run->samples());
+    put_le<uint64_t>(done, run->detections());
+    if (!write_all(fd, done.data(), done.size()))
+    {
+        return false;
+    }
+    // The whole reply lands at once, so first byte and end coincide.
+    if (ServiceMetrics *metrics = core_.metrics())
+    {
+        double seconds = ServiceMetrics::since(arrived);
+        metrics->registry.observe(metrics->firstByte, seconds);
+        metrics->registry.observe(metrics->latency, seconds);
+    }
+    return true;
+}
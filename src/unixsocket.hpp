@@ -0,0 +1,120 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "simcore.hpp"
+#include "threadpool.hpp"
+
+// Binary simulation protocol for co-located clients over a Unix domain socket,
+// served by the same SimulationCore as POST /simspad. All integers and floats
+// are little-endian; a connection carries any number of requests in turn.
+//
+// Request header (120 bytes):
+//    0  char[4]  "SSPQ"
+//    4  u16      version (1)
+//    6  u16      flags: 1 seeded, 2 float32 input, 4 events output, 8 float32 output,
+//                16 shared memory
+//    8  f64[10]  device parameters, dump_configuration() order
+//   88  f64      meanPhotonsPerDt (< 0: from the input)
+//   96  u64      seed (if flagged)
+//  104  u64      declared sample count (0 if unknown)
+//  112  u32      deadline in ms (0: none)
+//  116  u32      reserved (0)
+// Status reply (16 bytes + message): "SSPR", u16 version, u16 status (HTTP
+// code), u32 Retry-After seconds, u32 message length, message. On any status
+// but 200 the server then closes the connection.
+//
+// The waveform follows as input frames: u32 byte length + samples; a zero
+// length ends the input. Every input frame is answered by exactly one output
+// frame (u32 byte length + float64/float32 samples or 20-byte event records,
+// possibly empty while the initial prefix is held back), and the end of input
+// by a last output frame and a trailer (u64 samples, u64 detections). A frame
+// length of 0xFFFFFFFF instead announces an error: u16 status, u16 0, u32
+// message length, message, then the connection is closed.
+// Framed input may be of any length, so it is simulated as it arrives: without
+// a meanPhotonsPerDt the ages are seeded from the mean of the first 65536
+// samples, which are held back (answered by empty frames) until then. Send the
+// mean to seed from the whole waveform as POST /simspad does.
+//
+// Shared memory (flag 16, float64 dense only, declared count required): the
+// header is followed by a 16-byte descriptor (u64 input offset, u64 output
+// offset, both 8-byte aligned) sent with the segment's file descriptor as
+// SCM_RIGHTS ancillary data. The segment must be a memfd_create() file sealed
+// with F_SEAL_SHRINK (status 400 otherwise), so the client cannot truncate it
+// while it is mapped. The server reads the waveform from and writes the
+// response into the segment directly, so no samples cross the socket; after
+// the status reply it sends an empty output frame and the trailer as the
+// completion notification.
+class UnixSocketServer
+{
+public:
+    static constexpr std::size_t HEADER_BYTES = 120;
+    static constexpr std::uint32_t MAX_FRAME_BYTES = 16u << 20;
+    static constexpr std::uint32_t ERROR_FRAME = 0xFFFFFFFFu;
+
+    using Logger = std::function<void(const std::string &message)>;
+
+    // Listen on `path` (replacing a stale socket there), owner-only, serving
+    // up to `threads` connections at once.
+    UnixSocketServer(const std::string &path, SimulationCore &core, std::size_t threads, Logger log = nullptr);
+    ~UnixSocketServer();
+
+    // Stop accepting, let open connections finish their current request, and
+    // remove the socket file.
+    void stop();
+
+    struct Stats
+    {
+        unsigned long long connections, requests, bytesIn, sharedRequests;
+    };
+    Stats stats() const { return Stats{connections_.load(), requests_.load(), bytesIn_.load(), sharedRequests_.load()}; }
+
+    UnixSocketServer(UnixSocketServer const &) = delete;
+    void operator=(UnixSocketServer const &) = delete;
+
+private:
+    std::string path_;
+    SimulationCore &core_;
+    Logger log_;
+    int listenFd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::atomic<unsigned long long> connections_{0}, requests_{0}, bytesIn_{0}, sharedRequests_{0};
+    ComputePool workers_;
+    std::thread acceptor_;
+    std::mutex openMutex_;
+    std::set<int> open_; // connection sockets, shut down by stop()
+
+    void accept_loop();
+    void serve(int fd);
+    bool serve_one(int fd, const std::string &client);
+    bool fail(int fd, int status, const std::string &message);
+    bool serve_shared(int fd, int segment, std::uint64_t inOffset, std::uint64_t outOffset,
+                      const SimulationRequest &req, std::chrono::steady_clock::time_point arrived);
+};
+
+#endif // UNIX_SOCKET_H
@@ -30,8 +30,10 @@
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
+#include <algorithm>
 #include "sipm.hpp"
 #include "utilities.hpp"
+#include "simd.hpp"
 
 using namespace std;
 
@@ -113,24 +115,10 @@ vector<double> conv1d(vector<double> inputVec, vector<double> kernel)
         return inputVec;
     }
 
-    vector<double> outputVec = {};
-    outputVec.reserve(inputVec.size());
-    int innerPosition;
-
-    for (int i = 0; i < (int)inputVec.size(); i++)
-    {
-        outputVec.push_back(0.0);
-        for (int j = 0; j < kernelSize; j++)
-        {
-            innerPosition = i + j - kernelSize / 2;
-            // >= : valid indices are [0, size). The old `>` let innerPosition ==
-            // inputVec.size() through, reading one past the end (GHSA-px96-f638-vjfj).
-            if (!(innerPosition < 0 || (innerPosition >= (long)inputVec.size())))
-            {
-                outputVec[i] += kernel[j] * inputVec[innerPosition];
-            }
-        }
-    }
+    // Only taps inside [0, size) contribute (reading one past the end was
+    // GHSA-px96-f638-vjfj); see simd.cpp.
+    vector<double> outputVec(inputVec.size());
+    simd().convolve(inputVec.data(), inputVec.size(), kernel.data(), (size_t)kernelSize, outputVec.data());
     return outputVec;
 }
 
@@ -275,16 +263,21 @@ static void parse_npy_descr_shape(const string &hdr, string &descr, size_t &coun
         count = 0; // shape () -> scalar / empty
 }
 
-// Build a version-1.0 .npy header for a 1-D little-endian float64 array of
-// `count` elements, padded so the total preamble is a multiple of 64 bytes.
-static string build_npy_header(size_t count)
+// Build a version-1.0 .npy header for a 1-D little-endian array of `count`
+// elements of dtype `descr` (a Python literal, e.g. "'<f8'" or a structured
+// list), padded so the total preamble is a multiple of 64 bytes and at least
+// `minLen` bytes long. The floor lets a writer that does not know its final
+// count up-front reserve a header and rewrite it in place on close.
+static string build_npy_header(size_t count, const string &descr = "'<f8'", size_t minLen = 0)
 {
     ostringstream dict;
-    dict << "{'descr': '<f8', 'fortran_order': False, 'shape': (" << count << ",), }";
+    dict << "{'descr': " << descr << ", 'fortran_order': False, 'shape': (" << count << ",), }";
     string d = dict.str();
 
     size_t unpadded = 10 + d.size() + 1; // 6 magic + 2 version + 2 len + dict + '\n'
     size_t pad = (64 - (unpadded % 64)) % 64;
+    if (unpadded + pad < minLen)
+        pad = minLen - unpadded;
     d.append(pad, ' ');
     d.push_back('\n');
 
@@ -355,6 +348,14 @@ void NpyReader::rewind()
     fin.seekg(dataStart);
 }
 
+void NpyReader::seek(size_t sample)
+{
+    if (sample > nElems)
+        sample = nElems;
+    fin.clear();
+    fin.seekg(dataStart + (streamoff)(sample * sizeof(double)));
+}
+
 NpyWriter::NpyWriter(const string &filename, size_t count)
     : fout(filename, ios::binary)
 {
@@ -362,6 +363,7 @@ NpyWriter::NpyWriter(const string &filename, size_t count)
         throw runtime_error("cannot open .npy file for writing: " + filename);
     string hdr = build_npy_header(count);
     fout.write(hdr.data(), (streamsize)hdr.size());
+    dataOffset = hdr.size();
 }
 
 void NpyWriter::write(const double *buf, size_t n)
@@ -374,6 +376,199 @@ void NpyWriter::close()
     fout.close();
 }
 
+// Structured dtype of one packed (unaligned) 20-byte detection record.
+static const char *kEventDescr = "[('step', '<u8'), ('cell', '<u4'), ('charge', '<f8')]";
+
+NpyEventWriter::NpyEventWriter(const string &filename)
+    : fout(filename, ios::binary), nEvents(0)
+{
+    if (!fout)
+        throw runtime_error("cannot open .npy file for writing: " + filename);
+    // Reserve room for the widest possible count; close() rewrites it in place.
+    string hdr = build_npy_header(SIZE_MAX, kEventDescr);
+    headerLen = hdr.size();
+    fout.write(hdr.data(), (streamsize)hdr.size());
+}
+
+void NpyEventWriter::write(const DetectionEvent *events, size_t n)
+{
+    char rec[EVENT_RECORD_BYTES];
+    for (size_t i = 0; i < n; i++)
+    {
+        pack_event(events[i], rec);
+        fout.write(rec, EVENT_RECORD_BYTES);
+    }
+    nEvents += n;
+}
+
+void NpyEventWriter::close()
+{
+    if (!fout.is_open())
+        return;
+    string hdr = build_npy_header(nEvents, kEventDescr, headerLen);
+    fout.seekp(0);
+    fout.write(hdr.data(), (streamsize)hdr.size());
+    fout.close();
+}
+
+// ===========================================================================
+// Chunk index / min-max pyramid
+// ===========================================================================
+
+ChunkIndexWriter::ChunkIndexWriter(const string &filename, size_t dataOffset_in,
+                                   size_t binSamples_in, size_t factor_in)
+    : fout(filename, ios::binary), dataOffset(dataOffset_in),
+      binSamples(binSamples_in ? binSamples_in : 1), factor(factor_in > 1 ? factor_in : 2), total(0)
+{
+    if (!fout)
+        throw runtime_error("cannot open index file for writing: " + filename);
+}
+
+void ChunkIndexWriter::merge(Bin &b, double lo, double hi, size_t n)
+{
+    if (b.n == 0)
+    {
+        b.min = lo;
+        b.max = hi;
+    }
+    else
+    {
+        b.min = lo < b.min ? lo : b.min;
+        b.max = hi > b.max ? hi : b.max;
+    }
+    b.n += n;
+}
+
+// Append a completed bin to `level` and fold it into the parent's pending bin,
+// completing that in turn once it has merged `factor` children.
+void ChunkIndexWriter::push_bin(size_t level, double lo, double hi)
+{
+    if (levels.size() <= level)
+        levels.resize(level + 1);
+    if (pending.size() <= level + 1)
+        pending.resize(level + 2, Bin{0.0, 0.0, 0});
+    levels[level].push_back(lo);
+    levels[level].push_back(hi);
+
+    Bin &parent = pending[level + 1];
+    merge(parent, lo, hi, 1);
+    if (parent.n == factor)
+    {
+        Bin done = parent;
+        parent = Bin{0.0, 0.0, 0};
+        push_bin(level + 1, done.min, done.max);
+    }
+}
+
+void ChunkIndexWriter::add_chunk(const double *buf, size_t n, unsigned long long detections)
+{
+    if (n == 0)
+        return;
+    if (pending.empty())
+        pending.resize(1, Bin{0.0, 0.0, 0});
+
+    ChunkEntry e{(uint64_t)(dataOffset + total * sizeof(double)), (uint64_t)n, 0.0, buf[0], buf[0], (uint64_t)detections};
+    // In runs that fill the pending bottom-level bin.
+    for (size_t i = 0; i < n;)
+    {
+        size_t run = min(n - i, binSamples - pending[0].n);
+        ChunkSummary s = simd().summarise(buf + i, run);
+        e.sum += s.sum;
+        e.min = s.min < e.min ? s.min : e.min;
+        e.max = s.max > e.max ? s.max : e.max;
+
+        merge(pending[0], s.min, s.max, run);
+        if (pending[0].n == binSamples)
+        {
+            Bin done = pending[0];
+            pending[0] = Bin{0.0, 0.0, 0};
+            push_bin(0, done.min, done.max);
+        }
+        i += run;
+    }
+    chunks.push_back(e);
+    total += n;
+}
+
+void ChunkIndexWriter::close()
+{
+    if (!fout.is_open())
+        return;
+
+    // Flush partially filled bins bottom-up, stopping at the first level that
+    // holds a single bin (the root).
+    for (size_t k = 0; k < pending.size(); k++)
+    {
+        if (k > 0 && levels[k - 1].size() <= 2)
+            break;
+        if (pending[k].n > 0)
+        {
+            Bin done = pending[k];
+            pending[k] = Bin{0.0, 0.0, 0};
+            push_bin(k, done.min, done.max);
+        }
+    }
+    while (levels.size() > 1 && levels[levels.size() - 2].size() <= 2)
+        levels.pop_back(); // drop a level above the root
+
+    auto put64 = [&](uint64_t v) { fout.write(reinterpret_cast<const char *>(&v), 8); };
+    auto put32 = [&](uint32_t v) { fout.write(reinterpret_cast<const char *>(&v), 4); };
+    auto putf = [&](double v) { fout.write(reinterpret_cast<const char *>(&v), 8); };
+
+    fout.write("SSPDIDX\0", 8);
+    put32(1);
+    put32((uint32_t)levels.size());
+    put64(total);
+    put64(chunks.size());
+    put64(dataOffset);
+    put64(binSamples);
+    put64(factor);
+    for (const auto &c : chunks)
+    {
+        put64(c.offset);
+        put64(c.count);
+        putf(c.sum);
+        putf(c.min);
+        putf(c.max);
+        put64(c.detections);
+    }
+    uint64_t perBin = binSamples;
+    for (const auto &lvl : levels)
+    {
+        put64(lvl.size() / 2);
+        put64(perBin);
+        fout.write(reinterpret_cast<const char *>(lvl.data()), (streamsize)(lvl.size() * sizeof(double)));
+        perBin *= factor;
+    }
+    fout.close();
+}
+
+// Pack one event as little-endian step (u8), cell (u4), charge (f8), with no
+// padding -- the layout of kEventDescr and of the server's event stream.
+void pack_event(const DetectionEvent &e, char *rec)
+{
+    uint64_t step = (uint64_t)e.step;
+    uint32_t cell = (uint32_t)e.cell;
+    memcpy(rec, &step, 8);
+    memcpy(rec + 8, &cell, 4);
+    memcpy(rec + 12, &e.charge, 8);
+}
+
+// Re-densify an event list into charge-per-step samples: out[0..n) covers
+// steps [firstStep, firstStep + n) and is overwritten. Events outside the
+// window are ignored, so a long list can be expanded one window at a time.
+void densify_events(const vector<DetectionEvent> &events, unsigned long long firstStep, double *out, size_t n)
+{
+    fill(out, out + n, 0.0);
+    for (const auto &e : events)
+    {
+        if (e.step >= firstStep && e.step - firstStep < n)
+        {
+            out[e.step - firstStep] += e.charge;
+        }
+    }
+}
+
 // ===========================================================================
 // Flat-JSON device parameters
 // ===========================================================================
@@ -26,6 +26,7 @@
 #include <ctime>
 #include <tuple>
 #include <cstddef>
+#include <cstdint>
 #include <map>
 #include "sipm.hpp"
 
@@ -48,6 +49,7 @@ public:
     std::size_t count() const { return nElems; } // total number of doubles
     std::size_t read(double *buf, std::size_t n); // read up to n; returns count read
     void rewind();                                // seek back to the first sample
+    void seek(std::size_t sample);                // seek to an arbitrary sample
 private:
     std::ifstream fin;
     std::size_t nElems;
@@ -64,10 +66,75 @@ public:
     NpyWriter(const std::string &filename, std::size_t count);
     void write(const double *buf, std::size_t n);
     void close();
+    std::size_t data_offset() const { return dataOffset; } // byte offset of sample 0
 private:
     std::ofstream fout;
+    std::size_t dataOffset;
 };
 
+// Side-car index for a .npy response, written alongside an NpyWriter. It
+// records one entry per written chunk (byte offset into the .npy, sample
+// count, sum, min, max, detections) plus a min/max pyramid: level 0 holds one
+// bin per `binSamples` samples and each level above merges `factor` bins of
+// the one below, up to a single root bin. The pyramid is built incrementally
+// as chunks arrive; the file itself is written by close(). Layout (all
+// little-endian) -- see README "Chunk Index":
+//   "SSPDIDX\0", u32 version, u32 nLevels,
+//   u64 totalSamples, u64 nChunks, u64 dataOffset, u64 binSamples, u64 factor,
+//   nChunks x {u64 offset, u64 count, f64 sum, f64 min, f64 max, u64 detections},
+//   nLevels x {u64 nBins, u64 samplesPerBin, nBins x {f64 min, f64 max}}
+class ChunkIndexWriter
+{
+public:
+    ChunkIndexWriter(const std::string &filename, std::size_t dataOffset,
+                     std::size_t binSamples = 1024, std::size_t factor = 4);
+    void add_chunk(const double *buf, std::size_t n, unsigned long long detections);
+    void close();
+private:
+    struct ChunkEntry
+    {
+        std::uint64_t offset, count;
+        double sum, min, max;
+        std::uint64_t detections;
+    };
+    struct Bin
+    {
+        double min, max;
+        std::size_t n; // samples (level 0) or child bins (level > 0) merged so far
+    };
+    std::ofstream fout;
+    std::size_t dataOffset, binSamples, factor, total;
+    std::vector<ChunkEntry> chunks;
+    std::vector<std::vector<double>> levels; // interleaved min/max per completed bin
+    std::vector<Bin> pending;                // in-progress bin per level
+
+    void push_bin(std::size_t level, double lo, double hi);
+    void merge(Bin &b, double lo, double hi, std::size_t n);
+};
+
+// Streaming writer for a sparse detection-event list: a 1-D .npy structured
+// array of packed (step <u8, cell <u4, charge <f8) records. The event count
+// is not known until the run ends, so the header is reserved up-front and
+// rewritten by close(); close() must be called for a valid file.
+class NpyEventWriter
+{
+public:
+    explicit NpyEventWriter(const std::string &filename);
+    void write(const DetectionEvent *events, std::size_t n);
+    void close();
+    std::size_t count() const { return nEvents; }
+private:
+    std::ofstream fout;
+    std::size_t nEvents;
+    std::size_t headerLen;
+};
+
+constexpr std::size_t EVENT_RECORD_BYTES = 20; // packed bytes per DetectionEvent record
+
+void pack_event(const DetectionEvent &e, char *rec);
+
+void densify_events(const std::vector<DetectionEvent> &events, unsigned long long firstStep, double *out, std::size_t n);
+
 // Flat-JSON device parameters <-> SiPM.
 std::map<std::string, double> parse_flat_json(const std::string &text);
 SiPM load_params_json(const std::string &filename);
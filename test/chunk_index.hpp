@@ -0,0 +1,136 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+
+#include "../src/utilities.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+template <typename T>
+static T index_get(ifstream &f)
+{
+    T v{};
+    f.read(reinterpret_cast<char *>(&v), sizeof(T));
+    return v;
+}
+
+// Write a chunk index for a known waveform fed in uneven chunks, read it
+// back, and check the chunk table and every level of the min/max pyramid
+// against brute force over the samples each entry covers.
+bool TEST_chunk_index()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Chunk Index and Min/Max Pyramid" << endl;
+    cout << BAR_STRING << endl;
+
+    const size_t total = 100003, binSamples = 64, factor = 4, dataOffset = 128;
+    vector<double> x(total);
+    for (size_t i = 0; i < total; i++)
+    {
+        x[i] = sin(1e-3 * (double)i) + 0.25 * sin(0.7 * (double)i) + (i % 9973 == 0 ? 5.0 : 0.0);
+    }
+    const string path = (filesystem::temp_directory_path() / "simspad_test.idx").string();
+    vector<size_t> sizes;
+    {
+        ChunkIndexWriter writer(path, dataOffset, binSamples, factor);
+        for (size_t at = 0, k = 0; at < total; k++)
+        {
+            size_t n = min(total - at, (size_t)(1000 + (k * 7919) % 20000)); // not bin-aligned
+            writer.add_chunk(x.data() + at, n, k);
+            sizes.push_back(n);
+            at += n;
+        }
+        writer.close();
+    }
+
+    ifstream f(path, ios::binary);
+    char magic[8] = {};
+    f.read(magic, 8);
+    const uint32_t version = index_get<uint32_t>(f), nLevels = index_get<uint32_t>(f);
+    const uint64_t gotTotal = index_get<uint64_t>(f), nChunks = index_get<uint64_t>(f);
+    const uint64_t gotOffset = index_get<uint64_t>(f), gotBin = index_get<uint64_t>(f), gotFactor = index_get<uint64_t>(f);
+    bool header = memcmp(magic, "SSPDIDX\0", 8) == 0 && version == 1 && gotTotal == total && nChunks == sizes.size() &&
+                  gotOffset == dataOffset && gotBin == binSamples && gotFactor == factor;
+
+    bool chunks = header;
+    for (uint64_t c = 0, at = 0; chunks && c < nChunks; c++)
+    {
+        const uint64_t offset = index_get<uint64_t>(f), count = index_get<uint64_t>(f);
+        const double sum = index_get<double>(f), lo = index_get<double>(f), hi = index_get<double>(f);
+        const uint64_t detections = index_get<uint64_t>(f);
+        double s = 0.0, mn = x[at], mx = x[at];
+        for (uint64_t i = at; i < at + count && i < total; i++)
+        {
+            s += x[i];
+            mn = min(mn, x[i]);
+            mx = max(mx, x[i]);
+        }
+        chunks = offset == dataOffset + at * sizeof(double) && count == sizes[c] && fabs(sum - s) <= 1e-9 * (double)count &&
+                 lo == mn && hi == mx && detections == c;
+        at += count;
+    }
+
+    bool pyramid = chunks && nLevels > 1;
+    uint64_t lastBins = 0;
+    for (uint32_t level = 0; pyramid && level < nLevels; level++)
+    {
+        const uint64_t nBins = index_get<uint64_t>(f), perBin = index_get<uint64_t>(f);
+        pyramid = nBins == (total + perBin - 1) / perBin && (level == 0 ? perBin == binSamples : true);
+        for (uint64_t b = 0; pyramid && b < nBins; b++)
+        {
+            const double lo = index_get<double>(f), hi = index_get<double>(f);
+            const size_t from = (size_t)(b * perBin), to = (size_t)min<uint64_t>((b + 1) * perBin, total);
+            double mn = x[from], mx = x[from];
+            for (size_t i = from; i < to; i++)
+            {
+                mn = min(mn, x[i]);
+                mx = max(mx, x[i]);
+            }
+            pyramid = lo == mn && hi == mx;
+        }
+        lastBins = nBins;
+    }
+    pyramid = pyramid && lastBins == 1 && f.good() && f.peek() == EOF;
+    f.close();
+    remove(path.c_str());
+
+    cout << "Header" << (header ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    cout << "Chunk table (" << sizes.size() << " chunks)"
+         << (chunks ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    cout << "Min/max pyramid (" << nLevels << " levels, single root)"
+         << (pyramid ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    const bool passed_all = header && chunks && pyramid;
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Chunk Index and Min/Max Pyramid" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
@@ -23,6 +23,7 @@
 #include <cmath>
 
 #include "../src/sipm.hpp"
+#include "../src/estimator.hpp"
 #include "../src/utilities.hpp"
 #include "../src/constants.hpp"
 
@@ -32,27 +33,18 @@ using namespace std;
 
 double ibias_check(SiPM sipm, double photonsPerDt)
 {
-    int testSamples = 20000;
-    vector<double> in(testSamples, photonsPerDt); // DC light source
+    // Simulate until the 95% CI is within 2% of the mean (the bounds below
+    // are 25%), rather than for a fixed length
+    EstimatorOptions opts;
+    opts.relativeCi = 0.02;
+    opts.maxSamples = 2000000;
+    IbiasEstimate est = estimate_ibias(sipm, photonsPerDt, opts);
+    double Ibias = est.ibias;
 
-    vector<double> out = {};
-
-    bool silence = true;
-    out = sipm.simulate(in, silence);
-
-    // throw out first 10 RC times as statistics have not stabilised
-    int discard = (int)10 * (sipm.tauRecovery / sipm.dt);
-
-    double sumOut = 0;
-    for (int i = discard; i < (int)out.size(); i++)
-    {
-        sumOut += out[i];
-    }
-    double Ibias = sumOut / (((double)out.size() - (double)discard) * sipm.dt);
     double current_val;
     wstring current_prefix;
     tie(current_prefix, current_val) = exponent_val(Ibias);
-    wcout << L"Simulated Ibias: " << current_val << current_prefix << L"A";
+    wcout << L"Simulated Ibias: " << current_val << current_prefix << L"A (" << est.samples << L" samples)";
 
     return Ibias;
 }
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "../src/digest.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// SHA-256 of the FIPS 180-4 / NIST example messages, whole and fed in pieces
+// that straddle the 64-byte block and padding boundaries.
+bool TEST_digest()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: SHA-256 Known Answers" << endl;
+    cout << BAR_STRING << endl;
+
+    const string million(1000000, 'a');
+    const struct
+    {
+        const char *name;
+        string message;
+        const char *digest;
+    } vectors[] = {
+        {"empty", "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"448-bit", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+        {"896-bit",
+         "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+         "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+        {"million a", million, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+    };
+
+    bool passed_all = true;
+    for (const auto &v : vectors)
+    {
+        Sha256 whole;
+        whole.update(v.message);
+        const string a = whole.hex_digest();
+
+        Sha256 pieces;
+        for (size_t at = 0, piece = 1; at < v.message.size(); at += piece, piece = piece % 67 + 1)
+        {
+            pieces.update(v.message.data() + at, min(piece, v.message.size() - at));
+        }
+        const string b = pieces.hex_digest();
+
+        const bool passed = a == v.digest && b == v.digest;
+        cout << v.name << "  " << a << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+    }
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: SHA-256 Known Answers" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
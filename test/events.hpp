@@ -0,0 +1,94 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include "../src/sipm.hpp"
+#include "../src/utilities.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// The sparse detection-event list carries the whole response: densifying it
+// reproduces the dense output, window by window, and its records are in step
+// order with valid cells.
+bool TEST_events()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Detection Events vs Dense Output" << endl;
+    cout << BAR_STRING << endl;
+
+    SiPM sipm(14410, 24.5 + 3, 24.5, 2.2 * 14e-9, 0.0, 4.6e-14, 2.04, 0.46); // J30020
+    sipm.dt = 1E-10;
+    sipm.seed(2026);
+    const size_t n = 40000;
+    vector<double> in(n), out(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        in[i] = 2.0 + 1.5 * sin(2e-3 * (double)i); // varying light, not one DC chunk
+    }
+    vector<DetectionEvent> events;
+    sipm.set_event_sink(&events);
+    sipm.init_state(2.0, (unsigned long)n);
+    sipm.simulate_chunk(in.data(), out.data(), n);
+    sipm.set_event_sink(nullptr);
+
+    bool ordered = true;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        ordered = ordered && events[i].step < n && events[i].cell < sipm.numMicrocell &&
+                  (i == 0 || events[i - 1].step <= events[i].step);
+    }
+
+    // Densify in windows that do not divide the run evenly.
+    const size_t window = 7777;
+    vector<double> dense(window);
+    double worst = 0.0, peak = 0.0;
+    for (size_t first = 0; first < n; first += window)
+    {
+        const size_t m = min(window, n - first);
+        densify_events(events, first, dense.data(), m);
+        for (size_t i = 0; i < m; i++)
+        {
+            worst = max(worst, fabs(dense[i] - out[first + i]));
+            peak = max(peak, fabs(out[first + i]));
+        }
+    }
+
+    const bool counted = events.size() == sipm.detection_count() && !events.empty();
+    const bool matched = peak > 0.0 && worst <= 1e-12 * peak;
+    cout << "Events " << events.size() << ", detections " << sipm.detection_count()
+         << (counted ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    cout << "Events in step order with valid cells"
+         << (ordered ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    cout << "Densified events vs dense output, worst difference " << worst
+         << (matched ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    const bool passed_all = counted && ordered && matched;
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Detection Events vs Dense Output" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
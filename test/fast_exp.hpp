@@ -0,0 +1,77 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include "../src/sipm.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// Recovery::FastExp must meet the error bound it is configured with: the
+// polynomial's own truncation bound, and the measured voltage and PDE errors
+// against exact exp() over 0..20 tau, for two quite different devices.
+bool TEST_fast_exp()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Fast Exp Recovery Error Bounds" << endl;
+    cout << BAR_STRING << endl;
+
+    SiPM j30020(14410, 24.5 + 3, 24.5, 2.2 * 14e-9, 0.0, 4.6e-14, 2.04, 0.46);
+    SiPM slow(1000, 24.5 + 6, 24.5, 50e-9, 0.0, 4.6e-14, 1.0, 0.46); // Vover 6x Vchr
+    j30020.dt = slow.dt = 1E-10;
+
+    bool passed_all = true;
+    cout << scientific << setprecision(3);
+    for (SiPM *sipm : {&j30020, &slow})
+    {
+        for (double bound : {1e-2, 1e-3, 1e-6, 1e-9, 1e-12})
+        {
+            sipm->set_recovery(Recovery::FastExp, bound);
+            const RecoveryError err = sipm->recovery_error();
+            const ExpPolynomial &poly = sipm->exp_polynomial();
+            const bool passed = poly.bound <= bound && err.volt <= bound && err.pde <= bound;
+            cout << (sipm == &j30020 ? "J30020" : "slow  ") << "  bound " << bound << "   degree " << setw(2)
+                 << poly.degree << "   Vover error " << err.volt << "   PDE error " << err.pde
+                 << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+            passed_all = passed_all && passed;
+        }
+    }
+
+    // Exact has no error by definition; tighter bounds never lower the degree.
+    j30020.set_recovery(Recovery::Exact);
+    const RecoveryError exact = j30020.recovery_error();
+    const bool monotone = ExpPolynomial::for_error(1e-12).degree >= ExpPolynomial::for_error(1e-6).degree &&
+                          ExpPolynomial::for_error(1e-6).degree >= ExpPolynomial::for_error(1e-2).degree;
+    const bool passed = exact.volt == 0.0 && exact.pde == 0.0 && monotone;
+    cout << "Exact model error zero, degree monotone in bound"
+         << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    passed_all = passed_all && passed;
+    cout << defaultfloat;
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Fast Exp Recovery Error Bounds" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
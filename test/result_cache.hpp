@@ -0,0 +1,163 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+
+#include "../src/resultcache.hpp"
+#include "../src/digest.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// Cache keys are SHA-256 hex digests, as the server makes them.
+static string cache_key(const string &name)
+{
+    Sha256 h;
+    h.update(name);
+    return h.hex_digest();
+}
+
+// Compute-and-publish `key` as a body of `n` copies of `fill`; false unless it was a miss.
+static bool cache_put(ResultCache &cache, const string &key, size_t n, char fill)
+{
+    unique_ptr<ResultCache::Producer> producer;
+    if (cache.acquire(key, &producer) || !producer)
+    {
+        return false;
+    }
+    producer->publish(make_shared<const string>(n, fill));
+    return true;
+}
+
+// True if `key` is served from the cache with the expected body.
+static bool cache_hit(ResultCache &cache, const string &key, size_t n, char fill)
+{
+    unique_ptr<ResultCache::Producer> producer;
+    ResultCache::Result r = cache.acquire(key, &producer);
+    return r && !producer && *r == string(n, fill);
+}
+
+// Wait (bounded) until `n` requests are parked behind in-flight producers.
+static bool cache_coalesced(ResultCache &cache, unsigned long long n)
+{
+    for (int i = 0; i < 2000 && cache.stats().coalesced < n; i++)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return cache.stats().coalesced >= n;
+}
+
+// LRU eviction from memory, spill to disk and read back, the spill budget,
+// and coalescing of identical in-flight requests (including a producer that
+// gives up).
+bool TEST_result_cache()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Result Cache LRU, Spill and Coalescing" << endl;
+    cout << BAR_STRING << endl;
+
+    const string spillDir = (filesystem::temp_directory_path() / "simspad_test_spill").string();
+    bool passed_all = true;
+    {
+        ResultCache cache(3000, spillDir, 2500);
+        const string k1 = cache_key("1"), k2 = cache_key("2"), k3 = cache_key("3"), k4 = cache_key("4"),
+                     k5 = cache_key("5"), k6 = cache_key("6");
+
+        bool ok = cache_put(cache, k1, 1000, 'a') && cache_put(cache, k2, 1000, 'b') && cache_put(cache, k3, 1000, 'c');
+        ok = ok && cache_hit(cache, k1, 1000, 'a'); // k1 is now the most recently used
+        ok = ok && cache_put(cache, k4, 1000, 'd'); // evicts the least recently used, k2
+        ResultCache::Stats s = cache.stats();
+        ok = ok && s.entries == 3 && s.bytes == 3000 && s.evictions == 1 && s.spilledEntries == 1;
+        cout << "LRU eviction spills the least recently used" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        ok = cache_hit(cache, k2, 1000, 'b'); // read back; k3 makes room
+        s = cache.stats();
+        ok = ok && s.entries == 3 && s.spilledEntries == 1 && s.spilledBytes == 1000;
+        cout << "spilled body read back" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        // k1 and k4 spill after k3; 3000 bytes exceed the 2500 budget, so k3 goes.
+        ok = cache_put(cache, k5, 1000, 'e') && cache_put(cache, k6, 1000, 'f');
+        s = cache.stats();
+        ok = ok && s.spilledBytes <= 2500 && s.spilledEntries == 2;
+        ok = ok && cache_hit(cache, k1, 1000, 'a');
+        unique_ptr<ResultCache::Producer> producer;
+        ok = ok && !cache.acquire(k3, &producer) && producer; // dropped: a miss
+        producer.reset();
+        cout << "spill budget drops the oldest" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        // Coalescing: a second identical request waits for the first's result.
+        const string kc = cache_key("coalesce");
+        cache.acquire(kc, &producer);
+        ResultCache::Result waited;
+        thread follower([&]
+                        {
+                            unique_ptr<ResultCache::Producer> mine;
+                            waited = cache.acquire(kc, &mine);
+                        });
+        ok = producer && cache_coalesced(cache, 1);
+        producer->publish(make_shared<const string>(10, 'z'));
+        follower.join();
+        producer.reset();
+        ok = ok && waited && *waited == string(10, 'z') && cache.stats().misses == 8;
+        cout << "identical in-flight requests coalesced" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        // A producer that gives up hands the work to a waiter.
+        const string ka = cache_key("abandon");
+        cache.acquire(ka, &producer);
+        bool tookOver = false;
+        thread taker([&]
+                     {
+                         unique_ptr<ResultCache::Producer> mine;
+                         tookOver = !cache.acquire(ka, &mine) && mine;
+                     });
+        ok = producer && cache_coalesced(cache, 2);
+        producer.reset();
+        taker.join();
+        ok = ok && tookOver;
+        cout << "abandoned flight taken over" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        // A waiter gives up at its deadline, without taking the flight over.
+        const string kd = cache_key("deadline");
+        cache.acquire(kd, &producer);
+        unique_ptr<ResultCache::Producer> late;
+        ok = producer && !cache.acquire(kd, &late, chrono::steady_clock::now() + chrono::milliseconds(20)) && !late;
+        producer.reset();
+        cout << "coalesced wait honours the deadline" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+    }
+    filesystem::remove_all(spillDir);
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Result Cache LRU, Spill and Coalescing" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
@@ -0,0 +1,232 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+
+#include "../src/scheduler.hpp"
+#include "../src/service.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// Queue `requests` (client, work) behind a ticket that fills the only slot,
+// then release one admission at a time; returns the clients in the order
+// they were admitted.
+static vector<string> scheduler_order(AdmissionScheduler::Config config, const vector<pair<string, uint64_t>> &requests)
+{
+    config.slots = 1;
+    AdmissionScheduler scheduler(config);
+    vector<string> order;
+    vector<shared_ptr<AdmissionScheduler::Ticket>> running;
+    running.push_back(scheduler.admit("holder", 100, 0));
+    for (const auto &r : requests)
+    {
+        const string client = r.first;
+        scheduler.admit_async(client, r.second, 0, [&order, &running, client](shared_ptr<AdmissionScheduler::Ticket> t)
+                              {
+                                  order.push_back(client);
+                                  running.push_back(t);
+                              });
+    }
+    while (!running.empty())
+    {
+        shared_ptr<AdmissionScheduler::Ticket> t = running.back();
+        running.pop_back();
+        t.reset(); // frees the slot; the next admission is delivered here
+    }
+    return order;
+}
+
+// The admitted clients, space-separated.
+static string scheduler_names(const vector<string> &order)
+{
+    string names;
+    for (const string &c : order)
+    {
+        names += " " + c;
+    }
+    return names;
+}
+
+// Admission order of the weighted fair queue, withdrawal of queued requests,
+// and up-front refusal of requests that would wait too long.
+bool TEST_scheduler()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Admission Scheduler Fair Ordering" << endl;
+    cout << BAR_STRING << endl;
+
+    bool passed_all = true;
+    AdmissionScheduler::Config config;
+    config.maxQueueSeconds = 1e9;
+
+    // A client queueing three requests cannot hold back one that arrives after them.
+    vector<string> order = scheduler_order(config, {{"a", 100}, {"a", 100}, {"a", 100}, {"b", 100}});
+    bool passed = order == vector<string>{"a", "b", "a", "a"};
+    cout << "equal weights:" << scheduler_names(order) << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    passed_all = passed_all && passed;
+
+    // At three times the weight, a client gets three requests' worth per one of another's.
+    config.weights["heavy"] = 3.0;
+    order = scheduler_order(config, {{"light", 300}, {"heavy", 300}, {"heavy", 300}, {"heavy", 300}});
+    passed = order == vector<string>{"heavy", "heavy", "light", "heavy"};
+    cout << "weight 3 vs 1:" << scheduler_names(order) << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    passed_all = passed_all && passed;
+
+    // Requests are charged by work: a large one waits while another client's
+    // small ones add up to it, then goes ahead of the rest.
+    config.weights.clear();
+    order = scheduler_order(config, {{"big", 1000}, {"small", 250}, {"small", 250}, {"small", 250}, {"small", 250}, {"small", 250}});
+    passed = order == vector<string>{"small", "small", "small", "big", "small", "small"};
+    cout << "work-weighted:" << scheduler_names(order) << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    passed_all = passed_all && passed;
+
+    // Virtual time advances to the start tag of each admission, also for
+    // weighted clients, so a newcomer starts level with them rather than
+    // ahead: here "late" (finish tag 100 + 250) must follow heavy's third
+    // request (finish tag 300).
+    {
+        config.slots = 1;
+        config.weights["heavy"] = 3.0;
+        AdmissionScheduler scheduler(config);
+        vector<string> admitted;
+        vector<shared_ptr<AdmissionScheduler::Ticket>> held;
+        auto grant = [&](const string &client)
+        {
+            return [&admitted, &held, client](shared_ptr<AdmissionScheduler::Ticket> t)
+            {
+                admitted.push_back(client);
+                held.push_back(t);
+            };
+        };
+        auto release = [&]
+        {
+            shared_ptr<AdmissionScheduler::Ticket> t = held.front();
+            held.erase(held.begin());
+            t.reset(); // may grant the next request, which appends to `held`
+        };
+        held.push_back(scheduler.admit("holder", 100, 0));
+        for (int i = 0; i < 3; i++)
+        {
+            scheduler.admit_async("heavy", 300, 0, grant("heavy"));
+        }
+        release(); // heavy #1 admitted
+        release(); // heavy #2 admitted
+        scheduler.admit_async("late", 250, 0, grant("late"));
+        while (!held.empty())
+        {
+            release();
+        }
+        passed = admitted == vector<string>{"heavy", "heavy", "heavy", "late"};
+        cout << "virtual time:" << scheduler_names(admitted) << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+        config.weights.clear();
+    }
+
+    // Work transferred from a batch's admitting client to a lane's client is
+    // billed to the latter: here "b" queues behind it and "a" does not.
+    {
+        config.slots = 1;
+        AdmissionScheduler scheduler(config);
+        vector<string> admitted;
+        auto holder = scheduler.admit("a", 300, 0);
+        scheduler.transfer("a", "b", 300);
+        vector<shared_ptr<AdmissionScheduler::Ticket>> held;
+        for (const string client : {"b", "a"})
+        {
+            scheduler.admit_async(client, 100, 0, [&admitted, &held, client](shared_ptr<AdmissionScheduler::Ticket> t)
+                                  {
+                                      admitted.push_back(client);
+                                      held.push_back(t);
+                                  });
+        }
+        holder.reset();
+        while (!held.empty())
+        {
+            shared_ptr<AdmissionScheduler::Ticket> t = held.back();
+            held.pop_back();
+            t.reset();
+        }
+        passed = admitted == vector<string>{"a", "b"};
+        cout << "transfer:" << scheduler_names(admitted) << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+    }
+
+    // A withdrawn request is never admitted and leaves the queue.
+    {
+        config.slots = 1;
+        AdmissionScheduler scheduler(config);
+        auto holder = scheduler.admit("holder", 100, 0);
+        bool granted = false;
+        auto id = scheduler.admit_async("w", 100, 0, [&](shared_ptr<AdmissionScheduler::Ticket>)
+                                        { granted = true; });
+        const bool queued = scheduler.stats().queued == 1;
+        const bool withdrawn = scheduler.withdraw(id);
+        holder.reset();
+        passed = queued && withdrawn && !granted && scheduler.stats().queued == 0 && !scheduler.withdraw(id);
+        cout << "withdraw:" << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+    }
+
+    // Refusals: 429 when the estimated wait is too long, 503 when a deadline cannot be met.
+    {
+        AdmissionScheduler::Config slow;
+        slow.slots = 1;
+        slow.initialRate = 1.0; // microcell-steps/s: the holder takes 100 s
+        slow.maxQueueSeconds = 10.0;
+        AdmissionScheduler scheduler(slow);
+        auto holder = scheduler.admit("holder", 100, 0);
+        int status429 = 0, retryAfter = 0, status503 = 0;
+        try
+        {
+            scheduler.admit("late", 1, 0);
+        }
+        catch (const ServiceError &e)
+        {
+            status429 = e.status;
+            retryAfter = e.retryAfter;
+        }
+        slow.maxQueueSeconds = 1e9;
+        AdmissionScheduler patient(slow);
+        auto holder2 = patient.admit("holder", 100, 0);
+        try
+        {
+            patient.admit("late", 1, 0, chrono::steady_clock::now() + chrono::seconds(1));
+        }
+        catch (const ServiceError &e)
+        {
+            status503 = e.status;
+        }
+        passed = status429 == 429 && retryAfter >= 100 && status503 == 503;
+        cout << "refusals:" << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+    }
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Admission Scheduler Fair Ordering" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
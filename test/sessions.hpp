@@ -0,0 +1,136 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+
+#include "../src/sessions.hpp"
+#include "../src/service.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// The session state budget (reserved before allocation and released on
+// failure), idle eviction that spares busy sessions, and advances that
+// continue exactly where the previous one stopped.
+bool TEST_sessions()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Session Budget, Eviction and Continuity" << endl;
+    cout << BAR_STRING << endl;
+
+    // dt, numMicrocell, vBias, vBr, tauRecovery, pdeMax, vChr, cCell, tauFwhm, digitalThreshold
+    const vector<double> svars = {1e-10, 1000, 27.5, 24.5, 2.2 * 14e-9, 0.46, 2.04, 4.6e-14, 1e-9, 0.0};
+    const uint64_t perSession = 1000 * sizeof(double) + sizeof(SiPM);
+    bool passed_all = true;
+
+    {
+        SessionManager sessions(2 * perSession, chrono::seconds(3600));
+        auto a = sessions.create(svars, 2.0, nullptr);
+        auto b = sessions.create(svars, -1.0, nullptr);
+        int status = 0;
+        try
+        {
+            sessions.create(svars, 2.0, nullptr);
+        }
+        catch (const ServiceError &e)
+        {
+            status = e.status;
+        }
+        bool ok = status == 507 && sessions.stats().bytes == 2 * perSession;
+        ok = ok && sessions.remove(b->id) && sessions.create(svars, 2.0, nullptr);
+        cout << "budget refuses with 507, frees on remove" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+
+        // Failures after the reservation hand it back.
+        sessions.remove(a->id);
+        const uint64_t before = sessions.stats().bytes;
+        vector<double> bad = svars;
+        bad[1] = 0; // numMicrocell out of range
+        bool threw = false;
+        try
+        {
+            sessions.create(bad, 2.0, nullptr);
+        }
+        catch (const invalid_argument &)
+        {
+            threw = true;
+        }
+        int refused = 0;
+        try
+        {
+            sessions.create(svars, 2.0, nullptr, [](const SiPM &) -> shared_ptr<AdmissionScheduler::Ticket>
+                            { throw ServiceError(429, "busy"); });
+        }
+        catch (const ServiceError &e)
+        {
+            refused = e.status;
+        }
+        ok = threw && refused == 429 && sessions.stats().bytes == before && sessions.stats().sessions == 1;
+        cout << "bad parameters and refused admission release the budget" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+    }
+
+    {
+        // Zero idle timeout: anything idle goes at the next look.
+        SessionManager sessions(1ULL << 30, chrono::seconds(0));
+        auto busy = sessions.create(svars, 2.0, nullptr);
+        busy->active++; // as during an advance
+        auto idle = sessions.create(svars, 2.0, nullptr);
+        this_thread::sleep_for(chrono::milliseconds(2));
+        SessionManager::Stats s = sessions.stats();
+        const bool ok = s.sessions == 1 && s.evicted == 1 && sessions.find(busy->id) && !sessions.find(idle->id);
+        busy->active--;
+        cout << "idle sessions evicted, busy ones kept" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+    }
+
+    {
+        // Two advances of a seeded session match one run over both halves.
+        SessionManager sessions(1ULL << 30, chrono::seconds(3600));
+        const uint64_t seed = 33;
+        auto split = sessions.create(svars, 2.0, &seed);
+        auto whole = sessions.create(svars, 2.0, &seed);
+        const size_t n = 20000;
+        vector<double> in(2 * n), outSplit(2 * n), outWhole(2 * n);
+        for (size_t i = 0; i < 2 * n; i++)
+        {
+            in[i] = 2.0 + sin(1e-3 * (double)i);
+        }
+        const unsigned long long first0 = sessions.advance(*split, in.data(), outSplit.data(), n, nullptr);
+        const unsigned long long first1 = sessions.advance(*split, in.data() + n, outSplit.data() + n, n, nullptr);
+        sessions.advance(*whole, in.data(), outWhole.data(), 2 * n, nullptr);
+        const bool ok = first0 == 0 && first1 == n && outSplit == outWhole;
+        cout << "advances continue the microcell state" << (ok ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && ok;
+    }
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Session Budget, Eviction and Continuity" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
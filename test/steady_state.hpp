@@ -0,0 +1,87 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include "../src/sipm.hpp"
+#include "../src/estimator.hpp"
+#include "../src/constants.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// Compare the analytic steady-state response to the experimental bias
+// currents used by TEST_currents, and to Monte Carlo estimates (exact
+// recovery) simulated to a 1% confidence interval.
+bool TEST_steady_state()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Analytic Steady State vs Experiment and Monte Carlo" << endl;
+    cout << BAR_STRING << endl;
+    const vector<double> irradiances = {1e-4, 1e-3, 1e-2, 1e-1, 1e0};
+    const vector<double> expected_currents = {8.4519e-5, 8.0958e-4, 6.9938e-3, 31.4950e-3, 55.0066e-3}; // J30020 3V over
+    const double area = pow((3.07E-3), 2);
+    const double ePhoton = (speedOfLight * hPlanck) / 405E-9;
+    const double bounds[2] = {0.75, 1.25}; // against experiment, as TEST_currents
+    const double mcTolerance = 0.03;       // against Monte Carlo
+    EstimatorOptions mcOpts;               // simulated to a 1% CI
+    mcOpts.relativeCi = 0.01;
+
+    SiPM sipm(14410, 24.5 + 3, 24.5, 2.2 * 14e-9, 0.0, 4.6e-14, 2.04, 0.46); // J30020
+    sipm.dt = 1E-10;
+    sipm.set_recovery(Recovery::Exact);
+
+    bool passed_all = true;
+    cout << scientific << setprecision(4);
+    for (int i = 0; i < (int)irradiances.size(); i++)
+    {
+        const double photonsPerDt = sipm.dt * irradiances[i] * area / ePhoton;
+        const SteadyState ss = sipm.steady_state(photonsPerDt);
+        bool passed = (ss.ibias >= expected_currents[i] * bounds[0]) & (ss.ibias <= expected_currents[i] * bounds[1]);
+        cout << "Irradiance " << irradiances[i] << " W/m2   Expected " << expected_currents[i] << " A   Analytic "
+             << ss.ibias << " A";
+
+        const IbiasEstimate mc = estimate_ibias(sipm, photonsPerDt, mcOpts);
+        passed = passed & mc.converged & (fabs(mc.ibias / ss.ibias - 1) <= mcTolerance);
+        cout << "   Monte Carlo " << mc.ibias << " A";
+        cout << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all & passed;
+    }
+
+    // Dark limit: every photon meets a recharged cell
+    const SteadyState dark = sipm.steady_state(1e-9);
+    const double pdeFull = sipm.pdeMax * (1 - exp(-(sipm.vOver / sipm.vChr)));
+    const bool darkPassed = fabs(dark.effectivePde / pdeFull - 1) < 1e-6 && fabs(dark.meanOvervoltage / sipm.vOver - 1) < 1e-6;
+    cout << "Dark limit PDE " << dark.effectivePde << " (expected " << pdeFull << ")"
+         << (darkPassed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+    passed_all = passed_all & darkPassed;
+    cout << defaultfloat;
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Analytic Steady State vs Experiment and Monte Carlo" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}
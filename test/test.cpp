@@ -19,6 +19,15 @@
 #include <string>
 #include "performance.hpp"
 #include "current_accuracy.hpp"
+#include "steady_state.hpp"
+#include "wire_encoding.hpp"
+#include "digest.hpp"
+#include "scheduler.hpp"
+#include "fast_exp.hpp"
+#include "events.hpp"
+#include "chunk_index.hpp"
+#include "result_cache.hpp"
+#include "sessions.hpp"
 
 using namespace std;
 
@@ -39,6 +48,15 @@ int main()
 
     passed = passed && TEST_performance();
     passed = passed && TEST_currents();
+    passed = passed && TEST_steady_state();
+    passed = passed && TEST_wire_encoding();
+    passed = passed && TEST_digest();
+    passed = passed && TEST_scheduler();
+    passed = passed && TEST_fast_exp();
+    passed = passed && TEST_events();
+    passed = passed && TEST_chunk_index();
+    passed = passed && TEST_result_cache();
+    passed = passed && TEST_sessions();
 
     if (passed)
     {
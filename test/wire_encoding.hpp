@@ -0,0 +1,192 @@
+/*
+ * This file is part of the SimSPAD distribution (http://github.com/WillMatthews/SimSPAD).
+ * Copyright (c) 2022 William Matthews.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <cmath>
+
+#include "../src/encoding.hpp"
+#include "../src/service.hpp"
+
+#define BARS 102
+
+using namespace std;
+
+// Encode `x` in two blocks, then decode it fed in irregular pieces (so values
+// and block headers are split across reads) and return the worst absolute
+// error against the input, or -1 if the decoder threw or lost samples.
+static double wire_round_trip(const WireFormat &format, const vector<double> &x)
+{
+    string body;
+    const size_t half = x.size() / 2;
+    encode_samples(format, x.data(), half, body);
+    encode_samples(format, x.data() + half, x.size() - half, body);
+
+    vector<double> got;
+    try
+    {
+        WireDecoder decoder(format);
+        auto emit = [&](const double *y, size_t n)
+        { got.insert(got.end(), y, y + n); };
+        for (size_t at = 0, piece = 1; at < body.size(); at += piece, piece = piece % 37 + 1)
+        {
+            decoder.feed(body.data() + at, min(piece, body.size() - at), emit);
+        }
+        decoder.finish();
+    }
+    catch (const ServiceError &)
+    {
+        return -1.0;
+    }
+    if (got.size() != x.size())
+    {
+        return -1.0;
+    }
+    double worst = 0.0;
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        worst = max(worst, fabs(got[i] - x[i]));
+    }
+    return worst;
+}
+
+// True if decoding `body` in `format` is refused with a 400.
+static bool wire_rejected(const WireFormat &format, const string &body)
+{
+    try
+    {
+        WireDecoder decoder(format);
+        decoder.feed(body.data(), body.size(), [](const double *, size_t) {});
+        decoder.finish();
+    }
+    catch (const ServiceError &e)
+    {
+        return e.status == 400;
+    }
+    return false;
+}
+
+template <typename T>
+static void wire_put(string &out, T v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+// Round-trip every wire encoding through the incremental decoder within its
+// stated precision, and check that malformed bodies are refused.
+bool TEST_wire_encoding()
+{
+    string BAR_STRING(BARS, '=');
+    cout << BAR_STRING << endl;
+    cout << "BEGIN TEST: Wire Encodings Round Trip and Malformed Blocks" << endl;
+    cout << BAR_STRING << endl;
+
+    // A smooth waveform, and photon counts (integers, many repeats).
+    const size_t n = 20000;
+    vector<double> smooth(n), counts(n);
+    double peak = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        smooth[i] = 3.0 + 2.5 * sin(0.01 * (double)i) + 0.1 * cos(0.37 * (double)i);
+        counts[i] = (double)((i * 7919) % 13 < 4 ? (i * 31) % 5 : 0) + (i % 1000 == 0 ? 40000.0 : 0.0);
+        peak = max(peak, fabs(smooth[i]));
+    }
+    const double quantum = peak / 32767.0; // per-block scale bound for i16 and dvarint
+
+    bool passed_all = true;
+    auto check = [&](const string &name, bool passed)
+    {
+        cout << name << (passed ? "    \t\033[32;49;1mPASS\033[0m" : "      \t\033[31;49;1mFAIL\033[0m") << endl;
+        passed_all = passed_all && passed;
+    };
+
+    WireFormat f64, f32, i16, dvarint, counted;
+    f32.encoding = Encoding::F32;
+    i16.encoding = Encoding::I16;
+    dvarint.encoding = Encoding::DeltaVarint;
+    counted.encoding = Encoding::DeltaVarint;
+    counted.scale = 1.0;
+
+    double err = wire_round_trip(f64, smooth);
+    check("f64 round trip exact", err == 0.0);
+    err = wire_round_trip(f32, smooth);
+    check("f32 round trip within float precision", err >= 0.0 && err <= peak * 1.2e-7);
+    err = wire_round_trip(i16, smooth);
+    check("i16 round trip within half a quantum", err >= 0.0 && err <= 0.5 * quantum * (1 + 1e-9));
+    err = wire_round_trip(dvarint, smooth);
+    check("dvarint round trip within half a quantum", err >= 0.0 && err <= 0.5 * quantum * (1 + 1e-9));
+    err = wire_round_trip(counted, counts);
+    check("dvarint scale=1 photon counts lossless", err == 0.0);
+
+    // Negotiation.
+    WireFormat parsed = parse_wire_format("application/octet-stream; encoding=dvarint; scale=0.5", 415);
+    check("parse encoding and scale", parsed.encoding == Encoding::DeltaVarint && parsed.scale == 0.5);
+    check("non-octet-stream means f64", parse_wire_format("application/json", 415).encoding == Encoding::F64);
+    bool refused = false;
+    try
+    {
+        parse_wire_format("application/octet-stream; encoding=zstd", 415);
+    }
+    catch (const ServiceError &e)
+    {
+        refused = e.status == 415;
+    }
+    check("unknown encoding refused with the given status", refused);
+
+    // Malformed bodies.
+    string zeroScale;
+    wire_put<double>(zeroScale, 0.0);
+    wire_put<uint32_t>(zeroScale, 1);
+    wire_put<int16_t>(zeroScale, 1);
+    check("i16 block with zero scale", wire_rejected(i16, zeroScale));
+
+    string oversized;
+    wire_put<double>(oversized, 1.0);
+    wire_put<uint32_t>(oversized, MAX_BLOCK_SAMPLES + 1);
+    check("i16 block over MAX_BLOCK_SAMPLES", wire_rejected(i16, oversized));
+
+    string shortPayload;
+    wire_put<double>(shortPayload, 1.0);
+    wire_put<uint32_t>(shortPayload, 4);
+    wire_put<uint32_t>(shortPayload, 3); // fewer bytes than varints
+    shortPayload.append(3, '\0');
+    check("dvarint byte length below its sample count", wire_rejected(dvarint, shortPayload));
+
+    string overrun;
+    wire_put<double>(overrun, 1.0);
+    wire_put<uint32_t>(overrun, 1);
+    wire_put<uint32_t>(overrun, 2);
+    overrun.push_back('\x80'); // continuation byte, then the block ends mid-varint
+    overrun.push_back('\x80');
+    check("dvarint varint running past its block", wire_rejected(dvarint, overrun));
+
+    string truncated;
+    encode_samples(i16, smooth.data(), 100, truncated);
+    truncated.resize(truncated.size() - 3);
+    check("i16 body ending mid-block", wire_rejected(i16, truncated));
+    check("f32 body ending mid-value", wire_rejected(f32, string(6, '\0')));
+
+    string prefix = passed_all ? "\033[32;49;1m" : "\033[31;49;1m";
+    string outStatus = passed_all ? "PASS\n" : "FAIL\a\n";
+    cout << prefix << BAR_STRING << endl;
+    cout << prefix << "TEST " << outStatus;
+    cout << prefix << "END TEST: Wire Encodings Round Trip and Malformed Blocks" << endl;
+    cout << prefix << BAR_STRING << "\033[0m" << endl;
+    return passed_all;
+}